@@ -0,0 +1,402 @@
+#!/usr/bin/env python3
+
+# Copyright (c) 2017 Walter Kuppens
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+"""Runs the mlbf benchmark suite and writes the results as JSON.
+
+Every workload is executed on every engine. For each run the compile time, run
+time and peak RSS are recorded, along with IR dispatches per second for engines
+that count their own dispatches (currently only the interpreter). Other engines
+execute different code for the same program, so their dispatches are null.
+
+Usage: bench.py [--mlbf PATH] [--output PATH] [--baseline PATH] [--repeat N]
+"""
+
+import argparse
+import json
+import os
+import platform
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+ROOT_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+MLBF_PATH = os.path.join(ROOT_DIR, 'builddir', 'mlbf')
+CC = os.environ.get('CC', 'cc')
+CFLAGS = ['-O2']
+RSS_SAMPLE_INTERVAL = 0.002
+BATCH_RUNS = 16
+
+WORKLOADS = [
+    'examples/mandelbrot.b',
+    'examples/hanoi.b',
+    'bench/workloads/bench.b',
+    'bench/workloads/cat.b',
+    'tests/rot13.b',
+]
+
+
+def generate_text(size):
+    """Deterministic printable input used by the filter workloads."""
+
+    rng = random.Random(size)
+    alphabet = b'abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ \n'
+    return bytes(rng.choice(alphabet) for _ in range(size))
+
+
+# Workloads that read stdin get generated input so the benchmark doesn't
+# depend on files that are too large to keep in the repository.
+WORKLOAD_INPUTS = {
+    'bench/workloads/cat.b': lambda: generate_text(4 * 1024 * 1024),
+    'tests/rot13.b': lambda: generate_text(256 * 1024),
+}
+
+
+def read_peak_rss(pid):
+    """Reads VmHWM (peak RSS in KiB) of a running process, or None."""
+
+    try:
+        with open('/proc/{}/status'.format(pid), 'r') as f:
+            for line in f:
+                if line.startswith('VmHWM:'):
+                    return int(line.split()[1])
+    except (OSError, ValueError):
+        pass
+    return None
+
+
+def run_measured(args, stdin_data=None):
+    """Runs a command and returns (elapsed seconds, peak RSS KiB, stdout, stderr).
+
+    ru_maxrss can't be used for the peak RSS on Linux since it carries over the
+    high water mark of this (much larger) python process through exec. Instead
+    VmHWM is sampled while the child runs, which is exact for anything that
+    runs longer than the sampling interval.
+    """
+
+    with tempfile.TemporaryFile() as stdin, \
+            tempfile.TemporaryFile() as stdout, \
+            tempfile.TemporaryFile() as stderr:
+        if stdin_data:
+            stdin.write(stdin_data)
+            stdin.seek(0)
+
+        start = time.perf_counter()
+        process = subprocess.Popen(args, stdin=stdin, stdout=stdout, stderr=stderr)
+        peak_rss = None
+
+        while True:
+            pid, status, rusage = os.wait4(process.pid, os.WNOHANG)
+            if pid != 0:
+                break
+            peak_rss = read_peak_rss(process.pid) or peak_rss
+            time.sleep(RSS_SAMPLE_INTERVAL)
+
+        elapsed = time.perf_counter() - start
+        process.returncode = os.waitstatus_to_exitcode(status)
+
+        if process.returncode != 0:
+            stderr.seek(0)
+            raise RuntimeError("'{}' exited with code {}: {}".format(
+                ' '.join(args), process.returncode, stderr.read().decode(errors='replace')))
+
+        stdout.seek(0)
+        stderr.seek(0)
+        return elapsed, peak_rss or rusage.ru_maxrss, stdout.read(), stderr.read()
+
+
+def parse_bench_line(stderr):
+    """Extracts the JSON timing line printed by mlbf --bench."""
+
+    for line in reversed(stderr.decode(errors='replace').splitlines()):
+        if line.startswith('{'):
+            return json.loads(line)
+    raise RuntimeError('mlbf --bench did not print any timings.')
+
+
+def engine_interpreter(mlbf, script, stdin_data, workdir):
+    """Bytecode interpreter built into mlbf."""
+
+    _, _, output, stderr = run_measured([mlbf, '--bench', script], stdin_data)
+    timings = parse_bench_line(stderr)
+
+    return {
+        'compile_s': timings['compile_ns'] / 1e9,
+        'run_s': timings['run_ns'] / 1e9,
+        'peak_rss_kb': timings['peak_rss_kb'],
+        'dispatches': timings['dispatches'],
+    }, output
+
+
+def engine_jit(mlbf, script, stdin_data, workdir):
+    """Copy and patch JIT built into mlbf (mlbf --jit)."""
+
+    _, _, output, stderr = run_measured([mlbf, '--bench', '--jit', script], stdin_data)
+    timings = parse_bench_line(stderr)
+
+    return {
+        'compile_s': timings['compile_ns'] / 1e9,
+        'run_s': timings['run_ns'] / 1e9,
+        'peak_rss_kb': timings['peak_rss_kb'],
+    }, output
+
+
+def engine_lazy(mlbf, script, stdin_data, workdir):
+    """Interpreter optimizing each loop on first use (mlbf --lazy)."""
+
+    _, _, output, stderr = run_measured([mlbf, '--bench', '--lazy', script], stdin_data)
+    timings = parse_bench_line(stderr)
+
+    return {
+        'compile_s': timings['compile_ns'] / 1e9,
+        'run_s': timings['run_ns'] / 1e9,
+        'peak_rss_kb': timings['peak_rss_kb'],
+    }, output
+
+
+def engine_batch(mlbf, script, stdin_data, workdir):
+    """BATCH_RUNS runs of the same input in lockstep (mlbf --batch).
+
+    The run time is the time of the whole batch divided by the number of runs,
+    so that it can be compared with engines that run the input once.
+    """
+
+    inputs = []
+    for i in range(BATCH_RUNS):
+        inputs.append(os.path.join(workdir, 'input-{}'.format(i)))
+        with open(inputs[-1], 'wb') as f:
+            f.write(stdin_data or b'')
+
+    _, _, _, stderr = run_measured([mlbf, '--bench', '--batch', script] + inputs)
+    timings = parse_bench_line(stderr)
+
+    with open(inputs[0] + '.out', 'rb') as f:
+        output = f.read()
+    for path in inputs[1:]:
+        with open(path + '.out', 'rb') as f:
+            if f.read() != output:
+                raise RuntimeError("Batch runs of '{}' produced different output.".format(script))
+
+    return {
+        'compile_s': timings['compile_ns'] / 1e9,
+        'run_s': timings['run_ns'] / 1e9 / BATCH_RUNS,
+        'peak_rss_kb': timings['peak_rss_kb'],
+        'batch_runs': BATCH_RUNS,
+    }, output
+
+
+def engine_auto(mlbf, script, stdin_data, workdir):
+    """Whichever engine mlbf --engine auto picks."""
+
+    _, _, output, stderr = run_measured([mlbf, '--bench', '--engine', 'auto', script], stdin_data)
+    timings = parse_bench_line(stderr)
+
+    return {
+        'compile_s': timings['compile_ns'] / 1e9,
+        'run_s': timings['run_ns'] / 1e9,
+        'peak_rss_kb': timings['peak_rss_kb'],
+    }, output
+
+
+def engine_transpiler(mlbf, script, stdin_data, workdir):
+    """mlbf --output followed by a C compiler (ahead of time)."""
+
+    source = os.path.join(workdir, 'program.c')
+    binary = os.path.join(workdir, 'program')
+
+    transpile_s, _, _, _ = run_measured([mlbf, '--output', source, script])
+    cc_s, _, _, _ = run_measured([CC] + CFLAGS + [source, '-o', binary])
+    run_s, rss, output, _ = run_measured([binary], stdin_data)
+
+    return {
+        'compile_s': transpile_s + cc_s,
+        'run_s': run_s,
+        'peak_rss_kb': rss,
+    }, output
+
+
+def engine_assembler(mlbf, script, stdin_data, workdir):
+    """mlbf --assembly followed by as and ld (ahead of time)."""
+
+    source = os.path.join(workdir, 'program.s')
+    obj = os.path.join(workdir, 'program.o')
+    binary = os.path.join(workdir, 'program')
+
+    assemble_s, _, _, _ = run_measured([mlbf, '--assembly', source, script])
+    as_s, _, _, _ = run_measured(['as', source, '-o', obj])
+    ld_s, _, _, _ = run_measured(['ld', obj, '-o', binary])
+    run_s, rss, output, _ = run_measured([binary], stdin_data)
+
+    return {
+        'compile_s': assemble_s + as_s + ld_s,
+        'run_s': run_s,
+        'peak_rss_kb': rss,
+    }, output
+
+
+# New engines are registered here. Each entry returns a result dictionary and
+# the program output, which is compared against the interpreter's output.
+ENGINES = {
+    'interpreter': engine_interpreter,
+    'lazy': engine_lazy,
+    'jit': engine_jit,
+    'batch': engine_batch,
+    'auto': engine_auto,
+    'transpiler': engine_transpiler,
+    'assembler': engine_assembler,
+}
+
+
+def run_workload(mlbf, workload, engines, repeat):
+    script = os.path.join(ROOT_DIR, workload)
+    stdin_data = WORKLOAD_INPUTS.get(workload, lambda: None)()
+    results = []
+    reference = None
+
+    for name in engines:
+        best = None
+
+        for _ in range(repeat):
+            with tempfile.TemporaryDirectory() as workdir:
+                result, output = ENGINES[name](mlbf, script, stdin_data, workdir)
+
+            if reference is None:
+                reference = output
+            elif output != reference:
+                raise RuntimeError("Engine '{}' produced different output for '{}'.".format(
+                    name, workload))
+
+            if best is None or result['run_s'] < best['run_s']:
+                best = result
+
+        dispatches = best.setdefault('dispatches', None)
+        best['dispatches_per_s'] = dispatches / best['run_s'] if dispatches is not None and best['run_s'] > 0 else None
+
+        best.update(workload=workload, engine=name)
+        results.append(best)
+
+        print('{:<28} {:<12} compile {:>9.4f}s  run {:>9.4f}s  rss {:>7} KiB'.format(
+            workload, name, best['compile_s'], best['run_s'], best['peak_rss_kb']),
+            file=sys.stderr)
+
+    return results
+
+
+# Fields of a result compared against the baseline, with their printed names.
+BASELINE_FIELDS = [
+    ('compile_s', 'compile'),
+    ('run_s', 'run'),
+    ('peak_rss_kb', 'rss'),
+]
+
+
+def compare_to_baseline(results, baseline_path):
+    """Prints compile time, run time and peak RSS ratios against a previously
+    saved result file. Measurements missing on either side are left out."""
+
+    with open(baseline_path, 'r') as f:
+        baseline = json.load(f)
+
+    previous = {(r['workload'], r['engine']): r for r in baseline['results']}
+
+    print('\nCompared to {}:'.format(baseline_path), file=sys.stderr)
+    for result in results:
+        old = previous.get((result['workload'], result['engine']))
+        if old is None:
+            continue
+
+        ratios = {}
+        for key, _ in BASELINE_FIELDS:
+            if result.get(key) is not None and old.get(key):
+                ratios[key] = result[key] / old[key]
+        if not ratios:
+            continue
+
+        result['baseline_ratios'] = ratios
+        print('{:<28} {:<12} {}'.format(result['workload'], result['engine'], '  '.join(
+            '{} x{:.3f}'.format(label, ratios[key]) for key, label in BASELINE_FIELDS if key in ratios)),
+            file=sys.stderr)
+
+
+def jit_available(mlbf):
+    """mlbf is built without the JIT on hosts other than x86-64 ELF, in which
+    case --jit fails before running anything."""
+
+    with tempfile.NamedTemporaryFile(suffix='.b') as script:
+        return subprocess.run([mlbf, '--jit', script.name], stdin=subprocess.DEVNULL,
+                              stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL).returncode == 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Benchmarks mlbf engines.')
+    parser.add_argument('--mlbf', default=MLBF_PATH)
+    parser.add_argument('--output', default=None)
+    parser.add_argument('--baseline', default=None)
+    parser.add_argument('--repeat', type=int, default=1)
+    parser.add_argument('--engine', action='append', choices=sorted(ENGINES))
+    parser.add_argument('--workload', action='append')
+    args = parser.parse_args()
+
+    mlbf = os.path.abspath(args.mlbf)
+    if not os.path.isfile(mlbf):
+        raise RuntimeError("mlbf hasn't been compiled yet.")
+
+    engines = args.engine or list(ENGINES)
+    if 'jit' in engines and not jit_available(mlbf):
+        print('Skipping jit, mlbf was built without it.', file=sys.stderr)
+        engines.remove('jit')
+    if 'transpiler' in engines and shutil.which(CC) is None:
+        print("Skipping transpiler, '{}' wasn't found.".format(CC), file=sys.stderr)
+        engines.remove('transpiler')
+    if 'assembler' in engines and (shutil.which('as') is None or shutil.which('ld') is None
+                                   or platform.machine() != 'x86_64'):
+        print("Skipping assembler, it needs 'as' and 'ld' on x86-64.", file=sys.stderr)
+        engines.remove('assembler')
+
+    results = []
+    for workload in args.workload or WORKLOADS:
+        results.extend(run_workload(mlbf, workload, engines, max(args.repeat, 1)))
+
+    if args.baseline:
+        compare_to_baseline(results, args.baseline)
+
+    # meson runs targets from an unspecified directory, so default to the
+    # build directory it exports when one is available.
+    output = args.output or os.path.join(
+        os.environ.get('MESON_BUILD_ROOT', os.getcwd()), 'bench_results.json')
+
+    with open(output, 'w') as f:
+        json.dump({
+            'mlbf': mlbf,
+            'timestamp': int(time.time()),
+            'machine': platform.machine(),
+            'system': platform.platform(),
+            'results': results,
+        }, f, indent=2)
+
+    print('\nResults written to {}'.format(output), file=sys.stderr)
+
+
+if __name__ == '__main__':
+    main()
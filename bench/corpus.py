@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+
+# Copyright (c) 2017 Walter Kuppens
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+"""Generates synthetic brainfuck programs for compiler stress tests.
+
+Programs are built from fragments that exercise the compiler's pattern
+matching (clear, copy, mul and scan loops) mixed with deeply nested loops and
+plain arithmetic. Output is syntactically valid and deterministic for a given
+seed, but isn't meant to compute anything useful.
+
+Usage: corpus.py --size BYTES [--depth N] [--mix clear=1,mul=2,...] [--seed N]
+"""
+
+import argparse
+import random
+import sys
+
+FRAGMENTS = ('clear', 'copy', 'mul', 'scan', 'nest', 'arith')
+DEFAULT_MIX = 'clear=1,copy=1,mul=1,scan=1,nest=1,arith=2'
+
+
+def fragment_clear(rng, depth, max_depth, budget):
+    return '[-]'
+
+
+def fragment_copy(rng, depth, max_depth, budget):
+    targets = rng.randint(1, 4)
+    return '[-' + '>+' * targets + '<' * targets + ']'
+
+
+def fragment_mul(rng, depth, max_depth, budget):
+    targets = rng.randint(1, 4)
+    body = ''.join('>' + '+' * rng.randint(2, 9) for _ in range(targets))
+    return '[-' + body + '<' * targets + ']'
+
+
+def fragment_scan(rng, depth, max_depth, budget):
+    return '[' + rng.choice('<>') * rng.randint(1, 9) + ']'
+
+
+def fragment_arith(rng, depth, max_depth, budget):
+    out = []
+    for _ in range(rng.randint(1, 6)):
+        out.append(rng.choice('+-<>') * rng.randint(1, 12))
+    if rng.random() < 0.1:
+        out.append('.')
+    return ''.join(out)
+
+
+def fragment_nest(rng, depth, max_depth, budget):
+    """A loop around more fragments, up to the maximum nesting depth.
+
+    Children share the byte budget of their parent, which keeps nest heavy
+    mixes close to --size instead of growing exponentially with the depth.
+    """
+
+    if depth >= max_depth or budget < 8:
+        return fragment_arith(rng, depth, max_depth, budget)
+
+    body = []
+    remaining = budget - 3
+    while remaining > 0:
+        child = generate_fragment(rng, depth + 1, max_depth, remaining)
+        body.append(child)
+        remaining -= len(child)
+
+        if rng.random() < 0.5:
+            break
+
+    return '+[' + ''.join(body) + '-]'
+
+
+def generate_fragment(rng, depth, max_depth, budget):
+    kind = rng.choices(FRAGMENTS, weights=generate_fragment.weights)[0]
+    return globals()['fragment_' + kind](rng, depth, max_depth, budget)
+
+
+def parse_mix(mix):
+    weights = dict.fromkeys(FRAGMENTS, 0)
+
+    for item in mix.split(','):
+        name, _, weight = item.partition('=')
+        if name not in weights:
+            raise ValueError("Unknown fragment '{}', expected one of {}.".format(
+                name, ', '.join(FRAGMENTS)))
+        weights[name] = float(weight or 1)
+
+    if not any(weights.values()):
+        raise ValueError('At least one fragment needs a non-zero weight.')
+
+    return [weights[name] for name in FRAGMENTS]
+
+
+def generate_program(size, depth=8, mix=DEFAULT_MIX, seed=0):
+    """Returns a program of roughly 'size' bytes with loops nested at most
+    'depth' levels deep."""
+
+    rng = random.Random(seed)
+    generate_fragment.weights = parse_mix(mix)
+    out = []
+    length = 0
+
+    while length < size:
+        fragment = generate_fragment(rng, 0, depth, size - length)
+        out.append(fragment)
+        length += len(fragment)
+
+        if rng.random() < 0.05:
+            out.append('\n')
+            length += 1
+
+    return ''.join(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Generates brainfuck stress tests.')
+    parser.add_argument('--size', type=int, required=True, help='Approximate size in bytes.')
+    parser.add_argument('--depth', type=int, default=8, help='Maximum loop nesting.')
+    parser.add_argument('--mix', default=DEFAULT_MIX,
+                        help='Comma separated fragment weights ({}).'.format(', '.join(FRAGMENTS)))
+    parser.add_argument('--seed', type=int, default=0)
+    parser.add_argument('--output', default=None)
+    args = parser.parse_args()
+
+    program = generate_program(args.size, args.depth, args.mix, args.seed)
+
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(program)
+    else:
+        sys.stdout.write(program)
+
+
+if __name__ == '__main__':
+    main()
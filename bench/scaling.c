@@ -0,0 +1,180 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Compiler scaling harness. Times every compiler phase on the given brainfuck
+// sources and prints one JSON object per file to stdout. bench/scaling.py
+// feeds it generated programs of growing size to spot super-linear phases.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "compiler.h"
+#include "patterns.h"
+#include "program.h"
+#include "utils.h"
+
+#define SCALING_REPEAT 3
+
+#define PATTERN_LENGTH(pattern) (sizeof(pattern) / sizeof(pattern[0]))
+
+/**
+ * Runs every phase of 'bf_compile' separately and records the fastest of
+ * SCALING_REPEAT runs for each of them. Returns false if compilation fails,
+ * which is also reported in the JSON output.
+ */
+bool scaling_measure_compile(const char *src)
+{
+    const struct bf_optimization_pass *pass;
+    struct bf_program *program;
+    uint64_t start, elapsed;
+    uint64_t unoptimized_ns = UINT64_MAX;
+    uint64_t pass_ns[BF_COMPILE_STATS_PASSES];
+    size_t pass_size[BF_COMPILE_STATS_PASSES];
+    size_t unoptimized_size = 0;
+    int pass_count = 0;
+
+    for (pass = bf_optimization_passes; pass->name; pass++) {
+        pass_ns[pass_count++] = UINT64_MAX;
+    }
+
+    for (int r = 0; r < SCALING_REPEAT; r++) {
+        program = bf_program_create();
+        if (!program) {
+            return false;
+        }
+
+        start = bf_perf_time_ns();
+        if (!bf_unoptimized_pass(program, src)) {
+            bf_program_destroy(program);
+            printf("\"error\": \"unoptimized pass failed\"");
+            return false;
+        }
+        elapsed = bf_perf_time_ns() - start;
+        unoptimized_ns = elapsed < unoptimized_ns ? elapsed : unoptimized_ns;
+        unoptimized_size = program->size;
+
+        for (int i = 0; i < pass_count; i++) {
+            start = bf_perf_time_ns();
+            if (!bf_optimization_passes[i].run(program)) {
+                bf_program_destroy(program);
+                printf("\"error\": \"%s failed\"", bf_optimization_passes[i].name);
+                return false;
+            }
+            elapsed = bf_perf_time_ns() - start;
+            pass_ns[i] = elapsed < pass_ns[i] ? elapsed : pass_ns[i];
+            pass_size[i] = program->size;
+        }
+
+        bf_program_destroy(program);
+    }
+
+    printf("\"unoptimized\": {\"ns\": %" PRIu64 ", \"ir\": %zu}", unoptimized_ns, unoptimized_size);
+    for (int i = 0; i < pass_count; i++) {
+        printf(", \"%s\": {\"ns\": %" PRIu64 ", \"ir\": %zu}",
+            bf_optimization_passes[i].name, pass_ns[i], pass_size[i]);
+    }
+
+    return true;
+}
+
+/**
+ * Calls 'bf_program_match_sequence' with every loop pattern at every position
+ * of the IR that pass 2 sees. This isolates the matcher from the rewriting
+ * done by the passes themselves.
+ */
+void scaling_measure_match(const char *src)
+{
+    struct bf_program *program;
+    uint64_t start;
+    uint64_t best_ns = UINT64_MAX;
+    uint64_t calls = 0;
+    uint64_t matches = 0;
+
+    program = bf_program_create();
+    if (!program) {
+        return;
+    }
+    if (!bf_unoptimized_pass(program, src) || !bf_optimization_pass_1(program)) {
+        bf_program_destroy(program);
+        return;
+    }
+
+    for (int r = 0; r < SCALING_REPEAT; r++) {
+        calls = 0;
+        matches = 0;
+
+        start = bf_perf_time_ns();
+        for (int i = 0; i < program->size; i++) {
+            matches += bf_program_match_sequence(program, bf_pattern_clear, i, PATTERN_LENGTH(bf_pattern_clear)) != 0;
+            matches += bf_program_match_sequence(program, bf_pattern_copy, i, PATTERN_LENGTH(bf_pattern_copy)) != 0;
+            matches += bf_program_match_sequence(program, bf_pattern_mul, i, PATTERN_LENGTH(bf_pattern_mul)) != 0;
+            calls += 3;
+        }
+        start = bf_perf_time_ns() - start;
+        best_ns = start < best_ns ? start : best_ns;
+    }
+
+    printf(", \"match_sequence\": {\"ns\": %" PRIu64 ", \"calls\": %" PRIu64 ", \"matches\": %" PRIu64 "}",
+        best_ns, calls, matches);
+
+    bf_program_destroy(program);
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *fp;
+    char *src;
+    uint64_t start, read_ns;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: mlbf-scaling [script...]\n");
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        fp = fopen(argv[i], "r");
+        if (fp == NULL) {
+            fprintf(stderr, "Unable to open file '%s'.\n", argv[i]);
+            return 1;
+        }
+
+        start = bf_perf_time_ns();
+        src = bf_read_file(fp, FILE_ALLOC_SIZE);
+        read_ns = bf_perf_time_ns() - start;
+        fclose(fp);
+        if (src == NULL) {
+            fprintf(stderr, "Unable to read source code.\n");
+            return 1;
+        }
+
+        printf("{\"file\": \"%s\", \"bytes\": %zu, \"read_file\": {\"ns\": %" PRIu64 "}, ",
+            argv[i], strlen(src), read_ns);
+        if (scaling_measure_compile(src)) {
+            scaling_measure_match(src);
+        }
+        printf("}\n");
+        fflush(stdout);
+
+        free(src);
+    }
+
+    return 0;
+}
@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+
+# Copyright (c) 2017 Walter Kuppens
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+"""Measures how each compiler phase scales with input size.
+
+Programs from corpus.py are generated at doubling sizes and timed phase by
+phase with the mlbf-scaling harness. For every phase the growth exponent
+between consecutive sizes is printed: ~1.0 is linear, ~2.0 quadratic. Phases
+whose exponent exceeds --threshold are flagged.
+
+Usage: scaling.py [--harness PATH] [--min BYTES] [--max BYTES] [--depth N]
+                  [--mix SPEC] [--output PATH]
+"""
+
+import argparse
+import json
+import math
+import os
+import subprocess
+import sys
+import tempfile
+
+import corpus
+
+ROOT_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+HARNESS_PATH = os.path.join(ROOT_DIR, 'builddir', 'mlbf-scaling')
+
+# Phases below this many nanoseconds are too noisy to derive an exponent from.
+MIN_SIGNIFICANT_NS = 200000
+
+
+def measure(harness, path):
+    output = subprocess.check_output([harness, path])
+    return json.loads(output.decode().splitlines()[-1])
+
+
+def phases(result):
+    """Yields (name, nanoseconds) for every timed phase in a harness result."""
+
+    for name, value in result.items():
+        if isinstance(value, dict) and 'ns' in value:
+            yield name, value['ns']
+
+
+def report(results, threshold):
+    flagged = set()
+    names = [name for name, _ in phases(results[0])]
+
+    print('{:>10}  {}'.format('bytes', '  '.join('{:>16}'.format(n) for n in names)))
+
+    for previous, current in zip([None] + results, results):
+        cells = []
+        for name in names:
+            ns = current.get(name, {}).get('ns')
+            if ns is None:
+                cells.append('{:>16}'.format('-'))
+                continue
+
+            exponent = ''
+            if previous is not None and name in previous:
+                old = previous[name]['ns']
+                if ns >= MIN_SIGNIFICANT_NS and old > 0:
+                    k = math.log(ns / old) / math.log(current['bytes'] / previous['bytes'])
+                    exponent = '^{:.2f}'.format(k)
+                    if k > threshold:
+                        exponent += '!'
+                        flagged.add(name)
+
+            cells.append('{:>16}'.format('{:.2f}ms{}'.format(ns / 1e6, exponent)))
+
+        line = '{:>10}  {}'.format(current['bytes'], '  '.join(cells))
+        if 'error' in current:
+            line += '  ({})'.format(current['error'])
+        print(line)
+
+    if flagged:
+        print('\nSuper-linear phases (exponent > {}): {}'.format(threshold, ', '.join(sorted(flagged))))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Measures compiler scaling.')
+    parser.add_argument('--harness', default=HARNESS_PATH)
+    parser.add_argument('--min', type=int, default=4096)
+    parser.add_argument('--max', type=int, default=1024 * 1024)
+    parser.add_argument('--depth', type=int, default=8)
+    parser.add_argument('--mix', default=corpus.DEFAULT_MIX)
+    parser.add_argument('--seed', type=int, default=0)
+    parser.add_argument('--threshold', type=float, default=1.3)
+    parser.add_argument('--output', default=None)
+    args = parser.parse_args()
+
+    if not os.path.isfile(args.harness):
+        raise RuntimeError("mlbf-scaling hasn't been compiled yet.")
+
+    results = []
+    size = args.min
+
+    with tempfile.TemporaryDirectory() as workdir:
+        while size <= args.max:
+            path = os.path.join(workdir, 'corpus-{}.b'.format(size))
+            with open(path, 'w') as f:
+                f.write(corpus.generate_program(size, args.depth, args.mix, args.seed))
+
+            result = measure(args.harness, path)
+            result['file'] = 'corpus-{}.b'.format(size)
+            results.append(result)
+            print('Measured {} bytes'.format(result['bytes']), file=sys.stderr)
+
+            size *= 2
+
+    report(results, args.threshold)
+
+    output = args.output or os.path.join(
+        os.environ.get('MESON_BUILD_ROOT', os.getcwd()), 'scaling_results.json')
+    with open(output, 'w') as f:
+        json.dump({'depth': args.depth, 'mix': args.mix, 'results': results}, f, indent=2)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,7 @@
+[
+    Nested counting loops around a short output routine; a common interpreter
+    benchmark. Prints the alphabet backwards followed by a newline.
+]
+>++[<+++++++++++++>-]<[[>+>+<<-]>[<+>-]++++++++[>++++++++<-]>.[-]<<
+>++++++++++[>++++++++++[>++++++++++[>++++++++++[>++++++++++[>++++++++++[>++++
+++++++[-]<-]<-]<-]<-]<-]<-]<-]++++++++++.
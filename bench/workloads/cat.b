@@ -0,0 +1,4 @@
+[
+    Copies stdin to stdout until EOF. Measures raw I/O dispatch throughput.
+]
+,[.[-],]
@@ -0,0 +1,537 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "assembler.h"
+#include "interpreter.h"
+#include "program.h"
+#include "utils.h"
+
+/** Size of the buffers used by the generated program for input and output. */
+#define BF_ASSEMBLE_BUFFER_SIZE 65536
+
+/** Constants used by the rest of the generated assembly. */
+static const char bf_assemble_header[] = "# Generated by mlbf - https://github.com/Reshurum/mlbf\n"
+                                         "#\n"
+                                         "# %%rbx holds the pointer and %%r12 the middle copy of memory.\n"
+                                         "\n"
+                                         "    .set MEMORY_SIZE, %d\n"
+                                         "    .set BUFFER_SIZE, %d\n"
+                                         "    .set SYS_READ, 0\n"
+                                         "    .set SYS_WRITE, 1\n"
+                                         "    .set SYS_CLOSE, 3\n"
+                                         "    .set SYS_MMAP, 9\n"
+                                         "    .set SYS_EXIT, 60\n"
+                                         "    .set SYS_FTRUNCATE, 77\n"
+                                         "    .set SYS_MEMFD_CREATE, 319\n"
+                                         "    .set EINTR, 4\n";
+
+/**
+ * Memory, buffered I/O through system calls and the entry point. Memory is
+ * mapped the same way as in generated C, see 'bf_transpile_header'.
+ */
+static const char bf_assemble_runtime[] = "\n"
+                                          "    .bss\n"
+                                          "    .align 65536\n"
+                                          "copies:\n"
+                                          "    .zero 3 * MEMORY_SIZE\n"
+                                          "output:\n"
+                                          "    .zero BUFFER_SIZE\n"
+                                          "output_size:\n"
+                                          "    .zero 8\n"
+                                          "input:\n"
+                                          "    .zero BUFFER_SIZE\n"
+                                          "input_size:\n"
+                                          "    .zero 8\n"
+                                          "input_position:\n"
+                                          "    .zero 8\n"
+                                          "\n"
+                                          "    .section .rodata\n"
+                                          "memfd_name:\n"
+                                          "    .asciz \"mlbf\"\n"
+                                          "map_error:\n"
+                                          "    .ascii \"Unable to map memory\\n\"\n"
+                                          "map_error_end:\n"
+                                          "\n"
+                                          "    .text\n"
+                                          "\n"
+                                          "# Maps the middle of 'copies' over both of its ends.\n"
+                                          "map_memory:\n"
+                                          "    mov $SYS_MEMFD_CREATE, %eax\n"
+                                          "    lea memfd_name(%rip), %rdi\n"
+                                          "    xor %esi, %esi\n"
+                                          "    syscall\n"
+                                          "    test %eax, %eax\n"
+                                          "    js 2f\n"
+                                          "    mov %eax, %r13d\n"
+                                          "    mov $SYS_FTRUNCATE, %eax\n"
+                                          "    mov %r13d, %edi\n"
+                                          "    mov $MEMORY_SIZE, %esi\n"
+                                          "    syscall\n"
+                                          "    test %rax, %rax\n"
+                                          "    jnz 2f\n"
+                                          "    lea copies(%rip), %r14\n"
+                                          "    mov $3, %r15d\n"
+                                          "1:\n"
+                                          "    mov $SYS_MMAP, %eax\n"
+                                          "    mov %r14, %rdi\n"
+                                          "    mov $MEMORY_SIZE, %esi\n"
+                                          "    mov $3, %edx # PROT_READ | PROT_WRITE\n"
+                                          "    mov $0x11, %r10d # MAP_SHARED | MAP_FIXED\n"
+                                          "    mov %r13d, %r8d\n"
+                                          "    xor %r9d, %r9d\n"
+                                          "    syscall\n"
+                                          "    cmp $-4096, %rax\n"
+                                          "    ja 2f\n"
+                                          "    add $MEMORY_SIZE, %r14\n"
+                                          "    dec %r15d\n"
+                                          "    jnz 1b\n"
+                                          "    mov $SYS_CLOSE, %eax\n"
+                                          "    mov %r13d, %edi\n"
+                                          "    syscall\n"
+                                          "    ret\n"
+                                          "2:\n"
+                                          "    mov $SYS_WRITE, %eax\n"
+                                          "    mov $2, %edi\n"
+                                          "    lea map_error(%rip), %rsi\n"
+                                          "    mov $map_error_end - map_error, %edx\n"
+                                          "    syscall\n"
+                                          "    mov $SYS_EXIT, %eax\n"
+                                          "    mov $1, %edi\n"
+                                          "    syscall\n"
+                                          "\n"
+                                          "flush_output:\n"
+                                          "    xor %r8d, %r8d\n"
+                                          "1:\n"
+                                          "    mov output_size(%rip), %rdx\n"
+                                          "    sub %r8, %rdx\n"
+                                          "    jz 2f\n"
+                                          "    mov $SYS_WRITE, %eax\n"
+                                          "    mov $1, %edi\n"
+                                          "    lea output(%rip), %rsi\n"
+                                          "    add %r8, %rsi\n"
+                                          "    syscall\n"
+                                          "    cmp $-EINTR, %rax\n"
+                                          "    je 1b\n"
+                                          "    test %rax, %rax\n"
+                                          "    jle 2f\n"
+                                          "    add %rax, %r8\n"
+                                          "    jmp 1b\n"
+                                          "2:\n"
+                                          "    movq $0, output_size(%rip)\n"
+                                          "    ret\n"
+                                          "\n"
+                                          "# Appends %al to the output buffer.\n"
+                                          "write_output:\n"
+                                          "    mov output_size(%rip), %rcx\n"
+                                          "    lea output(%rip), %rdx\n"
+                                          "    mov %al, (%rdx,%rcx)\n"
+                                          "    inc %rcx\n"
+                                          "    mov %rcx, output_size(%rip)\n"
+                                          "    cmp $BUFFER_SIZE, %rcx\n"
+                                          "    je flush_output\n"
+                                          "    ret\n"
+                                          "\n"
+                                          "# Appends %rdx bytes from %rsi to the output buffer. %r13 and %r14 are only\n"
+                                          "# used by map_memory otherwise.\n"
+                                          "write_string:\n"
+                                          "    mov %rsi, %r13\n"
+                                          "    lea (%rsi,%rdx), %r14\n"
+                                          "1:\n"
+                                          "    movzbl (%r13), %eax\n"
+                                          "    inc %r13\n"
+                                          "    call write_output\n"
+                                          "    cmp %r14, %r13\n"
+                                          "    jne 1b\n"
+                                          "    ret\n"
+                                          "\n"
+                                          "# Returns C(%rax, %rcx) in %rax, which is exact modulo 256 as long as %rcx is\n"
+                                          "# at most 10. Clobbers %rdx, %r8 and %r9.\n"
+                                          "binomial:\n"
+                                          "    mov %rax, %r8\n"
+                                          "    mov $1, %eax\n"
+                                          "    xor %r9d, %r9d\n"
+                                          "1:\n"
+                                          "    cmp %rcx, %r9\n"
+                                          "    jae 2f\n"
+                                          "    mov %r8, %rdx\n"
+                                          "    sub %r9, %rdx\n"
+                                          "    mul %rdx\n"
+                                          "    inc %r9\n"
+                                          "    div %r9\n"
+                                          "    jmp 1b\n"
+                                          "2:\n"
+                                          "    ret\n"
+                                          "\n"
+                                          "# Runs [[-<+>]>] with %rdx = 1, or [[->+<]<] with %rdx = -1, one cell at a\n"
+                                          "# time. The pointer is left in the middle copy of memory. Clobbers %rax, %rcx\n"
+                                          "# and %rsi.\n"
+                                          "move_block:\n"
+                                          "    mov %rbx, %rax\n"
+                                          "    sub %r12, %rax\n"
+                                          "1:\n"
+                                          "    movzwl %ax, %eax\n"
+                                          "    movzbl (%r12,%rax), %ecx\n"
+                                          "    test %ecx, %ecx\n"
+                                          "    jz 2f\n"
+                                          "    movb $0, (%r12,%rax)\n"
+                                          "    mov %rax, %rsi\n"
+                                          "    sub %rdx, %rsi\n"
+                                          "    movzwl %si, %esi\n"
+                                          "    add %cl, (%r12,%rsi)\n"
+                                          "    add %rdx, %rax\n"
+                                          "    jmp 1b\n"
+                                          "2:\n"
+                                          "    lea (%r12,%rax), %rbx\n"
+                                          "    ret\n"
+                                          "\n"
+                                          "# Returns the next byte of input in %eax, or -1 at the end of input. Output is\n"
+                                          "# flushed before blocking so that prompts show up.\n"
+                                          "read_input:\n"
+                                          "    mov input_position(%rip), %rcx\n"
+                                          "    cmp input_size(%rip), %rcx\n"
+                                          "    jne 2f\n"
+                                          "    call flush_output\n"
+                                          "1:\n"
+                                          "    mov $SYS_READ, %eax\n"
+                                          "    xor %edi, %edi\n"
+                                          "    lea input(%rip), %rsi\n"
+                                          "    mov $BUFFER_SIZE, %edx\n"
+                                          "    syscall\n"
+                                          "    cmp $-EINTR, %rax\n"
+                                          "    je 1b\n"
+                                          "    test %rax, %rax\n"
+                                          "    jle 3f\n"
+                                          "    mov %rax, input_size(%rip)\n"
+                                          "    xor %ecx, %ecx\n"
+                                          "2:\n"
+                                          "    lea input(%rip), %rdx\n"
+                                          "    movzbl (%rdx,%rcx), %eax\n"
+                                          "    inc %rcx\n"
+                                          "    mov %rcx, input_position(%rip)\n"
+                                          "    ret\n"
+                                          "3:\n"
+                                          "    mov $-1, %eax\n"
+                                          "    ret\n"
+                                          "\n"
+                                          "    .globl _start\n"
+                                          "_start:\n"
+                                          "    call map_memory\n"
+                                          "    lea copies + MEMORY_SIZE(%rip), %r12\n"
+                                          "    mov %r12, %rbx\n";
+
+static const char bf_assemble_exit[] = ".Lexit:\n"
+                                       "    call flush_output\n"
+                                       "    mov $SYS_EXIT, %eax\n"
+                                       "    xor %edi, %edi\n"
+                                       "    syscall\n";
+
+/**
+ * Scratch registers for the addresses of wrapped cells, one for each cell an
+ * instruction can access.
+ */
+static const char *const bf_assemble_scratch[][3] = {
+    { "%rsi", "%esi", "%si" },
+    { "%rdi", "%edi", "%di" },
+};
+
+/**
+ * Writes the operand for a cell 'offset' cells away from the pointer to 'buf'.
+ * Unless memory is 'mirrored', cells that aren't proven to be inside of
+ * memory wrap around it, for which the address is first computed into one of
+ * the scratch registers.
+ */
+void bf_assemble_cell(FILE *fp, char *buf, size_t size, const struct bf_instruction *instr, int offset, bool mirrored, int scratch)
+{
+    const char *const *reg = bf_assemble_scratch[scratch];
+
+    if (!mirrored && !bf_utils_check_flag(instr->flags, BF_INS_FLAG_BOUNDED)) {
+        fprintf(fp, "    lea %d(%%rbx), %s\n", offset, reg[0]);
+        fprintf(fp, "    sub %%r12, %s\n", reg[0]);
+        fprintf(fp, "    movzwl %s, %s\n", reg[2], reg[1]);
+        snprintf(buf, size, "(%%r12,%s)", reg[0]);
+    } else {
+        snprintf(buf, size, "%d(%%rbx)", offset);
+    }
+}
+
+/**
+ * Writes a pointer move. Unless memory is 'mirrored', moves that could leave
+ * memory wrap around it.
+ */
+void bf_assemble_move(FILE *fp, const struct bf_instruction *instr, bool mirrored)
+{
+    int amount;
+
+    switch (instr->opcode) {
+    case BF_INS_INC_P:
+        amount = 1;
+        break;
+    case BF_INS_DEC_P:
+        amount = -1;
+        break;
+    case BF_INS_SUB_P:
+        amount = -(int)instr->argument;
+        break;
+    default:
+        amount = instr->argument;
+        break;
+    }
+
+    fprintf(fp, "    add $%d, %%rbx\n", amount);
+    if (!mirrored && !bf_utils_check_flag(instr->flags, BF_INS_FLAG_BOUNDED)) {
+        fprintf(fp, "    sub %%r12, %%rbx\n");
+        fprintf(fp, "    movzwl %%bx, %%ebx\n");
+        fprintf(fp, "    add %%r12, %%rbx\n");
+    }
+}
+
+/**
+ * Writes a COPY or MUL, which adds a multiple of the source cell to the
+ * target cell. The source cell is kept in %ecx, and 'cached' is the offset it
+ * was loaded from so that runs of them from the same cell only load it once.
+ */
+void bf_assemble_mul(FILE *fp, const struct bf_instruction *instr, bool mirrored, long *cached)
+{
+    char source[64];
+    char target[64];
+    int offset = (int16_t)instr->shift;
+    uint8_t factor = instr->opcode == BF_INS_COPY ? 1 : instr->argument;
+    int distance = (int16_t)(instr->opcode == BF_INS_COPY ? instr->argument : instr->offset);
+    bool wraps = !mirrored && !bf_utils_check_flag(instr->flags, BF_INS_FLAG_BOUNDED);
+
+    if (wraps || *cached != offset) {
+        bf_assemble_cell(fp, source, sizeof(source), instr, offset, mirrored, 0);
+        fprintf(fp, "    movzbl %s, %%ecx\n", source);
+        *cached = wraps ? LONG_MIN : offset;
+    }
+    bf_assemble_cell(fp, target, sizeof(target), instr, offset + distance, mirrored, 1);
+
+    if (factor == 1) {
+        fprintf(fp, "    add %%cl, %s\n", target);
+    } else if (factor == 255) {
+        fprintf(fp, "    sub %%cl, %s\n", target);
+    } else if ((factor & (factor - 1)) == 0) {
+        fprintf(fp, "    mov %%ecx, %%eax\n");
+        fprintf(fp, "    shl $%d, %%eax\n", __builtin_ctz(factor));
+        fprintf(fp, "    add %%al, %s\n", target);
+    } else {
+        fprintf(fp, "    imul $%d, %%ecx, %%eax\n", factor);
+        fprintf(fp, "    add %%al, %s\n", target);
+    }
+}
+
+/**
+ * Writes the assembly of a single instruction.
+ */
+void bf_assemble_instruction(FILE *fp, const struct bf_instruction *instr, bool mirrored, long *cached)
+{
+    char cell[64];
+    char source[64];
+    char target[64];
+    struct bf_poly poly;
+
+    if (instr->opcode == BF_INS_COPY || instr->opcode == BF_INS_MUL) {
+        bf_assemble_mul(fp, instr, mirrored, cached);
+        return;
+    }
+    *cached = LONG_MIN;
+
+    switch (instr->opcode) {
+    case BF_INS_NOP:
+    case BF_INS_INC_P:
+    case BF_INS_DEC_P:
+    case BF_INS_ADD_P:
+    case BF_INS_SUB_P:
+    case BF_INS_JMP:
+    case BF_INS_HALT:
+    case BF_INS_DIVMOD: // Idioms and filters run their loops.
+    case BF_INS_PRINT_DEC:
+    case BF_INS_FILTER:
+    case BF_INS_OUTS:
+    case BF_INS_CLEAR_RANGE:
+    case BF_INS_MOVE_BLOCK:
+        break;
+    default:
+        bf_assemble_cell(fp, cell, sizeof(cell), instr, (int16_t)instr->shift, mirrored, 0);
+        break;
+    }
+
+    switch (instr->opcode) {
+    case BF_INS_NOP:
+        break;
+    case BF_INS_IN:
+        fprintf(fp, "    call read_input\n");
+        fprintf(fp, "    test %%eax, %%eax\n");
+        fprintf(fp, "    js 1f\n");
+        // The call may have clobbered the scratch register, so the address
+        // is worked out again.
+        bf_assemble_cell(fp, cell, sizeof(cell), instr, (int16_t)instr->shift, mirrored, 0);
+        fprintf(fp, "    mov %%al, %s\n", cell);
+        fprintf(fp, "1:\n");
+        break;
+    case BF_INS_OUT:
+        fprintf(fp, "    mov %s, %%al\n", cell);
+        fprintf(fp, "    call write_output\n");
+        break;
+    case BF_INS_INC_V:
+        fprintf(fp, "    incb %s\n", cell);
+        break;
+    case BF_INS_DEC_V:
+        fprintf(fp, "    decb %s\n", cell);
+        break;
+    case BF_INS_ADD_V:
+        fprintf(fp, "    addb $%d, %s\n", (uint8_t)instr->argument, cell);
+        break;
+    case BF_INS_SUB_V:
+        fprintf(fp, "    subb $%d, %s\n", (uint8_t)instr->argument, cell);
+        break;
+    case BF_INS_INC_P:
+    case BF_INS_DEC_P:
+    case BF_INS_ADD_P:
+    case BF_INS_SUB_P:
+        bf_assemble_move(fp, instr, mirrored);
+        break;
+    case BF_INS_BRANCH_Z:
+        // Counted loops are always entered.
+        if (!bf_utils_check_flag(instr->flags, BF_INS_FLAG_COUNTED)) {
+            fprintf(fp, "    cmpb $0, %s\n", cell);
+            fprintf(fp, "    je .L%u\n", instr->argument);
+        }
+        break;
+    case BF_INS_BRANCH_NZ:
+        if (mirrored && !bf_utils_check_flag(instr->flags, BF_INS_FLAG_BALANCED)) {
+            // Brings the pointer back into the middle copy of memory.
+            fprintf(fp, "    mov %%rbx, %%rax\n");
+            fprintf(fp, "    sub %%r12, %%rax\n");
+            fprintf(fp, "    cmp $MEMORY_SIZE, %%rax\n");
+            fprintf(fp, "    jb 1f\n");
+            fprintf(fp, "    movzwl %%ax, %%eax\n");
+            fprintf(fp, "    lea (%%r12,%%rax), %%rbx\n");
+            fprintf(fp, "1:\n");
+        }
+        fprintf(fp, "    cmpb $0, %s\n", cell);
+        fprintf(fp, "    jne .L%u\n", instr->argument);
+        break;
+    case BF_INS_JMP:
+        fprintf(fp, "    jmp .L%u\n", instr->argument);
+        break;
+    case BF_INS_HALT:
+        fprintf(fp, "    jmp .Lexit\n");
+        break;
+    case BF_INS_CLEAR:
+        fprintf(fp, "    movb $0, %s\n", cell);
+        break;
+    case BF_INS_OUTS:
+        fprintf(fp, "    lea strings + %u(%%rip), %%rsi\n", instr->argument);
+        fprintf(fp, "    mov $%u, %%edx\n", instr->offset);
+        fprintf(fp, "    call write_string\n");
+        break;
+    case BF_INS_CLEAR_RANGE:
+        // Ranges that wrap run on into the copy of memory after the middle.
+        fprintf(fp, "    lea %d(%%rbx), %%rdi\n", (int16_t)instr->shift);
+        if (!mirrored && !bf_utils_check_flag(instr->flags, BF_INS_FLAG_BOUNDED)) {
+            fprintf(fp, "    sub %%r12, %%rdi\n");
+            fprintf(fp, "    movzwl %%di, %%edi\n");
+            fprintf(fp, "    add %%r12, %%rdi\n");
+        }
+        fprintf(fp, "    mov $%u, %%ecx\n", instr->argument);
+        fprintf(fp, "    xor %%eax, %%eax\n");
+        fprintf(fp, "    rep stosb\n");
+        break;
+    case BF_INS_MOVE_BLOCK:
+        fprintf(fp, "    mov $%d, %%rdx\n", (int16_t)instr->argument);
+        fprintf(fp, "    call move_block\n");
+        break;
+    case BF_INS_POLY:
+        bf_program_poly(instr, &poly);
+        fprintf(fp, "    movzbl %s, %%eax\n", cell);
+        fprintf(fp, "    mov $%d, %%ecx\n", poly.degree);
+        fprintf(fp, "    call binomial\n");
+        fprintf(fp, "    imul $%d, %%eax, %%eax\n", poly.factor);
+        if (poly.source != poly.counter) {
+            bf_assemble_cell(fp, source, sizeof(source), instr, poly.source, mirrored, 0);
+            fprintf(fp, "    movzbl %s, %%ecx\n", source);
+            fprintf(fp, "    imul %%ecx, %%eax\n");
+        }
+        bf_assemble_cell(fp, target, sizeof(target), instr, poly.target, mirrored, 1);
+        fprintf(fp, "    add %%al, %s\n", target);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * Writes the string table of a program, which OUTS instructions write from.
+ */
+void bf_assemble_strings(FILE *fp, const struct bf_program *program)
+{
+    fprintf(fp, "\n    .section .rodata\nstrings:");
+    for (size_t i = 0; i < program->strings_size; i++) {
+        fprintf(fp, "%s0x%02x", i % 12 == 0 ? "\n    .byte " : ", ", program->strings[i]);
+    }
+    fprintf(fp, "\n");
+}
+
+bool bf_assemble_program(struct bf_program *program, FILE *fp)
+{
+    const struct bf_instruction *instr;
+    bool *targets;
+    bool mirrored;
+    long cached = LONG_MIN;
+
+    targets = calloc(program->size + 1, sizeof(bool));
+    if (!targets) {
+        return false;
+    }
+    for (size_t i = 0; i < program->size; i++) {
+        instr = &program->ir[i];
+        if (instr->opcode == BF_INS_BRANCH_Z || instr->opcode == BF_INS_BRANCH_NZ || instr->opcode == BF_INS_JMP) {
+            targets[instr->argument] = true;
+        }
+    }
+
+    // See 'bf_transpile_sharded'.
+    mirrored = bf_program_drift(program) <= BF_MEMORY_SIZE;
+
+    fprintf(fp, bf_assemble_header, BF_MEMORY_SIZE, BF_ASSEMBLE_BUFFER_SIZE);
+    fputs(bf_assemble_runtime, fp);
+
+    for (size_t i = 0; i <= program->size; i++) {
+        // The cached cell is only valid when there's a single way to get here.
+        if (targets[i]) {
+            fprintf(fp, ".L%zu:\n", i);
+            cached = LONG_MIN;
+        }
+        if (i < program->size) {
+            bf_assemble_instruction(fp, &program->ir[i], mirrored, &cached);
+        }
+    }
+
+    fputs(bf_assemble_exit, fp);
+    bf_assemble_strings(fp, program);
+    free(targets);
+
+    return true;
+}
@@ -0,0 +1,39 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef BF_ASSEMBLER_H
+#define BF_ASSEMBLER_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "program.h"
+
+/**
+ * Writes GNU assembler source for x86-64 Linux that does the same as
+ * 'program' to 'fp'. The output doesn't depend on libc, so it's built with:
+ *
+ *   as program.s -o program.o && ld program.o -o program
+ *
+ * Returns false if memory couldn't be allocated.
+ */
+bool bf_assemble_program(struct bf_program *program, FILE *fp);
+
+#endif
@@ -0,0 +1,529 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+#include "bytecode.h"
+#include "interpreter.h"
+#include "utils.h"
+
+/** The same cell of every lane. */
+typedef uint8_t bf_batch_cells __attribute__((vector_size(BF_BATCH_LANES)));
+
+/**
+ * Lanes that are at the same instruction with the same pointer.
+ */
+struct bf_batch_group {
+    size_t pc; // IR index of the next instruction.
+    uint16_t pointer;
+    uint32_t lanes; // A bit for every lane in the group.
+    bf_batch_cells mask; // 0xff in every lane of the group, 0 elsewhere.
+};
+
+/**
+ * A batch while it runs. There can't be more groups than lanes since every
+ * group has at least one lane.
+ */
+struct bf_batch {
+    struct bf_program *program;
+    struct bf_batch_lane *lanes;
+    size_t input_positions[BF_BATCH_LANES];
+    size_t output_capacities[BF_BATCH_LANES];
+    struct bf_batch_group groups[BF_BATCH_LANES];
+    size_t group_count;
+    bf_batch_cells *tape;
+    size_t *offsets; // Bytecode offset of every instruction, once a lane needs a vm.
+    struct bf_batch_stats *stats;
+};
+
+/** What 'bf_batch_step' did to the groups. */
+enum bf_batch_step {
+    BF_BATCH_STEP_NEXT, // The group moved on to its next instruction.
+    BF_BATCH_STEP_SCHEDULE, // Groups were added or removed.
+    BF_BATCH_STEP_SCALAR, // The lanes of the group have to finish on a vm.
+    BF_BATCH_STEP_ERROR, // Memory couldn't be allocated.
+};
+
+/** Output allocated for a lane when it first writes. */
+#define BF_BATCH_OUTPUT_SIZE 256
+
+/** Room for output that a lane finished by 'bf_vm_run' gets on top of its input. */
+#define BF_BATCH_SCALAR_OUTPUT 4096
+
+/**
+ * Returns the mask of a group with 'lanes'.
+ */
+bf_batch_cells bf_batch_mask(uint32_t lanes)
+{
+    bf_batch_cells mask;
+
+    for (int i = 0; i < BF_BATCH_LANES; i++) {
+        mask[i] = (lanes >> i & 1) ? 0xff : 0;
+    }
+
+    return mask;
+}
+
+/**
+ * Returns the lanes in which a cell isn't zero.
+ */
+uint32_t bf_batch_nonzero(bf_batch_cells cells)
+{
+    uint32_t lanes = 0;
+
+    for (int i = 0; i < BF_BATCH_LANES; i++) {
+        if (cells[i] != 0) {
+            lanes |= 1u << i;
+        }
+    }
+
+    return lanes;
+}
+
+/**
+ * Makes room for at least 'size' more bytes of output in a lane. Returns false
+ * if memory couldn't be allocated.
+ */
+bool bf_batch_reserve(struct bf_batch *batch, int lane, size_t size)
+{
+    struct bf_batch_lane *run = &batch->lanes[lane];
+    size_t capacity = batch->output_capacities[lane];
+    uint8_t *grown;
+
+    if (run->output_size + size <= capacity) {
+        return true;
+    }
+
+    if (capacity == 0) {
+        capacity = BF_BATCH_OUTPUT_SIZE;
+    }
+    while (run->output_size + size > capacity) {
+        capacity *= 2;
+    }
+    grown = realloc(run->output, capacity);
+    if (!grown) {
+        return false;
+    }
+    run->output = grown;
+    batch->output_capacities[lane] = capacity;
+
+    return true;
+}
+
+/**
+ * Appends 'size' bytes to the output of a lane. Returns false if memory
+ * couldn't be allocated.
+ */
+bool bf_batch_write(struct bf_batch *batch, int lane, const uint8_t *bytes, size_t size)
+{
+    struct bf_batch_lane *run = &batch->lanes[lane];
+
+    if (!bf_batch_reserve(batch, lane, size)) {
+        return false;
+    }
+    memcpy(&run->output[run->output_size], bytes, size);
+    run->output_size += size;
+
+    return true;
+}
+
+/**
+ * Moves 'lanes' out of a group into a new one at 'pc' with 'pointer'.
+ */
+void bf_batch_split(struct bf_batch *batch, struct bf_batch_group *group, uint32_t lanes, size_t pc, uint16_t pointer)
+{
+    struct bf_batch_group *split = &batch->groups[batch->group_count++];
+
+    group->lanes &= ~lanes;
+    group->mask = bf_batch_mask(group->lanes);
+    split->pc = pc;
+    split->pointer = pointer;
+    split->lanes = lanes;
+    split->mask = bf_batch_mask(lanes);
+    batch->stats->splits++;
+}
+
+/**
+ * Sends the lanes of a group in which a branch is 'taken' to 'target', and
+ * the rest on to the next instruction. The group splits if they disagree.
+ */
+enum bf_batch_step bf_batch_branch(struct bf_batch *batch, struct bf_batch_group *group, uint32_t taken, size_t target)
+{
+    if (taken == group->lanes) {
+        group->pc = target;
+        return BF_BATCH_STEP_NEXT;
+    }
+
+    group->pc++;
+    if (taken == 0) {
+        return BF_BATCH_STEP_NEXT;
+    }
+    bf_batch_split(batch, group, taken, target, group->pointer);
+
+    return BF_BATCH_STEP_SCHEDULE;
+}
+
+/**
+ * Runs MOVE_BLOCK on every lane of a group. Each lane's block ends somewhere
+ * else, so the group splits by where the pointer ends up.
+ */
+enum bf_batch_step bf_batch_move_block(struct bf_batch *batch, struct bf_batch_group *group, int direction)
+{
+    uint16_t pointers[BF_BATCH_LANES];
+    uint16_t pointer;
+    uint32_t rest, lanes;
+    int lane;
+
+    for (rest = group->lanes; rest != 0; rest &= rest - 1) {
+        lane = __builtin_ctz(rest);
+        pointer = group->pointer;
+        while (batch->tape[pointer][lane] != 0) {
+            batch->tape[(uint16_t)(pointer - direction)][lane] += batch->tape[pointer][lane];
+            batch->tape[pointer][lane] = 0;
+            pointer += direction;
+        }
+        pointers[lane] = pointer;
+    }
+
+    // The group keeps the lanes that end up where its first lane does.
+    group->pc++;
+    group->pointer = pointers[__builtin_ctz(group->lanes)];
+    rest = group->lanes;
+    while (rest != 0) {
+        pointer = pointers[__builtin_ctz(rest)];
+        lanes = 0;
+        for (uint32_t other = rest; other != 0; other &= other - 1) {
+            if (pointers[__builtin_ctz(other)] == pointer) {
+                lanes |= other & -other;
+            }
+        }
+        rest &= ~lanes;
+        if (pointer != group->pointer) {
+            bf_batch_split(batch, group, lanes, group->pc, pointer);
+        }
+    }
+
+    return batch->group_count > 1 ? BF_BATCH_STEP_SCHEDULE : BF_BATCH_STEP_NEXT;
+}
+
+/**
+ * Executes the next instruction of a group on all of its lanes.
+ */
+enum bf_batch_step bf_batch_step(struct bf_batch *batch, size_t index)
+{
+    struct bf_batch_group *group = &batch->groups[index];
+    const struct bf_instruction *instr;
+    struct bf_poly poly;
+    bf_batch_cells *cell;
+    bf_batch_cells *target;
+    uint32_t rest;
+    uint8_t source;
+    int lane;
+
+    batch->stats->dispatches++;
+    batch->stats->lane_dispatches += __builtin_popcount(group->lanes);
+
+    if (group->pc >= batch->program->size) {
+        goto halt;
+    }
+    instr = &batch->program->ir[group->pc];
+    cell = &batch->tape[(uint16_t)(group->pointer + instr->shift)];
+
+    switch (instr->opcode) {
+    case BF_INS_IN:
+        for (rest = group->lanes; rest != 0; rest &= rest - 1) {
+            lane = __builtin_ctz(rest);
+            if (batch->input_positions[lane] < batch->lanes[lane].input_size) {
+                (*cell)[lane] = batch->lanes[lane].input[batch->input_positions[lane]++];
+            }
+        }
+        break;
+    case BF_INS_OUT:
+        for (rest = group->lanes; rest != 0; rest &= rest - 1) {
+            lane = __builtin_ctz(rest);
+            if (!bf_batch_write(batch, lane, &(*cell)[lane], 1)) {
+                return BF_BATCH_STEP_ERROR;
+            }
+        }
+        break;
+    case BF_INS_OUTS:
+        for (rest = group->lanes; rest != 0; rest &= rest - 1) {
+            if (!bf_batch_write(batch, __builtin_ctz(rest), &batch->program->strings[instr->argument], instr->offset)) {
+                return BF_BATCH_STEP_ERROR;
+            }
+        }
+        break;
+    case BF_INS_INC_V:
+    case BF_INS_DEC_V:
+    case BF_INS_ADD_V:
+    case BF_INS_SUB_V:
+        *cell += bf_bytecode_value(instr) & group->mask;
+        break;
+    case BF_INS_INC_P:
+    case BF_INS_DEC_P:
+    case BF_INS_ADD_P:
+    case BF_INS_SUB_P:
+        group->pointer += bf_bytecode_move(instr);
+        break;
+    case BF_INS_BRANCH_Z:
+        // Counted loops are always entered.
+        if (bf_utils_check_flag(instr->flags, BF_INS_FLAG_COUNTED)) {
+            break;
+        }
+        return bf_batch_branch(batch, group, group->lanes & ~bf_batch_nonzero(*cell), instr->argument);
+    case BF_INS_BRANCH_NZ:
+        return bf_batch_branch(batch, group, group->lanes & bf_batch_nonzero(*cell), instr->argument);
+    case BF_INS_JMP:
+        group->pc = instr->argument;
+        return BF_BATCH_STEP_NEXT;
+    case BF_INS_CLEAR:
+        *cell &= ~group->mask;
+        break;
+    case BF_INS_COPY:
+        target = &batch->tape[(uint16_t)(group->pointer + instr->shift + instr->argument)];
+        *target += *cell & group->mask;
+        break;
+    case BF_INS_MUL:
+        target = &batch->tape[(uint16_t)(group->pointer + instr->shift + instr->offset)];
+        *target += *cell * (uint8_t)instr->argument & group->mask;
+        break;
+    case BF_INS_POLY:
+        bf_program_poly(instr, &poly);
+        target = &batch->tape[(uint16_t)(group->pointer + poly.target)];
+        for (rest = group->lanes; rest != 0; rest &= rest - 1) {
+            lane = __builtin_ctz(rest);
+            source = poly.source != poly.counter ? batch->tape[(uint16_t)(group->pointer + poly.source)][lane] : 1;
+            (*target)[lane] += poly.factor * bf_utils_binomial((*cell)[lane], poly.degree) * source;
+        }
+        break;
+    case BF_INS_CLEAR_RANGE:
+        for (uint32_t i = 0; i < instr->argument; i++) {
+            batch->tape[(uint16_t)(group->pointer + instr->shift + i)] &= ~group->mask;
+        }
+        break;
+    case BF_INS_MOVE_BLOCK:
+        return bf_batch_move_block(batch, group, (int8_t)instr->argument);
+    case BF_INS_FILTER:
+        // Filters run over all of the input natively, which the interpreter
+        // does far faster than a loop in lockstep could.
+        return BF_BATCH_STEP_SCALAR;
+    case BF_INS_NOP:
+    case BF_INS_DIVMOD:
+    case BF_INS_PRINT_DEC:
+        // The native versions of idioms only work on a single tape, and their
+        // snippets are short, so they run as they are.
+        break;
+    default:
+        goto halt;
+    }
+    group->pc++;
+
+    return BF_BATCH_STEP_NEXT;
+
+halt:
+    *group = batch->groups[--batch->group_count];
+    return BF_BATCH_STEP_SCHEDULE;
+}
+
+/**
+ * Merges groups that caught up with each other, and returns the group that
+ * runs next: the one furthest behind. 'limit' is set to where the group
+ * furthest behind of the others is.
+ */
+size_t bf_batch_schedule(struct bf_batch *batch, size_t *limit)
+{
+    struct bf_batch_group *group, *other;
+    size_t next = 0;
+
+    for (size_t i = 0; i < batch->group_count; i++) {
+        group = &batch->groups[i];
+        for (size_t j = i + 1; j < batch->group_count; j++) {
+            other = &batch->groups[j];
+            if (other->pc == group->pc && other->pointer == group->pointer) {
+                group->lanes |= other->lanes;
+                group->mask |= other->mask;
+                *other = batch->groups[--batch->group_count];
+                batch->stats->merges++;
+                j--;
+            }
+        }
+        if (group->pc < batch->groups[next].pc) {
+            next = i;
+        }
+    }
+
+    *limit = SIZE_MAX;
+    for (size_t i = 0; i < batch->group_count; i++) {
+        if (i != next && batch->groups[i].pc < *limit) {
+            *limit = batch->groups[i].pc;
+        }
+    }
+
+    return next;
+}
+
+/**
+ * Finishes a lane of a group on a vm of its own, starting from where the
+ * group is. Returns false if memory couldn't be allocated.
+ */
+bool bf_batch_finish_lane(struct bf_batch *batch, const struct bf_batch_group *group, int lane)
+{
+    struct bf_batch_lane *run = &batch->lanes[lane];
+    struct bf_result result;
+    struct bf_vm *vm;
+
+    if (group->pc >= batch->program->size) {
+        return true; // The lane has finished.
+    }
+
+    vm = bf_vm_create(bf_program_retain(batch->program), BF_INPUT_BUFFER | BF_OUTPUT_BUFFER);
+    if (!vm) {
+        return false;
+    }
+    for (size_t i = 0; i < BF_MEMORY_SIZE; i++) {
+        vm->memory[i] = batch->tape[i][lane];
+    }
+    vm->pc = batch->offsets[group->pc];
+    vm->pointer = group->pointer;
+    bf_vm_feed_input(vm, &run->input[batch->input_positions[lane]], run->input_size - batch->input_positions[lane]);
+    bf_vm_close_input(vm);
+
+    // The vm writes straight into the output of the lane. A filter only runs
+    // natively while there's room for its output, so there's room for one
+    // byte per byte of input at least.
+    do {
+        if (!bf_batch_reserve(batch, lane, run->input_size + BF_BATCH_SCALAR_OUTPUT)) {
+            bf_vm_destroy(vm);
+            return false;
+        }
+        bf_vm_set_output(vm, &run->output[run->output_size], batch->output_capacities[lane] - run->output_size);
+        result = bf_vm_run(vm);
+        run->output_size += vm->output_size;
+    } while (result.code == BF_RESULT_NEED_DRAIN);
+
+    bf_vm_destroy(vm);
+    batch->stats->scalar_lanes++;
+
+    return true;
+}
+
+/**
+ * Finishes every lane of a group with 'bf_vm_run' and removes the group.
+ * Returns false if memory couldn't be allocated.
+ */
+bool bf_batch_finish(struct bf_batch *batch, size_t index)
+{
+    struct bf_batch_group *group = &batch->groups[index];
+
+    // Where the bytecode of every instruction starts, so that a vm can pick
+    // up at the instruction a group is at.
+    if (!batch->offsets) {
+        batch->offsets = malloc((batch->program->size + 1) * sizeof(size_t));
+        if (!batch->offsets) {
+            return false;
+        }
+        bf_bytecode_layout(batch->program, 0, batch->program->size, 0, batch->offsets);
+    }
+
+    for (uint32_t rest = group->lanes; rest != 0; rest &= rest - 1) {
+        if (!bf_batch_finish_lane(batch, group, __builtin_ctz(rest))) {
+            return false;
+        }
+    }
+    *group = batch->groups[--batch->group_count];
+
+    return true;
+}
+
+bool bf_batch_run(struct bf_program *program, struct bf_batch_lane *lanes, size_t count, struct bf_batch_stats *stats)
+{
+    struct bf_batch batch = {
+        .program = program,
+        .lanes = lanes,
+        .stats = stats,
+    };
+    enum bf_batch_step step;
+    uint64_t window_end = BF_BATCH_WINDOW;
+    uint64_t window_lanes = 0;
+    size_t index;
+    size_t limit;
+
+    memset(stats, 0, sizeof(struct bf_batch_stats));
+    for (size_t i = 0; i < count; i++) {
+        lanes[i].output = NULL;
+        lanes[i].output_size = 0;
+    }
+    if (count == 0) {
+        return true;
+    }
+
+    batch.tape = aligned_alloc(sizeof(bf_batch_cells), BF_MEMORY_SIZE * sizeof(bf_batch_cells));
+    if (!batch.tape) {
+        goto error1;
+    }
+    memset(batch.tape, 0, BF_MEMORY_SIZE * sizeof(bf_batch_cells));
+
+    batch.groups[0].lanes = count == 32 ? UINT32_MAX : (1u << count) - 1;
+    batch.groups[0].mask = bf_batch_mask(batch.groups[0].lanes);
+    batch.group_count = 1;
+
+    while (batch.group_count > 0) {
+        // The group furthest behind runs until it passes another group, or
+        // until the groups change.
+        index = bf_batch_schedule(&batch, &limit);
+        do {
+            step = bf_batch_step(&batch, index);
+        } while (step == BF_BATCH_STEP_NEXT && batch.groups[index].pc < limit && stats->dispatches < window_end);
+        if (step == BF_BATCH_STEP_ERROR || (step == BF_BATCH_STEP_SCALAR && !bf_batch_finish(&batch, index))) {
+            goto error2;
+        }
+
+        if (stats->dispatches >= window_end) {
+            if (stats->lane_dispatches - window_lanes < (uint64_t)BF_BATCH_WINDOW * BF_BATCH_MIN_LANES) {
+                while (batch.group_count > 0) {
+                    if (!bf_batch_finish(&batch, 0)) {
+                        goto error2;
+                    }
+                }
+                break;
+            }
+            window_end = stats->dispatches + BF_BATCH_WINDOW;
+            window_lanes = stats->lane_dispatches;
+        }
+    }
+
+    free(batch.offsets);
+    free(batch.tape);
+    return true;
+
+error2:
+    free(batch.offsets);
+    free(batch.tape);
+error1:
+    for (size_t i = 0; i < count; i++) {
+        free(lanes[i].output);
+        lanes[i].output = NULL;
+        lanes[i].output_size = 0;
+    }
+    return false;
+}
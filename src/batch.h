@@ -0,0 +1,95 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef BF_BATCH_H
+#define BF_BATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "program.h"
+
+/**
+ * === README ===
+ *
+ * The batch engine runs one program over many inputs at once. Every run gets
+ * a lane, and the tape is laid out as a structure of arrays: each cell is a
+ * vector with one byte per lane, so an instruction operates on the same cell
+ * of every lane with a single SIMD operation.
+ *
+ * Lanes that are at the same instruction with the same pointer form a group,
+ * which executes instructions in lockstep with a mask of its lanes. When the
+ * lanes of a group disagree about a branch the group splits in two, and each
+ * half continues on its own. The group with the lowest IR index always runs
+ * next, so a group that left a loop early waits right after it for the rest
+ * of its lanes, which are merged back into it once they catch up with the
+ * same pointer.
+ *
+ * When lanes keep diverging, a single dispatch covers too few of them to be
+ * worth it. If that persists over BF_BATCH_WINDOW dispatches, every lane that
+ * hasn't finished is moved to a vm of its own and finished by 'bf_vm_run'.
+ */
+
+/** Number of lanes, and so runs, in a batch. */
+#define BF_BATCH_LANES 16
+
+/** Dispatches over which the lanes covered per dispatch are averaged. */
+#define BF_BATCH_WINDOW 65536
+
+/**
+ * Lanes a dispatch has to cover on average over the last window for the
+ * batch to keep running in lockstep.
+ */
+#define BF_BATCH_MIN_LANES 4
+
+/**
+ * A single run in a batch. 'input' is owned by the caller. 'output' is
+ * allocated by 'bf_batch_run' and has to be freed by the caller.
+ */
+struct bf_batch_lane {
+    const uint8_t *input;
+    size_t input_size;
+    uint8_t *output;
+    size_t output_size;
+};
+
+/**
+ * How well the lanes of a batch kept together.
+ */
+struct bf_batch_stats {
+    uint64_t dispatches; // Instructions dispatched for a group.
+    uint64_t lane_dispatches; // Instructions executed, summed over lanes.
+    size_t splits; // Groups split by a divergent branch or MOVE_BLOCK.
+    size_t merges; // Groups merged after catching up with each other.
+    size_t scalar_lanes; // Lanes finished by 'bf_vm_run'.
+};
+
+/**
+ * Runs a program compiled by 'bf_compile' once for each of the 'count' lanes
+ * (at most BF_BATCH_LANES), reading the input of the lane and writing its
+ * output into it. Reads past the end of the input leave the cell unchanged,
+ * like EOF on stdin. Every lane is run to the end. Returns false if memory
+ * couldn't be allocated, in which case the outputs are freed.
+ */
+bool bf_batch_run(struct bf_program *program, struct bf_batch_lane *lanes, size_t count, struct bf_batch_stats *stats);
+
+#endif
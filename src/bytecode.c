@@ -0,0 +1,450 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdlib.h>
+
+#include "bytecode.h"
+#include "program.h"
+#include "utils.h"
+
+size_t bf_bytecode_op_length(enum bf_op op)
+{
+    switch (op) {
+    case BF_OP_ADD_V:
+    case BF_OP_MOVE_BLOCK:
+        return BF_OP_LEN_U8;
+    case BF_OP_ADD_P:
+    case BF_OP_SUB_P:
+    case BF_OP_ADD_P_WRAP:
+    case BF_OP_COPY:
+    case BF_OP_IN_AT:
+    case BF_OP_OUT_AT:
+    case BF_OP_CLEAR_AT:
+        return BF_OP_LEN_U16;
+    case BF_OP_MUL:
+    case BF_OP_ADD_V_AT:
+        return BF_OP_LEN_U8_U16;
+    case BF_OP_BRANCH_Z:
+    case BF_OP_BRANCH_NZ:
+    case BF_OP_JMP:
+        return BF_OP_LEN_U32;
+    case BF_OP_COPY_AT:
+    case BF_OP_CLEAR_RANGE:
+        return BF_OP_LEN_U16_U16;
+    case BF_OP_MUL_AT:
+        return BF_OP_LEN_U8_U16_U16;
+    case BF_OP_BRANCH_Z_AT:
+    case BF_OP_BRANCH_NZ_AT:
+    case BF_OP_DIVMOD:
+    case BF_OP_PRINT_DEC:
+        return BF_OP_LEN_U32_U16;
+    case BF_OP_ENTER:
+    case BF_OP_FILTER:
+    case BF_OP_OUTS:
+        return BF_OP_LEN_U32_U32;
+    case BF_OP_POLY:
+        return BF_OP_LEN_U8_U8_U16_U16_U16;
+    default:
+        return BF_OP_LEN;
+    }
+}
+
+/**
+ * Picks the _AT variant for instructions that operate on a shifted cell.
+ */
+bool bf_bytecode_select_shifted(const struct bf_instruction *instr, enum bf_op *op)
+{
+    switch (instr->opcode) {
+    case BF_INS_IN:
+        *op = BF_OP_IN_AT;
+        return true;
+    case BF_INS_OUT:
+        *op = BF_OP_OUT_AT;
+        return true;
+    case BF_INS_INC_V:
+    case BF_INS_DEC_V:
+    case BF_INS_ADD_V:
+    case BF_INS_SUB_V:
+        *op = BF_OP_ADD_V_AT;
+        return true;
+    case BF_INS_BRANCH_Z:
+        *op = BF_OP_BRANCH_Z_AT;
+        return true;
+    case BF_INS_BRANCH_NZ:
+        *op = BF_OP_BRANCH_NZ_AT;
+        return true;
+    case BF_INS_CLEAR:
+        *op = BF_OP_CLEAR_AT;
+        return true;
+    case BF_INS_COPY:
+        *op = BF_OP_COPY_AT;
+        return true;
+    case BF_INS_MUL:
+        *op = BF_OP_MUL_AT;
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Picks the opcode an IR instruction is lowered into. NOPs don't produce any
+ * code, in which case false is returned. Neither does the BRANCH_Z of a
+ * counted loop, which is always entered.
+ */
+bool bf_bytecode_select(const struct bf_instruction *instr, enum bf_op *op)
+{
+    if (instr->opcode == BF_INS_BRANCH_Z && bf_utils_check_flag(instr->flags, BF_INS_FLAG_COUNTED)) {
+        return false;
+    }
+    if (instr->shift != 0 && bf_bytecode_select_shifted(instr, op)) {
+        return true;
+    }
+
+    switch (instr->opcode) {
+    case BF_INS_INC_P:
+    case BF_INS_DEC_P:
+    case BF_INS_ADD_P:
+    case BF_INS_SUB_P:
+        if (!bf_utils_check_flag(instr->flags, BF_INS_FLAG_BOUNDED)) {
+            *op = BF_OP_ADD_P_WRAP;
+            return true;
+        }
+        break;
+    default:
+        break;
+    }
+
+    switch (instr->opcode) {
+    case BF_INS_IN:
+        *op = BF_OP_IN;
+        return true;
+    case BF_INS_OUT:
+        *op = BF_OP_OUT;
+        return true;
+    case BF_INS_INC_V:
+        *op = BF_OP_INC_V;
+        return true;
+    case BF_INS_DEC_V:
+        *op = BF_OP_DEC_V;
+        return true;
+    case BF_INS_ADD_V:
+    case BF_INS_SUB_V:
+        // Lazily compiled loops skip pass 3, and a single '+' or '-' has to
+        // fit in its original byte when the loop is lowered again.
+        *op = instr->argument != 1 ? BF_OP_ADD_V : instr->opcode == BF_INS_ADD_V ? BF_OP_INC_V : BF_OP_DEC_V;
+        return true;
+    case BF_INS_INC_P:
+        *op = BF_OP_INC_P;
+        return true;
+    case BF_INS_DEC_P:
+        *op = BF_OP_DEC_P;
+        return true;
+    case BF_INS_ADD_P:
+        *op = BF_OP_ADD_P;
+        return true;
+    case BF_INS_SUB_P:
+        *op = BF_OP_SUB_P;
+        return true;
+    case BF_INS_BRANCH_Z:
+        *op = bf_utils_check_flag(instr->flags, BF_INS_FLAG_LAZY) ? BF_OP_ENTER : BF_OP_BRANCH_Z;
+        return true;
+    case BF_INS_BRANCH_NZ:
+        *op = BF_OP_BRANCH_NZ;
+        return true;
+    case BF_INS_JMP:
+        *op = BF_OP_JMP;
+        return true;
+    case BF_INS_HALT:
+        *op = BF_OP_HALT;
+        return true;
+    case BF_INS_CLEAR:
+        *op = BF_OP_CLEAR;
+        return true;
+    case BF_INS_COPY:
+        *op = BF_OP_COPY;
+        return true;
+    case BF_INS_MUL:
+        *op = BF_OP_MUL;
+        return true;
+    case BF_INS_DIVMOD:
+        *op = BF_OP_DIVMOD;
+        return true;
+    case BF_INS_PRINT_DEC:
+        *op = BF_OP_PRINT_DEC;
+        return true;
+    case BF_INS_FILTER:
+        *op = BF_OP_FILTER;
+        return true;
+    case BF_INS_OUTS:
+        *op = BF_OP_OUTS;
+        return true;
+    case BF_INS_POLY:
+        *op = BF_OP_POLY;
+        return true;
+    case BF_INS_CLEAR_RANGE:
+        *op = BF_OP_CLEAR_RANGE;
+        return true;
+    case BF_INS_MOVE_BLOCK:
+        *op = BF_OP_MOVE_BLOCK;
+        return true;
+    default:
+        return false;
+    }
+}
+
+uint8_t bf_bytecode_value(const struct bf_instruction *instr)
+{
+    switch (instr->opcode) {
+    case BF_INS_INC_V:
+        return 1;
+    case BF_INS_DEC_V:
+        return -1;
+    case BF_INS_SUB_V:
+        return -instr->argument;
+    default:
+        return instr->argument;
+    }
+}
+
+uint16_t bf_bytecode_move(const struct bf_instruction *instr)
+{
+    switch (instr->opcode) {
+    case BF_INS_INC_P:
+        return 1;
+    case BF_INS_DEC_P:
+        return -1;
+    case BF_INS_SUB_P:
+        return -instr->argument;
+    default:
+        return instr->argument;
+    }
+}
+
+size_t bf_bytecode_layout(const struct bf_program *program, size_t start, size_t end, size_t base, size_t *offsets)
+{
+    size_t size = 0;
+    size_t exit;
+    enum bf_op op;
+
+    for (size_t i = start; i < end; i++) {
+        offsets[i - start] = base + size;
+        if (!bf_bytecode_select(&program->ir[i], &op)) {
+            continue;
+        }
+        size += bf_bytecode_op_length(op);
+
+        if (op == BF_OP_ENTER) {
+            exit = program->ir[i].argument;
+            while (++i < exit) {
+                if (bf_bytecode_select(&program->ir[i], &op)) {
+                    size += bf_bytecode_op_length(op);
+                }
+            }
+            i--;
+        }
+    }
+    offsets[end - start] = base + size;
+
+    return size;
+}
+
+/**
+ * Emits the instructions from 'start' up to 'end' into 'code' at the places
+ * picked by 'bf_bytecode_layout'. Branches to 'end' go to 'exit'. Loops that
+ * begin with an ENTER are left out, 'bf_program_relower' emits them later.
+ */
+void bf_bytecode_emit(const struct bf_program *program, size_t start, size_t end, const size_t *offsets, size_t exit, uint8_t *code)
+{
+    const struct bf_instruction *instr;
+    uint8_t *cursor;
+    enum bf_op op;
+    uint8_t value;
+    uint16_t amount;
+    uint32_t target;
+    uint32_t loop;
+    size_t length;
+
+    for (size_t i = start; i < end; i++) {
+        instr = &program->ir[i];
+        if (!bf_bytecode_select(instr, &op)) {
+            continue;
+        }
+
+        cursor = code + offsets[i - start];
+        *cursor = op;
+
+        switch (op) {
+        case BF_OP_ADD_V:
+        case BF_OP_ADD_V_AT:
+            cursor[1] = bf_bytecode_value(instr);
+            break;
+        case BF_OP_MOVE_BLOCK:
+            cursor[1] = instr->argument;
+            break;
+        case BF_OP_ADD_P:
+        case BF_OP_SUB_P:
+        case BF_OP_COPY:
+        case BF_OP_COPY_AT:
+        case BF_OP_CLEAR_RANGE:
+            amount = instr->argument;
+            memcpy(cursor + 1, &amount, sizeof(amount));
+            break;
+        case BF_OP_ADD_P_WRAP:
+            amount = bf_bytecode_move(instr);
+            memcpy(cursor + 1, &amount, sizeof(amount));
+            break;
+        case BF_OP_MUL:
+        case BF_OP_MUL_AT:
+            value = instr->argument;
+            amount = instr->offset;
+            cursor[1] = value;
+            memcpy(cursor + 2, &amount, sizeof(amount));
+            break;
+        case BF_OP_BRANCH_Z:
+        case BF_OP_BRANCH_NZ:
+        case BF_OP_JMP:
+        case BF_OP_BRANCH_Z_AT:
+        case BF_OP_BRANCH_NZ_AT:
+        case BF_OP_ENTER:
+        case BF_OP_DIVMOD:
+        case BF_OP_PRINT_DEC:
+        case BF_OP_FILTER:
+            target = instr->argument == end ? exit : offsets[instr->argument - start];
+            memcpy(cursor + 1, &target, sizeof(target));
+            if (op == BF_OP_ENTER) {
+                loop = i;
+                memcpy(cursor + 5, &loop, sizeof(loop));
+                i = instr->argument - 1; // The body is emitted once it runs.
+            } else if (op == BF_OP_FILTER) {
+                memcpy(cursor + 5, &instr->offset, sizeof(instr->offset));
+            }
+            break;
+        case BF_OP_OUTS:
+            memcpy(cursor + 1, &instr->argument, sizeof(instr->argument));
+            memcpy(cursor + 5, &instr->offset, sizeof(instr->offset));
+            break;
+        case BF_OP_POLY:
+            cursor[1] = instr->argument;
+            cursor[2] = instr->argument >> 8;
+            amount = instr->offset;
+            memcpy(cursor + 3, &amount, sizeof(amount));
+            amount = instr->offset >> 16;
+            memcpy(cursor + 5, &amount, sizeof(amount));
+            break;
+        default:
+            break;
+        }
+
+        // The shift always comes last, after the regular immediates. Idioms,
+        // POLY and CLEAR_RANGE have no unshifted variant so theirs is written
+        // even if it's 0.
+        if (instr->shift != 0 || op == BF_OP_DIVMOD || op == BF_OP_PRINT_DEC || op == BF_OP_POLY
+            || op == BF_OP_CLEAR_RANGE) {
+            length = bf_bytecode_op_length(op);
+            memcpy(cursor + length - sizeof(instr->shift), &instr->shift, sizeof(instr->shift));
+        }
+    }
+}
+
+bool bf_program_lower(struct bf_program *program)
+{
+    // Decides which pointer moves need to wrap, so it has to come before
+    // opcodes are selected.
+    bf_program_bound(program);
+
+    if (!bf_bytecode_lower(program)) {
+        return false;
+    }
+    program->reach = bf_program_reach(program);
+
+    return true;
+}
+
+bool bf_bytecode_lower(struct bf_program *program)
+{
+    size_t *offsets; // Byte offset of every IR instruction in the new code.
+    uint8_t *code;
+    size_t size;
+
+    offsets = malloc(sizeof(size_t) * (program->size + 1));
+    if (!offsets) {
+        goto error1;
+    }
+
+    // Branch targets are IR indices, so the layout of the whole program needs
+    // to be known before any code can be emitted.
+    size = bf_bytecode_layout(program, 0, program->size, 0, offsets);
+
+    code = malloc(size > 0 ? size : 1);
+    if (!code) {
+        goto error2;
+    }
+    bf_bytecode_emit(program, 0, program->size, offsets, size, code);
+
+    free(offsets);
+    free(program->code);
+    program->code = code;
+    program->code_size = size;
+
+    return true;
+
+error2:
+    free(offsets);
+error1:
+    return false;
+}
+
+bool bf_program_relower(struct bf_program *program, size_t start, size_t end, size_t pc, size_t limit)
+{
+    size_t *offsets;
+    size_t size;
+    uint32_t target = limit;
+
+    offsets = malloc(sizeof(size_t) * (end - start + 1));
+    if (!offsets) {
+        goto error1;
+    }
+
+    size = bf_bytecode_layout(program, start, end, pc, offsets);
+    if (size > limit - pc) {
+        goto error2;
+    }
+    bf_bytecode_emit(program, start, end, offsets, limit, program->code);
+
+    // Execution falls through to whatever is left of the old code when the
+    // loop exits, so skip over it.
+    pc += size;
+    if (limit - pc >= BF_OP_LEN_U32) {
+        program->code[pc] = BF_OP_JMP;
+        memcpy(&program->code[pc + 1], &target, sizeof(target));
+    } else {
+        memset(&program->code[pc], BF_OP_NOP, limit - pc);
+    }
+
+    free(offsets);
+    return true;
+
+error2:
+    free(offsets);
+error1:
+    return false;
+}
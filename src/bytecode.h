@@ -0,0 +1,224 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef BF_BYTECODE_H
+#define BF_BYTECODE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "program.h"
+
+/**
+ * === README ===
+ *
+ * The IR in 'struct bf_instruction' is convenient for optimization passes but
+ * takes 16 bytes per instruction, most of which is unused. Once optimization
+ * is done the IR is lowered into a packed byte stream which is what the
+ * interpreter executes.
+ *
+ * Every opcode is a single byte followed by immediates whose size depends
+ * only on the opcode. Immediates are stored in host byte order and may be
+ * unaligned, so always read them with the helpers below.
+ *
+ *   HALT, IN, OUT, INC_V, DEC_V, INC_P, DEC_P, CLEAR,   (no immediates)
+ *   NOP
+ *   ADD_V                                               u8 value
+ *   ADD_P, SUB_P, ADD_P_WRAP, COPY                      u16 amount / offset
+ *   MUL                                                 u8 factor, u16 offset
+ *   BRANCH_Z, BRANCH_NZ, JMP                            u32 target
+ *   ENTER                                               u32 target, u32 loop
+ *   FILTER                                              u32 target, u32 filter
+ *   OUTS                                                u32 string, u32 length
+ *   DIVMOD, PRINT_DEC                                   u32 target, u16 shift
+ *   POLY                     u8 factor, u8 degree, u16 target, u16 source,
+ *                                                                 u16 shift
+ *   CLEAR_RANGE                                         u16 count, u16 shift
+ *   MOVE_BLOCK                                          u8 direction
+ *
+ * Instructions inside balanced loops operate on a cell at a fixed distance
+ * from the pointer. They use the _AT variants, which take the same immediates
+ * followed by a u16 shift:
+ *
+ *   IN_AT, OUT_AT, CLEAR_AT                             u16 shift
+ *   ADD_V_AT                                            u8 value, u16 shift
+ *   COPY_AT                                             u16 offset, u16 shift
+ *   MUL_AT                                   u8 factor, u16 offset, u16 shift
+ *   BRANCH_Z_AT, BRANCH_NZ_AT                           u32 target, u16 shift
+ *
+ * Pointer moves that 'bf_program_bound' couldn't prove to stay inside of
+ * memory are lowered into ADD_P_WRAP instead, which adds a u16 amount modulo
+ * the memory size. Every other opcode can then assume the pointer is inside
+ * of memory.
+ *
+ * Branch targets are byte offsets into the code. SUB_V is folded into ADD_V
+ * since cell arithmetic wraps at 256 anyway, and INC_V / DEC_V with a shift
+ * become ADD_V_AT.
+ *
+ * Programs compiled by 'bf_compile_lazy' begin every outermost loop with an
+ * ENTER instead of a BRANCH_Z. It branches like BRANCH_Z does, but when the
+ * loop is entered its IR index ('loop') is handed to 'bf_compile_loop', which
+ * overwrites the loop's code with optimized code and pads whatever is left
+ * with a JMP or NOPs.
+ *
+ * DIVMOD and PRINT_DEC come right before the snippet of an idiom (see
+ * 'bf_idioms') and always carry a shift. If the native version of the idiom
+ * applies to the cells at the shift they jump to 'target' past the snippet,
+ * otherwise they fall through and the snippet runs.
+ *
+ * FILTER comes right before a loop found by 'bf_optimization_pass_filters'. It
+ * runs the loop over as much input as it can with the table at index 'filter'
+ * of 'program->filters', and jumps to 'target' past the loop once it has
+ * ended. Otherwise it falls through into the loop, which may also happen
+ * after part of the input has been handled.
+ *
+ * OUTS writes 'length' bytes from 'program->strings' starting at 'string', see
+ * 'bf_optimization_pass_outs'.
+ *
+ * POLY adds factor * C(n, degree) * source to the cell at 'target', where n is
+ * the cell at the shift and 'target' and 'source' are distances from it (see
+ * 'bf_program_poly'). A source of 0 stands for 1. Like the idioms it has no
+ * unshifted variant.
+ *
+ * CLEAR_RANGE clears 'count' cells starting at the shift, which it always
+ * carries too. MOVE_BLOCK moves the cells from the pointer up to the next zero
+ * cell in 'direction' (1 or 255 for -1) one cell the other way and leaves the
+ * pointer on the zero, see 'bf_vm_move_block'.
+ *
+ * Any opcodes that are added here should also be handled by
+ * 'bf_bytecode_op_length' and the interpreter.
+ */
+enum bf_op {
+    BF_OP_HALT,
+    BF_OP_IN,
+    BF_OP_OUT,
+    BF_OP_INC_V,
+    BF_OP_DEC_V,
+    BF_OP_ADD_V,
+    BF_OP_INC_P,
+    BF_OP_DEC_P,
+    BF_OP_ADD_P,
+    BF_OP_SUB_P,
+    BF_OP_BRANCH_Z,
+    BF_OP_BRANCH_NZ,
+    BF_OP_JMP,
+    BF_OP_CLEAR,
+    BF_OP_COPY,
+    BF_OP_MUL,
+    BF_OP_IN_AT,
+    BF_OP_OUT_AT,
+    BF_OP_ADD_V_AT,
+    BF_OP_BRANCH_Z_AT,
+    BF_OP_BRANCH_NZ_AT,
+    BF_OP_CLEAR_AT,
+    BF_OP_COPY_AT,
+    BF_OP_MUL_AT,
+    BF_OP_ADD_P_WRAP,
+    BF_OP_ENTER,
+    BF_OP_NOP,
+    BF_OP_DIVMOD,
+    BF_OP_PRINT_DEC,
+    BF_OP_FILTER,
+    BF_OP_OUTS,
+    BF_OP_POLY,
+    BF_OP_CLEAR_RANGE,
+    BF_OP_MOVE_BLOCK,
+};
+
+/** Encoded lengths (opcode byte included) of each immediate layout. */
+#define BF_OP_LEN 1
+#define BF_OP_LEN_U8 2
+#define BF_OP_LEN_U16 3
+#define BF_OP_LEN_U8_U16 4
+#define BF_OP_LEN_U32 5
+#define BF_OP_LEN_U16_U16 5
+#define BF_OP_LEN_U8_U16_U16 6
+#define BF_OP_LEN_U32_U16 7
+#define BF_OP_LEN_U32_U32 9
+#define BF_OP_LEN_U8_U8_U16_U16_U16 9
+
+static inline uint8_t bf_bytecode_read_u8(const uint8_t *code)
+{
+    return *code;
+}
+
+static inline uint16_t bf_bytecode_read_u16(const uint8_t *code)
+{
+    uint16_t value;
+
+    memcpy(&value, code, sizeof(value));
+    return value;
+}
+
+static inline uint32_t bf_bytecode_read_u32(const uint8_t *code)
+{
+    uint32_t value;
+
+    memcpy(&value, code, sizeof(value));
+    return value;
+}
+
+/**
+ * Returns the encoded length of an opcode including its immediates.
+ */
+size_t bf_bytecode_op_length(enum bf_op op);
+
+/**
+ * Returns the amount an ADD_V / SUB_V / INC_V / DEC_V adds to its cell.
+ */
+uint8_t bf_bytecode_value(const struct bf_instruction *instr);
+
+/**
+ * Returns how far a pointer move moves the pointer, modulo the memory size.
+ */
+uint16_t bf_bytecode_move(const struct bf_instruction *instr);
+
+/**
+ * Works out where each instruction from 'start' up to 'end' goes if the first
+ * one is placed at 'base'. The last entry of 'offsets' is where the code ends,
+ * the returned value is its size.
+ *
+ * Nothing can jump into a loop that begins with an ENTER, so only the size of
+ * its body is needed. Its offsets are left unset.
+ */
+size_t bf_bytecode_layout(const struct bf_program *program, size_t start, size_t end, size_t base, size_t *offsets);
+
+/**
+ * Lowers the optimized IR of a program into packed bytecode which is stored
+ * in 'program->code'. Any previously lowered code is replaced. This function
+ * returns false if memory couldn't be allocated.
+ */
+bool bf_program_lower(struct bf_program *program);
+
+/**
+ * Like 'bf_program_lower', but pointer moves aren't bounded first so all of
+ * them wrap, and 'program->reach' is left alone.
+ */
+bool bf_bytecode_lower(struct bf_program *program);
+
+/**
+ * Lowers the IR from 'start' up to 'end' again, in place of its current code
+ * which starts at 'pc' and ends at 'limit'. Jumps to 'end' go to 'limit'.
+ * Returns false without changing the code if the new code doesn't fit.
+ */
+bool bf_program_relower(struct bf_program *program, size_t start, size_t end, size_t pc, size_t limit);
+
+#endif
@@ -0,0 +1,160 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <string.h>
+
+#include "cache.h"
+
+#define BF_CACHE_FNV_OFFSET 14695981039346656037ULL
+#define BF_CACHE_FNV_PRIME 1099511628211ULL
+
+struct bf_cache *bf_cache_create(size_t capacity)
+{
+    struct bf_cache *cache;
+
+    cache = calloc(1, sizeof(struct bf_cache) + sizeof(struct bf_cache_entry) * capacity);
+    if (!cache) {
+        goto error1;
+    }
+    if (pthread_mutex_init(&cache->lock, NULL) != 0) {
+        goto error2;
+    }
+    cache->capacity = capacity;
+
+    return cache;
+
+error2:
+    free(cache);
+error1:
+    return NULL;
+}
+
+void bf_cache_destroy(struct bf_cache *cache)
+{
+    for (size_t i = 0; i < cache->size; i++) {
+        bf_program_destroy(cache->entries[i].program);
+        free(cache->entries[i].src);
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+uint64_t bf_cache_hash(const char *src, size_t size)
+{
+    uint64_t hash = BF_CACHE_FNV_OFFSET;
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (uint8_t)src[i];
+        hash *= BF_CACHE_FNV_PRIME;
+    }
+
+    return hash;
+}
+
+/**
+ * Returns the entry holding the passed hash, and the passed source code if
+ * 'src' is set, or NULL. The lock must be held.
+ */
+struct bf_cache_entry *bf_cache_find(struct bf_cache *cache, uint64_t hash, const char *src, size_t size)
+{
+    struct bf_cache_entry *entry;
+
+    for (size_t i = 0; i < cache->size; i++) {
+        entry = &cache->entries[i];
+        if (entry->hash == hash
+            && (!src || (entry->src_size == size && memcmp(entry->src, src, size) == 0))) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+struct bf_program *bf_cache_get(struct bf_cache *cache, uint64_t hash, const char *src, size_t size)
+{
+    struct bf_cache_entry *entry;
+    struct bf_program *program = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    entry = bf_cache_find(cache, hash, src, size);
+    if (entry) {
+        entry->last_used = ++cache->clock;
+        program = bf_program_retain(entry->program);
+        cache->hits++;
+    } else {
+        cache->misses++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return program;
+}
+
+struct bf_program *bf_cache_put(struct bf_cache *cache, uint64_t hash, const char *src, size_t size, struct bf_program *program)
+{
+    struct bf_cache_entry *entry;
+    struct bf_program *evicted = NULL;
+    char *copy;
+    char *evicted_src = NULL;
+
+    // Caching is disabled, or the source can't be kept. The caller's
+    // reference is handed back as is.
+    if (cache->capacity == 0 || !(copy = malloc(size))) {
+        return program;
+    }
+    memcpy(copy, src, size);
+
+    pthread_mutex_lock(&cache->lock);
+    entry = bf_cache_find(cache, hash, src, size);
+    if (entry) {
+        // Compiled twice by concurrent jobs, keep the one that's cached.
+        evicted = program;
+        evicted_src = copy;
+    } else if (cache->size < cache->capacity) {
+        entry = &cache->entries[cache->size++];
+        entry->program = program;
+        entry->src = copy;
+    } else {
+        entry = &cache->entries[0];
+        for (size_t i = 1; i < cache->size; i++) {
+            if (cache->entries[i].last_used < entry->last_used) {
+                entry = &cache->entries[i];
+            }
+        }
+        evicted = entry->program;
+        evicted_src = entry->src;
+        entry->program = program;
+        entry->src = copy;
+    }
+    entry->hash = hash;
+    entry->src_size = size;
+    entry->last_used = ++cache->clock;
+    program = bf_program_retain(entry->program);
+    pthread_mutex_unlock(&cache->lock);
+
+    // Programs in use by other threads stay alive until they're done with
+    // them, so releasing outside of the lock is safe.
+    if (evicted) {
+        bf_program_destroy(evicted);
+    }
+    free(evicted_src);
+
+    return program;
+}
@@ -0,0 +1,99 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef BF_CACHE_H
+#define BF_CACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "program.h"
+
+/**
+ * A cached program along with the source code it was compiled from, its hash
+ * and when it was last used. The source is kept so that scripts whose hashes
+ * collide aren't mistaken for each other.
+ */
+struct bf_cache_entry {
+    uint64_t hash;
+    uint64_t last_used;
+    char *src;
+    size_t src_size;
+    struct bf_program *program;
+};
+
+/**
+ * A fixed size, thread-safe cache of compiled programs keyed by the hash of
+ * their source code. When the cache is full the least recently used program
+ * is evicted.
+ *
+ * Lookups scan every entry, which is fast enough for the few hundred programs
+ * this is meant to hold and keeps eviction trivial.
+ */
+struct bf_cache {
+    pthread_mutex_t lock;
+    size_t capacity;
+    size_t size;
+    uint64_t clock; // Incremented on every access, used for 'last_used'.
+    uint64_t hits;
+    uint64_t misses;
+    struct bf_cache_entry entries[];
+};
+
+/**
+ * Creates an empty cache that holds at most 'capacity' programs.
+ */
+struct bf_cache *bf_cache_create(size_t capacity);
+
+/**
+ * Releases every cached program and frees the cache.
+ */
+void bf_cache_destroy(struct bf_cache *cache);
+
+/**
+ * Hashes brainfuck source code (64-bit FNV-1a).
+ */
+uint64_t bf_cache_hash(const char *src, size_t size);
+
+/**
+ * Looks up a program by the hash of its source code. If 'src' is set only a
+ * program compiled from exactly those 'size' bytes matches, otherwise the
+ * hash alone decides, which is what clients that only send the hash get.
+ *
+ * Returns a new reference to the program which the caller must release with
+ * 'bf_program_destroy', or NULL if it isn't cached.
+ */
+struct bf_program *bf_cache_get(struct bf_cache *cache, uint64_t hash, const char *src, size_t size);
+
+/**
+ * Adds a program compiled from 'size' bytes of 'src' to the cache, evicting
+ * the least recently used one if needed. The cache takes over the caller's
+ * reference and keeps a copy of the source. If another thread cached the same
+ * source in the meantime the passed program is released instead. If the copy
+ * can't be allocated the program isn't cached.
+ *
+ * Returns a new reference to the cached program which the caller must release
+ * with 'bf_program_destroy'.
+ */
+struct bf_program *bf_cache_put(struct bf_cache *cache, uint64_t hash, const char *src, size_t size, struct bf_program *program);
+
+#endif
@@ -18,36 +18,156 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "assert.h"
+#include "bytecode.h"
 #include "compiler.h"
+#include "filter.h"
 #include "interpreter.h"
+#include "linear.h"
 #include "patterns.h"
 #include "program.h"
+#include "utils.h"
+
+const struct bf_optimization_pass bf_optimization_passes[] = {
+    { "idioms", bf_optimization_pass_idioms },
+    { "pass_1", bf_optimization_pass_1 },
+    { "pass_2", bf_optimization_pass_2 },
+    { "pass_3", bf_optimization_pass_3 },
+    { "pass_4", bf_optimization_pass_4 },
+    { "linear", bf_optimization_pass_linear },
+    { "trips", bf_optimization_pass_trips },
+    { "outs", bf_optimization_pass_outs },
+    { "ranges", bf_optimization_pass_ranges },
+    { "filters", bf_optimization_pass_filters },
+    { NULL, NULL },
+};
+
+_Static_assert(sizeof(bf_optimization_passes) / sizeof(bf_optimization_passes[0]) - 1 <= BF_COMPILE_STATS_PASSES,
+    "BF_COMPILE_STATS_PASSES must have room for every optimization pass");
 
 struct bf_program *bf_compile(char *src)
 {
+    struct bf_compile_stats stats;
+
+    return bf_compile_measured(src, NULL, &stats);
+}
+
+/**
+ * Starts measuring a phase of 'bf_compile_measured', counting hardware events
+ * too if 'perf' is set. Returns the time it started at.
+ */
+uint64_t bf_compile_phase_start(struct bf_perf *perf)
+{
+    if (perf) {
+        bf_perf_start(perf);
+    }
+
+    return bf_perf_time_ns();
+}
+
+/**
+ * Stops measuring a phase that started at 'start'.
+ */
+void bf_compile_phase_stop(struct bf_perf *perf, uint64_t start, uint64_t *ns, struct bf_perf_counts *counts)
+{
+    *ns = bf_perf_time_ns() - start;
+
+    if (perf) {
+        bf_perf_stop(perf, counts);
+        return;
+    }
+    for (int i = 0; i < BF_PERF_EVENT_COUNT; i++) {
+        counts->values[i] = -1;
+    }
+}
+
+struct bf_program *bf_compile_measured(char *src, struct bf_perf *perf, struct bf_compile_stats *stats)
+{
+    const struct bf_optimization_pass *pass;
     struct bf_program *program;
+    struct bf_pass_stats *measured;
+    uint64_t start;
+
+    memset(stats, 0, sizeof(struct bf_compile_stats));
 
     program = bf_program_create();
     if (!program) {
         goto error1;
     }
+    program->stats = stats;
 
+    start = bf_compile_phase_start(perf);
     if (!bf_unoptimized_pass(program, src)) {
         goto error2;
     }
+    bf_compile_phase_stop(perf, start, &stats->unoptimized_ns, &stats->unoptimized_counts);
+    stats->unoptimized_size = program->size;
+
+    for (pass = bf_optimization_passes; pass->name; pass++) {
+        measured = &stats->passes[stats->pass_count++];
+        measured->name = pass->name;
+        measured->size_before = program->size;
+
+        start = bf_compile_phase_start(perf);
+        if (!pass->run(program)) {
+            goto error2;
+        }
+        bf_compile_phase_stop(perf, start, &measured->ns, &measured->counts);
+        measured->size_after = program->size;
+    }
 
-    if (!bf_optimization_pass_1(program)) {
+    start = bf_compile_phase_start(perf);
+    if (!bf_program_lower(program)) {
         goto error2;
     }
-    if (!bf_optimization_pass_2(program)) {
+    bf_compile_phase_stop(perf, start, &stats->lower_ns, &stats->lower_counts);
+    stats->code_size = program->code_size;
+    program->stats = NULL;
+
+    return program;
+
+error2:
+    bf_program_destroy(program);
+error1:
+    return NULL;
+}
+
+struct bf_program *bf_compile_lazy(char *src)
+{
+    struct bf_program *program;
+    size_t i = 0;
+
+    program = bf_program_create();
+    if (!program) {
+        goto error1;
+    }
+
+    if (!bf_unoptimized_pass(program, src)) {
         goto error2;
     }
-    if (!bf_optimization_pass_3(program)) {
+
+    // Only the outermost loops are compiled on their own, loops nested in
+    // them are optimized along with them.
+    while (i < program->size) {
+        if (program->ir[i].opcode == BF_INS_BRANCH_Z) {
+            program->ir[i].flags |= BF_INS_FLAG_LAZY;
+            i = program->ir[i].argument;
+            continue;
+        }
+        i++;
+    }
+
+    // Without the optimization passes there's no point in bounding pointer
+    // moves, every one of them wraps.
+    if (!bf_bytecode_lower(program)) {
         goto error2;
     }
+    program->reach = BF_PROGRAM_REACH_UNKNOWN;
 
     return program;
 
@@ -57,12 +177,59 @@ error1:
     return NULL;
 }
 
+bool bf_compile_loop(struct bf_program *program, size_t pos, size_t pc)
+{
+    struct bf_instruction *saved;
+    size_t end = program->ir[pos].argument;
+    size_t limit = bf_bytecode_read_u32(&program->code[pc + 1]);
+
+    program->ir[pos].flags &= ~BF_INS_FLAG_LAZY;
+
+    if (!bf_optimization_pass_1_range(program, pos, end)
+        || !bf_optimization_pass_2_range(program, pos, end)) {
+        goto error1;
+    }
+
+    saved = malloc(sizeof(struct bf_instruction) * (end - pos));
+    if (!saved) {
+        goto error1;
+    }
+    memcpy(saved, &program->ir[pos], sizeof(struct bf_instruction) * (end - pos));
+
+    // The _AT opcodes of shifted loops are larger than the plain ones, so the
+    // loop may no longer fit in its code once shifted. It's compiled without
+    // shifting in that case, which never takes more space than the original.
+    bf_shift_balanced_loops(program, pos, end);
+    if (!bf_program_relower(program, pos, end, pc, limit)) {
+        memcpy(&program->ir[pos], saved, sizeof(struct bf_instruction) * (end - pos));
+        if (!bf_program_relower(program, pos, end, pc, limit)) {
+            goto error2;
+        }
+    }
+
+    free(saved);
+    return true;
+
+error2:
+    free(saved);
+error1:
+    return false;
+}
+
 bool bf_unoptimized_pass(struct bf_program *program, const char *src)
 {
     char ch;
     int i = 0;
-    int offset = 0;
-    int address;
+    size_t *braces; // Indices of the BRANCH_Z of every loop that's still open.
+    size_t depth = 0;
+    size_t capacity = 64;
+    size_t *resized;
+    size_t address;
+
+    braces = malloc(sizeof(size_t) * capacity);
+    if (!braces) {
+        goto error1;
+    }
 
     while ((ch = src[i]) != '\0') {
         switch (ch) {
@@ -72,7 +239,7 @@ bool bf_unoptimized_pass(struct bf_program *program, const char *src)
                         .opcode = BF_INS_INC_P,
                         .argument = 0,
                     })) {
-                goto error1;
+                goto error2;
             }
             break;
         case '<':
@@ -81,7 +248,7 @@ bool bf_unoptimized_pass(struct bf_program *program, const char *src)
                         .opcode = BF_INS_DEC_P,
                         .argument = 0,
                     })) {
-                goto error1;
+                goto error2;
             }
             break;
         case '+':
@@ -90,7 +257,7 @@ bool bf_unoptimized_pass(struct bf_program *program, const char *src)
                         .opcode = BF_INS_INC_V,
                         .argument = 0,
                     })) {
-                goto error1;
+                goto error2;
             }
             break;
         case '-':
@@ -99,7 +266,7 @@ bool bf_unoptimized_pass(struct bf_program *program, const char *src)
                         .opcode = BF_INS_DEC_V,
                         .argument = 0,
                     })) {
-                goto error1;
+                goto error2;
             }
             break;
         case '.':
@@ -108,7 +275,7 @@ bool bf_unoptimized_pass(struct bf_program *program, const char *src)
                         .opcode = BF_INS_OUT,
                         .argument = 0,
                     })) {
-                goto error1;
+                goto error2;
             }
             break;
         case ',':
@@ -117,46 +284,56 @@ bool bf_unoptimized_pass(struct bf_program *program, const char *src)
                         .opcode = BF_INS_IN,
                         .argument = 0,
                     })) {
-                goto error1;
+                goto error2;
             }
             break;
         case '[':
-            address = bf_find_closing_brace(i, src);
-            if (address < 0) {
-                goto error1;
+            // The target is filled in once the matching brace is found.
+            if (depth == capacity) {
+                capacity *= 2;
+                resized = realloc(braces, sizeof(size_t) * capacity);
+                if (!resized) {
+                    goto error2;
+                }
+                braces = resized;
             }
+            braces[depth++] = program->size;
 
             if (!bf_program_append(program,
                     (struct bf_instruction){
                         .opcode = BF_INS_BRANCH_Z,
-                        .argument = address + 1 - offset,
+                        .argument = 0,
                     })) {
-                goto error1;
+                goto error2;
             }
 
             break;
         case ']':
-            address = bf_find_opening_brace(i, src);
-            if (address < 0) {
-                goto error1;
+            if (depth == 0) {
+                goto error2;
             }
+            address = braces[--depth];
 
             if (!bf_program_append(program,
                     (struct bf_instruction){
                         .opcode = BF_INS_BRANCH_NZ,
-                        .argument = address + 1 - offset,
+                        .argument = address + 1,
                     })) {
-                goto error1;
+                goto error2;
             }
+            program->ir[address].argument = program->size;
             break;
         default:
-            offset++;
             break;
         }
 
         i++;
     }
 
+    if (depth != 0) {
+        goto error2;
+    }
+
     // Ensure there's a halt at the end so the interpreter stops when execution
     // reaches the end of the program.
     if (!bf_program_append(program,
@@ -164,12 +341,132 @@ bool bf_unoptimized_pass(struct bf_program *program, const char *src)
                 .opcode = BF_INS_HALT,
                 .argument = 0,
             })) {
-        goto error1;
+        goto error2;
     }
 
+    free(braces);
     return true;
 
+error2:
+    free(braces);
+error1:
+    return false;
+}
+
+/**
+ * Returns the index of the instruction after 'source' if the unoptimized IR at
+ * 'pos' was compiled from it, or 0 if it wasn't.
+ */
+size_t bf_match_idiom(const struct bf_program *program, size_t pos, const char *source)
+{
+    enum bf_opcode opcode;
+
+    for (; *source; source++) {
+        switch (*source) {
+        case '>':
+            opcode = BF_INS_INC_P;
+            break;
+        case '<':
+            opcode = BF_INS_DEC_P;
+            break;
+        case '+':
+            opcode = BF_INS_INC_V;
+            break;
+        case '-':
+            opcode = BF_INS_DEC_V;
+            break;
+        case '.':
+            opcode = BF_INS_OUT;
+            break;
+        case ',':
+            opcode = BF_INS_IN;
+            break;
+        case '[':
+            opcode = BF_INS_BRANCH_Z;
+            break;
+        case ']':
+            opcode = BF_INS_BRANCH_NZ;
+            break;
+        default:
+            continue;
+        }
+
+        if (pos >= program->size || program->ir[pos].opcode != opcode) {
+            return 0;
+        }
+        pos++;
+    }
+
+    return pos;
+}
+
+/**
+ * Finds the snippets in 'bf_idioms' and puts their native opcode in front of
+ * them. The snippets themselves are left alone, since they're still run when
+ * the native version doesn't apply.
+ *
+ * A NOP is put after each snippet too, which the native opcode jumps to. It
+ * keeps pass 1 from combining the end of the snippet with the instructions
+ * after it, which would leave the jump in the middle of a pointer move.
+ *
+ * This works on the unoptimized IR, so it has to run before pass 1.
+ */
+bool bf_optimization_pass_idioms(struct bf_program *program)
+{
+    const struct bf_idiom *idiom;
+    size_t *positions = NULL;
+    struct bf_instruction *ir = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    size_t end;
+    void *resized;
+    bool result;
+    size_t i = 0;
+
+    while (i < program->size) {
+        for (idiom = bf_idioms; idiom->name; idiom++) {
+            if ((end = bf_match_idiom(program, i, idiom->source)) != 0) {
+                break;
+            }
+        }
+        if (!idiom->name) {
+            i++;
+            continue;
+        }
+
+        if (count + 2 > capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            if (!(resized = realloc(positions, sizeof(size_t) * capacity))) {
+                goto error1;
+            }
+            positions = resized;
+            if (!(resized = realloc(ir, sizeof(struct bf_instruction) * capacity))) {
+                goto error1;
+            }
+            ir = resized;
+        }
+
+        positions[count] = i;
+        ir[count++] = (struct bf_instruction){
+            .opcode = idiom->opcode,
+            .argument = end,
+        };
+        positions[count] = end;
+        ir[count++] = (struct bf_instruction){
+            .opcode = BF_INS_NOP,
+        };
+        i = end;
+    }
+
+    result = bf_program_insert(program, positions, ir, count);
+    free(positions);
+    free(ir);
+
+    return result;
+
 error1:
+    free(positions);
+    free(ir);
     return false;
 }
 
@@ -573,10 +870,15 @@ int bf_try_optimization_combine_dec_p(struct bf_program *program, int pos)
  */
 bool bf_optimization_pass_1(struct bf_program *program)
 {
-    int i = 0;
+    return bf_optimization_pass_1_range(program, 0, program->size);
+}
+
+bool bf_optimization_pass_1_range(struct bf_program *program, size_t start, size_t end)
+{
+    size_t i = start;
     int offset;
 
-    while (i < program->size) {
+    while (i < end) {
         if (program->ir[i].opcode == BF_INS_NOP) {
             i++;
             continue;
@@ -615,10 +917,15 @@ bool bf_optimization_pass_1(struct bf_program *program)
  */
 bool bf_optimization_pass_2(struct bf_program *program)
 {
-    int i = 0;
+    return bf_optimization_pass_2_range(program, 0, program->size);
+}
+
+bool bf_optimization_pass_2_range(struct bf_program *program, size_t start, size_t end)
+{
+    size_t i = start;
     int offset;
 
-    while (i < program->size) {
+    while (i < end) {
         if (program->ir[i].opcode == BF_INS_NOP) {
             i++;
             continue;
@@ -626,16 +933,25 @@ bool bf_optimization_pass_2(struct bf_program *program)
 
         // Replaces clear loops with singular clear instructions.
         if ((offset = bf_try_optimization_clear_loop(program, i))) {
+            if (program->stats) {
+                program->stats->clear_loops++;
+            }
             i += offset;
             continue;
         }
         // Replaces copy loops with copy instructions.
         if ((offset = bf_try_optimization_copy_loop(program, i))) {
+            if (program->stats) {
+                program->stats->copy_loops++;
+            }
             i += offset;
             continue;
         }
         // Replaces multiplication loops with multiply instructions.
         if ((offset = bf_try_optimization_mul_loop(program, i))) {
+            if (program->stats) {
+                program->stats->mul_loops++;
+            }
             i += offset;
             continue;
         }
@@ -646,159 +962,1377 @@ bool bf_optimization_pass_2(struct bf_program *program)
     return true;
 }
 
+/** Cells on either side of the pointer that 'bf_optimization_pass_outs' tracks. */
+#define BF_OUTS_REACH 32
+
 /**
- * Replaces occurences of ADD(1) and SUB(1) with INC and DEC respectively. This
- * pass also removes NOP instructions from the executable IR. Because of this,
- * the address of branch instructions need to be shifted depending on where
- * NOPs are removed from.
- *
- * Each time a NOP instruction is removed, an offset value is incremented. This
- * offset is used to correct branch addresses as the IR is shifted towards the
- * left of the array.
- *
- * Optimizations that happen here assume that branches always appear in certain
- * orders and always have a matching branch 'brace'.
+ * What 'bf_optimization_pass_outs' knows about the cells around the pointer
+ * at some point of a program. Cells are indexed relative to a window which is
+ * moved along whenever the pointer leaves it, and 'pointer' is where the
+ * pointer is in the window.
  */
-bool bf_optimization_pass_3(struct bf_program *program)
-{
-    int i = 0;
-    int offset = 0;
-    int addr = 0;
+struct bf_outs_state {
+    long pointer;
+    bool known[BF_OUTS_REACH * 2];
+    uint8_t values[BF_OUTS_REACH * 2];
+};
 
-    while (i < program->size) {
-        enum bf_opcode opcode = program->ir[i].opcode;
-        enum bf_opcode argument = program->ir[i].argument;
+/**
+ * Centers the window on the pointer and forgets every cell, or takes every
+ * cell to be zero if 'zero' is set.
+ */
+void bf_outs_reset(struct bf_outs_state *state, bool zero)
+{
+    state->pointer = BF_OUTS_REACH;
+    memset(state->known, zero, sizeof(state->known));
+    memset(state->values, 0, sizeof(state->values));
+}
 
-        if (opcode == BF_INS_NOP) {
-            offset++;
-            i++;
-            continue;
-        } else if (opcode == BF_INS_BRANCH_Z) {
-            // Save the offset from the current point in time to the branch
-            // instruction that matches this one. Applying that offset later
-            // will ensure the branch has the correct address.
-
-            addr = program->ir[i].argument;
-            program->ir[addr - 1].offset = offset;
-            program->ir[i - offset] = program->ir[i];
-        } else if (opcode == BF_INS_BRANCH_NZ) {
-            // Same as the former, save the offset for the other branch.
-
-            addr = program->ir[i].argument - program->ir[i].offset;
-            program->ir[addr - 1].offset = offset;
-        } else if (opcode == BF_INS_ADD_V && argument == 1) {
-            program->ir[i].opcode = BF_INS_INC_V;
-            program->ir[i].argument = 0;
-        } else if (opcode == BF_INS_SUB_V && argument == 1) {
-            program->ir[i].opcode = BF_INS_DEC_V;
-            program->ir[i].argument = 0;
-        } else if (opcode == BF_INS_ADD_P && argument == 1) {
-            program->ir[i].opcode = BF_INS_INC_P;
-            program->ir[i].argument = 0;
-        } else if (opcode == BF_INS_SUB_P && argument == 1) {
-            program->ir[i].opcode = BF_INS_DEC_P;
-            program->ir[i].argument = 0;
-        }
+/**
+ * Returns the index in the window of the cell 'offset' cells away from the
+ * pointer, or -1 if it's outside of the window.
+ */
+long bf_outs_cell(const struct bf_outs_state *state, long offset)
+{
+    long cell = state->pointer + offset;
 
-        // Since optimizations always reduces instruction count, shift the
-        // instruction towards the left of the array by the amount of NOPs
-        // encountered so far.
-        program->ir[i - offset] = program->ir[i];
+    return cell >= 0 && cell < BF_OUTS_REACH * 2 ? cell : -1;
+}
 
-        i++;
+/**
+ * Applies an instruction to what's known about the cells. Returns true if
+ * everything it does is known at compile time: it only writes known values to
+ * cells in the window, and only writes cells to the output that are known.
+ */
+bool bf_outs_step(struct bf_outs_state *state, const struct bf_instruction *instr)
+{
+    long delta;
+    long first;
+    long second;
+    long cell;
+    long target;
+    long source;
+    uint8_t amount;
+    struct bf_poly poly;
+
+    bf_program_access(instr, &delta, &first, &second);
+    cell = bf_outs_cell(state, first);
+    target = bf_outs_cell(state, second);
+
+    switch (instr->opcode) {
+    case BF_INS_NOP:
+    case BF_INS_OUTS:
+        return true;
+    case BF_INS_OUT:
+        return cell >= 0 && state->known[cell];
+    case BF_INS_IN:
+        if (cell >= 0) {
+            state->known[cell] = false;
+        }
+        return false;
+    case BF_INS_INC_V:
+    case BF_INS_DEC_V:
+    case BF_INS_ADD_V:
+    case BF_INS_SUB_V:
+        if (instr->opcode == BF_INS_INC_V || instr->opcode == BF_INS_DEC_V) {
+            amount = instr->opcode == BF_INS_INC_V ? 1 : -1;
+        } else {
+            amount = instr->opcode == BF_INS_ADD_V ? instr->argument : -instr->argument;
+        }
+        if (cell < 0) {
+            return false;
+        }
+        state->values[cell] += amount;
+        return state->known[cell];
+    case BF_INS_CLEAR:
+        if (cell < 0) {
+            return false;
+        }
+        state->known[cell] = true;
+        state->values[cell] = 0;
+        return true;
+    case BF_INS_CLEAR_RANGE:
+        for (long offset = first; offset <= second; offset++) {
+            if ((cell = bf_outs_cell(state, offset)) >= 0) {
+                state->known[cell] = true;
+                state->values[cell] = 0;
+            }
+        }
+        return bf_outs_cell(state, first) >= 0 && bf_outs_cell(state, second) >= 0;
+    case BF_INS_COPY:
+    case BF_INS_MUL:
+        amount = instr->opcode == BF_INS_COPY ? 1 : instr->argument;
+        if (target < 0) {
+            return false;
+        } else if (cell < 0 || !state->known[cell]) {
+            state->known[target] = false;
+            return false;
+        }
+        state->values[target] += amount * state->values[cell];
+        return state->known[target];
+    case BF_INS_POLY:
+        bf_program_poly(instr, &poly);
+        cell = bf_outs_cell(state, poly.counter);
+        target = bf_outs_cell(state, poly.target);
+        source = bf_outs_cell(state, poly.source);
+        if (target < 0) {
+            return false;
+        } else if (cell < 0 || source < 0 || !state->known[cell] || !state->known[source]) {
+            state->known[target] = false;
+            return false;
+        }
+        amount = poly.factor * bf_utils_binomial(state->values[cell], poly.degree);
+        state->values[target] += amount * (poly.source != poly.counter ? state->values[source] : 1);
+        return state->known[target];
+    case BF_INS_INC_P:
+    case BF_INS_DEC_P:
+    case BF_INS_ADD_P:
+    case BF_INS_SUB_P:
+        state->pointer += delta;
+        if (bf_outs_cell(state, 0) < 0) {
+            bf_outs_reset(state, false);
+            return false;
+        }
+        return true;
+    case BF_INS_BRANCH_NZ:
+        // Loops only end once their cell is zero, and the branch that skips
+        // them goes to the same place.
+        bf_outs_reset(state, false);
+        if ((cell = bf_outs_cell(state, first)) >= 0) {
+            state->known[cell] = true;
+        }
+        return false;
+    default:
+        // Loop bodies start out knowing nothing about the cells the loop
+        // changes, and idioms may change any cell.
+        bf_outs_reset(state, false);
+        return false;
     }
+}
 
-    // Shrinking usable size doesn't deallocate, but it'll ensure that leftover
-    // IR left behind after optimization isn't executed.
-    program->size -= offset;
-
-    // Correct all branch addresses using the offset stored in the instructions.
-    i = 0;
-    while (i < program->size) {
-        enum bf_opcode opcode = program->ir[i].opcode;
-        if (opcode == BF_INS_BRANCH_NZ) {
-            program->ir[i].argument -= program->ir[i].offset;
-        } else if (opcode == BF_INS_BRANCH_Z) {
-            program->ir[i].argument -= program->ir[i].offset;
-        }
-        i++;
+/**
+ * Appends an instruction to the replacement built by 'bf_outs_replace' if
+ * there's room for it in 'limit' instructions.
+ */
+bool bf_outs_emit(struct bf_instruction *ir, size_t *count, size_t limit, enum bf_opcode opcode, uint32_t argument, long shift)
+{
+    if (*count >= limit) {
+        return false;
     }
+    ir[(*count)++] = (struct bf_instruction){ .opcode = opcode, .argument = argument, .shift = shift };
 
     return true;
 }
 
-int bf_find_closing_brace(int pos, const char *src)
+/**
+ * Appends the pointer move from window index 'from' to 'to', if it moves.
+ */
+bool bf_outs_emit_move(struct bf_instruction *ir, size_t *count, size_t limit, long from, long to)
 {
-    char ch;
-    int i = pos + 1;
-    int depth = 0;
-    int offset = 0;
-    int result = -1;
+    if (from == to) {
+        return true;
+    } else if (labs(to - from) == 1) {
+        return bf_outs_emit(ir, count, limit, to > from ? BF_INS_INC_P : BF_INS_DEC_P, 0, 0);
+    }
+
+    return bf_outs_emit(ir, count, limit, to > from ? BF_INS_ADD_P : BF_INS_SUB_P, labs(to - from), 0);
+}
 
-    // Failsafe in-case the position is at the end for some reason.
-    if (src[pos] == '\0') {
+/**
+ * Replaces the instructions from 'start' up to 'end', which have to be known
+ * at compile time from 'entry' on, with an OUTS that writes what they output.
+ * It's followed by whatever it takes to leave the cells and the pointer like
+ * the instructions would. Nothing is replaced unless at least two bytes are
+ * written and the replacement fits in place of the instructions. Returns false
+ * if memory couldn't be allocated.
+ */
+bool bf_outs_replace(struct bf_program *program, size_t start, size_t end, const struct bf_outs_state *entry)
+{
+    struct bf_outs_state state = *entry;
+    const struct bf_instruction *instr;
+    struct bf_instruction *ir;
+    uint8_t *string;
+    bool written[BF_OUTS_REACH * 2] = { false };
+    size_t size = 0;
+    size_t count = 0;
+    long delta;
+    long first;
+    long second;
+    long shift;
+    uint8_t value;
+    uint32_t position;
+    struct bf_poly poly;
+
+    ir = malloc(sizeof(struct bf_instruction) * (end - start));
+    string = malloc(end - start);
+    if (!ir || !string) {
         goto error1;
     }
 
-    while ((ch = src[i]) != '\0') {
-        if (!bf_is_valid_instruction(ch)) {
-            offset--;
-            i++;
+    for (size_t i = start; i < end; i++) {
+        instr = &program->ir[i];
+        bf_program_access(instr, &delta, &first, &second);
+
+        switch (instr->opcode) {
+        case BF_INS_OUT:
+            string[size++] = state.values[bf_outs_cell(&state, first)];
+            break;
+        case BF_INS_INC_V:
+        case BF_INS_DEC_V:
+        case BF_INS_ADD_V:
+        case BF_INS_SUB_V:
+        case BF_INS_CLEAR:
+            written[bf_outs_cell(&state, first)] = true;
+            break;
+        case BF_INS_COPY:
+        case BF_INS_MUL:
+            written[bf_outs_cell(&state, second)] = true;
+            break;
+        case BF_INS_POLY:
+            bf_program_poly(instr, &poly);
+            written[bf_outs_cell(&state, poly.target)] = true;
+            break;
+        default:
+            break;
+        }
+        bf_outs_step(&state, instr);
+    }
+
+    if (size < 2) {
+        goto cleanup;
+    }
+
+    // The OUTS comes first since it doesn't read any cells, after which each
+    // cell that changed is set to its final value. Cells are addressed by
+    // their distance from the pointer, which only moves at the very end, so
+    // this works in balanced loops too.
+    bf_outs_emit(ir, &count, end - start, BF_INS_OUTS, 0, 0);
+    for (long cell = 0; cell < BF_OUTS_REACH * 2; cell++) {
+        if (!written[cell] || (entry->known[cell] && entry->values[cell] == state.values[cell])) {
             continue;
         }
 
-        if (ch == '[') {
-            depth++;
-        } else if (ch == ']') {
-            if (depth == 0) {
-                result = i;
-                break;
-            } else {
-                depth--;
-            }
+        value = state.values[cell] - (entry->known[cell] ? entry->values[cell] : 0);
+        shift = cell - entry->pointer;
+        if ((!entry->known[cell] && !bf_outs_emit(ir, &count, end - start, BF_INS_CLEAR, 0, shift))
+            || (value != 0 && !bf_outs_emit(ir, &count, end - start, BF_INS_ADD_V, value, shift))) {
+            goto cleanup;
         }
+    }
+    if (!bf_outs_emit_move(ir, &count, end - start, entry->pointer, state.pointer)) {
+        goto cleanup;
+    }
 
-        i++;
+    if (!bf_program_add_string(program, string, size, &position)) {
+        goto error1;
+    }
+    ir[0].argument = position;
+    ir[0].offset = size;
+
+    for (size_t i = start; i < end; i++) {
+        program->ir[i] = i - start < count ? ir[i - start] : (struct bf_instruction){ .opcode = BF_INS_NOP };
     }
 
-    return result + offset;
+cleanup:
+    free(string);
+    free(ir);
+    return true;
 
 error1:
-    return -1;
+    free(string);
+    free(ir);
+    return false;
 }
 
-int bf_find_opening_brace(int pos, const char *src)
+/**
+ * Finds straight runs of instructions that write constant bytes, such as
+ * banners, by tracking which cells are known at compile time. Memory starts
+ * out cleared, and a loop leaves its cell cleared. Each run that writes at
+ * least two bytes becomes a single OUTS with the bytes in the string table of
+ * the program, followed by the instructions that leave memory as it was.
+ *
+ * This runs after 'bf_optimization_pass_linear' so that banners built by
+ * nested loops are known as well.
+ */
+bool bf_optimization_pass_outs(struct bf_program *program)
 {
-    char ch;
-    int i = pos - 1;
-    int depth = 0;
-    int offset = 0;
-    int result = -1;
+    struct bf_outs_state state;
+    struct bf_outs_state entry; // What's known at 'start'.
+    bool *targets;
+    size_t start = 0; // Where the current run of known instructions starts.
+    bool output = false; // Whether the run writes anything.
+
+    // Anything other than a loop jumps to places the state doesn't follow.
+    targets = calloc(program->size + 1, sizeof(bool));
+    if (!targets) {
+        goto error1;
+    }
+    for (size_t i = 0; i < program->size; i++) {
+        if (bf_program_has_address(&program->ir[i])
+            && program->ir[i].opcode != BF_INS_BRANCH_Z
+            && program->ir[i].opcode != BF_INS_BRANCH_NZ) {
+            targets[program->ir[i].argument] = true;
+        }
+    }
+
+    bf_outs_reset(&state, true);
+    entry = state;
 
-    while (i >= 0) {
-        ch = src[i];
+    for (size_t i = 0; i < program->size; i++) {
+        if (targets[i]) {
+            if (output && !bf_outs_replace(program, start, i, &entry)) {
+                goto error2;
+            }
+            bf_outs_reset(&state, false);
+            start = i;
+            output = false;
+            entry = state;
+        }
 
-        if (!bf_is_valid_instruction(ch)) {
-            offset++;
-            i--;
+        if (bf_outs_step(&state, &program->ir[i])) {
+            output |= program->ir[i].opcode == BF_INS_OUT;
             continue;
         }
 
-        if (ch == ']') {
+        if (output && !bf_outs_replace(program, start, i, &entry)) {
+            goto error2;
+        }
+        start = i + 1;
+        output = false;
+        entry = state;
+    }
+
+    if (output && !bf_outs_replace(program, start, program->size, &entry)) {
+        goto error2;
+    }
+
+    free(targets);
+    return bf_program_compact(program);
+
+error2:
+    free(targets);
+error1:
+    return false;
+}
+
+/** Most instructions a loop may take up once 'bf_optimization_pass_trips' unrolls it. */
+#define BF_TRIPS_UNROLL_SIZE 64
+
+/**
+ * Returns how many times the balanced loop at 'pos' runs if its counter is
+ * 'value' when it's entered, or -1 if that can't be told or it never stops.
+ * The body may only add constants to the counter, or clear it before doing so,
+ * outside of nested loops. 'straight' is set if nothing in the body has an
+ * address, so that it can be copied as it is.
+ */
+long bf_trips_count(const struct bf_program *program, size_t pos, uint8_t value, bool *straight)
+{
+    const struct bf_instruction *instr;
+    size_t end = program->ir[pos].argument - 1;
+    size_t depth = 0;
+    long counter = (int16_t)program->ir[pos].shift;
+    long delta;
+    long first;
+    long second;
+    uint8_t step = 0; // What the body adds to the counter.
+    bool cleared = false; // Whether the body clears the counter first.
+    struct bf_poly poly;
+
+    *straight = true;
+    if (value == 0) {
+        return 0;
+    }
+
+    for (size_t i = pos + 1; i < end; i++) {
+        instr = &program->ir[i];
+        bf_program_access(instr, &delta, &first, &second);
+        *straight &= !bf_program_has_address(instr);
+
+        switch (instr->opcode) {
+        case BF_INS_NOP:
+        case BF_INS_OUT:
+        case BF_INS_OUTS:
+            break;
+        case BF_INS_BRANCH_Z:
             depth++;
-        } else if (ch == '[') {
-            if (depth == 0) {
-                result = i;
+            break;
+        case BF_INS_BRANCH_NZ:
+            depth--;
+            break;
+        case BF_INS_INC_V:
+        case BF_INS_DEC_V:
+        case BF_INS_ADD_V:
+        case BF_INS_SUB_V:
+            if (first != counter) {
+                break;
+            } else if (depth > 0) {
+                return -1;
+            }
+            if (instr->opcode == BF_INS_INC_V || instr->opcode == BF_INS_DEC_V) {
+                step += instr->opcode == BF_INS_INC_V ? 1 : -1;
+            } else {
+                step += instr->opcode == BF_INS_ADD_V ? instr->argument : -instr->argument;
+            }
+            break;
+        case BF_INS_CLEAR:
+            if (first != counter) {
                 break;
+            } else if (depth > 0) {
+                return -1;
+            }
+            step = 0;
+            cleared = true;
+            break;
+        case BF_INS_IN:
+            if (first == counter) {
+                return -1;
+            }
+            break;
+        case BF_INS_COPY:
+        case BF_INS_MUL:
+            if (second == counter) {
+                return -1;
+            }
+            break;
+        case BF_INS_POLY:
+            bf_program_poly(instr, &poly);
+            if (poly.target == counter) {
+                return -1;
+            }
+            break;
+        case BF_INS_CLEAR_RANGE:
+            if (first <= counter && counter <= second) {
+                return -1;
+            }
+            break;
+        default:
+            // Idioms and filters may change any of their cells.
+            return -1;
+        }
+    }
+
+    // A cleared counter is the same after every iteration.
+    if (cleared) {
+        return step == 0 ? 1 : -1;
+    }
+    for (long trips = 1; trips < 256; trips++) {
+        if ((uint8_t)(value + trips * step) == 0) {
+            return trips;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Forgets the cells that the instructions from 'start' up to 'end' write to,
+ * which have to be in a balanced loop. Returns false if they may write to
+ * cells that can't be told, in which case nothing is known anymore.
+ */
+bool bf_trips_forget(const struct bf_program *program, size_t start, size_t end, struct bf_outs_state *state)
+{
+    const struct bf_instruction *instr;
+    long delta;
+    long first;
+    long second;
+    long cell;
+    struct bf_poly poly;
+
+    for (size_t i = start; i < end; i++) {
+        instr = &program->ir[i];
+        bf_program_access(instr, &delta, &first, &second);
+
+        switch (instr->opcode) {
+        case BF_INS_NOP:
+        case BF_INS_OUT:
+        case BF_INS_OUTS:
+        case BF_INS_BRANCH_Z:
+        case BF_INS_BRANCH_NZ:
+            continue;
+        case BF_INS_IN:
+        case BF_INS_INC_V:
+        case BF_INS_DEC_V:
+        case BF_INS_ADD_V:
+        case BF_INS_SUB_V:
+        case BF_INS_CLEAR:
+            second = first;
+            break;
+        case BF_INS_COPY:
+        case BF_INS_MUL:
+            first = second;
+            break;
+        case BF_INS_POLY:
+            bf_program_poly(instr, &poly);
+            first = second = poly.target;
+            break;
+        case BF_INS_CLEAR_RANGE:
+        case BF_INS_DIVMOD:
+        case BF_INS_PRINT_DEC:
+            break;
+        default:
+            bf_outs_reset(state, false);
+            return false;
+        }
+
+        for (long offset = first; offset <= second; offset++) {
+            if ((cell = bf_outs_cell(state, offset)) >= 0) {
+                state->known[cell] = false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Works out what's known about the cells after the loop at 'pos' from what's
+ * known before it. Balanced loops leave the cells they don't write to alone,
+ * and every loop leaves its counter cleared.
+ */
+void bf_trips_skip(const struct bf_program *program, size_t pos, struct bf_outs_state *state)
+{
+    const struct bf_instruction *instr = &program->ir[pos];
+    long cell;
+
+    if (!bf_utils_check_flag(instr->flags, BF_INS_FLAG_BALANCED)) {
+        bf_outs_reset(state, false);
+    } else {
+        bf_trips_forget(program, pos + 1, instr->argument - 1, state);
+    }
+
+    if ((cell = bf_outs_cell(state, (int16_t)instr->shift)) >= 0) {
+        state->known[cell] = true;
+        state->values[cell] = 0;
+    }
+}
+
+/**
+ * Works out what's known about the cells at the start of every iteration of
+ * the loop at 'pos' from what's known before it. Besides the cells the loop
+ * doesn't write to, cells that the body always leaves as they were when the
+ * loop was entered are known too, such as the counters of nested loops.
+ */
+void bf_trips_enter(const struct bf_program *program, size_t pos, struct bf_outs_state *state)
+{
+    const struct bf_instruction *instr = &program->ir[pos];
+    size_t end = instr->argument - 1;
+    struct bf_outs_state entry = *state;
+    struct bf_outs_state body;
+
+    if (!bf_utils_check_flag(instr->flags, BF_INS_FLAG_BALANCED)
+        || !bf_trips_forget(program, pos + 1, end, state)) {
+        bf_outs_reset(state, false);
+        return;
+    }
+
+    // The body is run once without knowing any of the cells it writes to.
+    // Whatever it then leaves in a cell, it leaves on every iteration.
+    body = *state;
+    for (size_t i = pos + 1; i < end; i++) {
+        if (program->ir[i].opcode == BF_INS_BRANCH_Z) {
+            bf_trips_skip(program, i, &body);
+            i = program->ir[i].argument - 1;
+        } else {
+            bf_outs_step(&body, &program->ir[i]);
+        }
+    }
+
+    for (long cell = 0; cell < BF_OUTS_REACH * 2; cell++) {
+        if (!state->known[cell] && entry.known[cell] && body.known[cell]
+            && body.values[cell] == entry.values[cell]) {
+            state->known[cell] = true;
+            state->values[cell] = entry.values[cell];
+        }
+    }
+}
+
+/**
+ * Appends an instruction to the ones that 'bf_optimization_pass_trips' or
+ * 'bf_optimization_pass_filters' inserts at 'position'.
+ */
+bool bf_trips_append(size_t **positions, struct bf_instruction **ir, size_t *count, size_t *capacity, size_t position, const struct bf_instruction *instr)
+{
+    void *resized;
+
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        if (!(resized = realloc(*positions, sizeof(size_t) * *capacity))) {
+            return false;
+        }
+        *positions = resized;
+        if (!(resized = realloc(*ir, sizeof(struct bf_instruction) * *capacity))) {
+            return false;
+        }
+        *ir = resized;
+    }
+
+    (*positions)[*count] = position;
+    (*ir)[(*count)++] = *instr;
+
+    return true;
+}
+
+/**
+ * Follows which cells are known at compile time like 'bf_optimization_pass_outs'
+ * does, and works out the trip count of every balanced loop whose counter is
+ * known when it's entered. What's known is carried into and past loops with
+ * 'bf_trips_enter' and 'bf_trips_skip', and unrolled loops are stepped
+ * through one iteration at a time.
+ *
+ * This runs after 'bf_optimization_pass_linear', which leaves the loops it
+ * can solve without a trip count, and before 'bf_optimization_pass_outs' so
+ * that output written by unrolled loops can be worked out at compile time.
+ */
+bool bf_optimization_pass_trips(struct bf_program *program)
+{
+    struct bf_outs_state state;
+    struct bf_outs_state *exits; // What's known after each loop the walk is in.
+    struct bf_instruction *instr;
+    bool *targets;
+    size_t *positions = NULL;
+    struct bf_instruction *ir = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    size_t depth = 0;
+    size_t end;
+    long cell;
+    long trips;
+    bool straight;
+    bool result;
+
+    // Anything other than a loop jumps to places the state doesn't follow.
+    targets = calloc(program->size + 1, sizeof(bool));
+    if (!targets) {
+        goto error1;
+    }
+    for (size_t i = 0; i < program->size; i++) {
+        if (bf_program_has_address(&program->ir[i])
+            && program->ir[i].opcode != BF_INS_BRANCH_Z
+            && program->ir[i].opcode != BF_INS_BRANCH_NZ) {
+            targets[program->ir[i].argument] = true;
+        }
+        depth += program->ir[i].opcode == BF_INS_BRANCH_Z;
+    }
+
+    exits = malloc(sizeof(struct bf_outs_state) * (depth + 1));
+    if (!exits) {
+        goto error2;
+    }
+    depth = 0;
+
+    bf_outs_reset(&state, true);
+
+    for (size_t i = 0; i < program->size; i++) {
+        instr = &program->ir[i];
+        if (targets[i]) {
+            bf_outs_reset(&state, false);
+        }
+
+        if (instr->opcode == BF_INS_BRANCH_NZ) {
+            state = exits[--depth];
+            continue;
+        } else if (instr->opcode != BF_INS_BRANCH_Z) {
+            bf_outs_step(&state, instr);
+            continue;
+        }
+
+        end = instr->argument;
+        if (bf_utils_check_flag(instr->flags, BF_INS_FLAG_BALANCED)
+            && (cell = bf_outs_cell(&state, (int16_t)instr->shift)) >= 0
+            && state.known[cell]
+            && (trips = bf_trips_count(program, i, state.values[cell], &straight)) >= 0) {
+            if (trips > 0 && (!straight || trips * (end - i - 2) > BF_TRIPS_UNROLL_SIZE)) {
+                instr->flags |= BF_INS_FLAG_COUNTED;
+                instr->offset = trips;
             } else {
-                depth--;
+                // Loops that never run are dropped along with any loops
+                // nested in them, and short ones become copies of their body.
+                for (long n = 0; n < trips; n++) {
+                    for (size_t k = i + 1; k < end - 1; k++) {
+                        if (!bf_trips_append(&positions, &ir, &count, &capacity, i, &program->ir[k])) {
+                            goto error3;
+                        }
+                        bf_outs_step(&state, &program->ir[k]);
+                    }
+                }
+                for (size_t k = i; k < end; k++) {
+                    program->ir[k] = (struct bf_instruction){ .opcode = BF_INS_NOP };
+                }
+                i = end - 1;
+                continue;
             }
         }
 
+        exits[depth] = state;
+        bf_trips_skip(program, i, &exits[depth++]);
+        bf_trips_enter(program, i, &state);
+    }
+
+    result = bf_program_insert(program, positions, ir, count) && bf_program_compact(program);
+    free(exits);
+    free(targets);
+    free(positions);
+    free(ir);
+
+    return result;
+
+error3:
+    free(exits);
+    free(positions);
+    free(ir);
+error2:
+    free(targets);
+error1:
+    return false;
+}
+
+/**
+ * Replaces occurences of ADD(1) and SUB(1) with INC and DEC respectively. This
+ * pass also removes NOP instructions from the executable IR with
+ * 'bf_program_compact', which corrects the addresses of branches.
+ */
+bool bf_optimization_pass_3(struct bf_program *program)
+{
+    for (size_t i = 0; i < program->size; i++) {
+        struct bf_instruction *instr = &program->ir[i];
+
+        if (instr->argument != 1) {
+            continue;
+        }
+
+        switch (instr->opcode) {
+        case BF_INS_ADD_V:
+            instr->opcode = BF_INS_INC_V;
+            break;
+        case BF_INS_SUB_V:
+            instr->opcode = BF_INS_DEC_V;
+            break;
+        case BF_INS_ADD_P:
+            instr->opcode = BF_INS_INC_P;
+            break;
+        case BF_INS_SUB_P:
+            instr->opcode = BF_INS_DEC_P;
+            break;
+        default:
+            continue;
+        }
+        instr->argument = 0;
+    }
+
+    return bf_program_compact(program);
+}
+
+/**
+ * Returns true if the loop starting at 'pos' ends with the pointer where it
+ * started on every iteration. Loops nested inside of it must be balanced as
+ * well, otherwise the pointer position after them isn't known.
+ */
+bool bf_is_balanced_loop(struct bf_program *program, int pos)
+{
+    int end = program->ir[pos].argument - 1;
+    int shift = 0;
+
+    for (int i = pos + 1; i < end; i++) {
+        switch (program->ir[i].opcode) {
+        case BF_INS_INC_P:
+            shift++;
+            break;
+        case BF_INS_DEC_P:
+            shift--;
+            break;
+        case BF_INS_ADD_P:
+            shift += program->ir[i].argument;
+            break;
+        case BF_INS_SUB_P:
+            shift -= program->ir[i].argument;
+            break;
+        case BF_INS_BRANCH_Z:
+            if (!bf_is_balanced_loop(program, i)) {
+                return false;
+            }
+            i = program->ir[i].argument - 1; // Continue after the inner loop.
+            break;
+        default:
+            break;
+        }
+
+        // Shifts are stored in 16 bits, anything further away than that is
+        // left alone.
+        if (shift < INT16_MIN || shift > INT16_MAX) {
+            return false;
+        }
+    }
+
+    return shift == 0;
+}
+
+/**
+ * Rewrites a balanced loop so every instruction in it carries the distance
+ * from the pointer at the loop entry, and replaces pointer movement with NOPs.
+ */
+void bf_shift_balanced_loop(struct bf_program *program, int pos)
+{
+    int end = program->ir[pos].argument - 1;
+    int shift = 0;
+
+    program->ir[pos].flags |= BF_INS_FLAG_BALANCED;
+    program->ir[end].flags |= BF_INS_FLAG_BALANCED;
+
+    for (int i = pos + 1; i < end; i++) {
+        struct bf_instruction *instr = &program->ir[i];
+
+        switch (instr->opcode) {
+        case BF_INS_INC_P:
+            shift++;
+            break;
+        case BF_INS_DEC_P:
+            shift--;
+            break;
+        case BF_INS_ADD_P:
+            shift += instr->argument;
+            break;
+        case BF_INS_SUB_P:
+            shift -= instr->argument;
+            break;
+        case BF_INS_BRANCH_Z:
+        case BF_INS_BRANCH_NZ:
+            // Nested loops are balanced too, otherwise this one wouldn't be.
+            instr->flags |= BF_INS_FLAG_BALANCED;
+            instr->shift = shift;
+            continue;
+        default:
+            instr->shift = shift;
+            continue;
+        }
+
+        instr->opcode = BF_INS_NOP;
+        instr->argument = 0;
+    }
+}
+
+/**
+ * Finds the outermost balanced loops between 'start' and 'end' and shifts
+ * them. Loops nested in an unbalanced loop (such as a scan loop) are still
+ * considered on their own.
+ */
+void bf_shift_balanced_loops(struct bf_program *program, size_t start, size_t end)
+{
+    size_t i = start;
+
+    while (i < end) {
+        if (program->ir[i].opcode == BF_INS_BRANCH_Z && bf_is_balanced_loop(program, i)) {
+            bf_shift_balanced_loop(program, i);
+            i = program->ir[i].argument;
+            continue;
+        }
+
+        i++;
+    }
+}
+
+bool bf_optimization_pass_4(struct bf_program *program)
+{
+    bf_shift_balanced_loops(program, 0, program->size);
+
+    return bf_program_compact(program);
+}
+
+/**
+ * Appends the closed form of a loop to the instructions that
+ * 'bf_optimization_pass_linear' inserts at 'position'.
+ */
+bool bf_linear_append(size_t **positions, struct bf_instruction **ir, size_t *count, size_t *capacity, size_t position, const struct bf_linear_loop *loop)
+{
+    void *resized;
+
+    while (*count + loop->size > *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        if (!(resized = realloc(*positions, sizeof(size_t) * *capacity))) {
+            return false;
+        }
+        *positions = resized;
+        if (!(resized = realloc(*ir, sizeof(struct bf_instruction) * *capacity))) {
+            return false;
+        }
+        *ir = resized;
+    }
+
+    for (size_t i = 0; i < loop->size; i++) {
+        (*positions)[*count] = position;
+        (*ir)[(*count)++] = loop->ir[i];
+    }
+
+    return true;
+}
+
+bool bf_optimization_pass_linear(struct bf_program *program)
+{
+    struct bf_linear_loop **loops;
+    struct bf_linear_loop loop;
+    struct bf_linear_loop *solved;
+    size_t *positions = NULL;
+    struct bf_instruction *ir = NULL;
+    size_t size = program->size;
+    size_t count = 0;
+    size_t capacity = 0;
+    size_t end;
+    bool result;
+
+    loops = calloc(size, sizeof(struct bf_linear_loop *));
+    if (!loops) {
+        goto error1;
+    }
+
+    // Inner loops come first since outer loops are solved with their closed
+    // forms.
+    for (size_t i = size; i-- > 0;) {
+        if (program->ir[i].opcode != BF_INS_BRANCH_Z || !bf_linear_solve(program, loops, i, &loop)) {
+            continue;
+        }
+        if (!(solved = malloc(sizeof(loop)))) {
+            goto error2;
+        }
+        *solved = loop;
+        loops[i] = solved;
+    }
+
+    // Loops that aren't peeled are replaced by their closed form, along with
+    // any loops nested in them. Peeled loops get their closed form after the
+    // body, and only ever run one iteration.
+    for (size_t i = 0; i < size; i++) {
+        if (program->ir[i].opcode == BF_INS_BRANCH_NZ
+            && loops[program->ir[i].argument - 1]
+            && loops[program->ir[i].argument - 1]->peeled
+            && !bf_linear_append(&positions, &ir, &count, &capacity, i, loops[program->ir[i].argument - 1])) {
+            goto error2;
+        }
+        if (program->ir[i].opcode != BF_INS_BRANCH_Z || !loops[i] || loops[i]->peeled) {
+            continue;
+        }
+
+        if (!bf_linear_append(&positions, &ir, &count, &capacity, i, loops[i])) {
+            goto error2;
+        }
+        end = program->ir[i].argument;
+        for (; i < end; i++) {
+            program->ir[i] = (struct bf_instruction){ .opcode = BF_INS_NOP };
+        }
         i--;
     }
 
-    return result + offset;
+    result = bf_program_insert(program, positions, ir, count) && bf_program_compact(program);
+    for (size_t i = 0; i < size; i++) {
+        free(loops[i]);
+    }
+    free(loops);
+    free(positions);
+    free(ir);
+
+    return result;
+
+error2:
+    for (size_t i = 0; i < size; i++) {
+        free(loops[i]);
+    }
+    free(loops);
+    free(positions);
+    free(ir);
+error1:
+    return false;
+}
+
+/** Furthest a run of clears may reach from where it starts. */
+#define BF_RANGES_REACH 4096
+
+/**
+ * Returns true if the loop at 'pos' is [[-<+>]>] or [[->+<]<], and stores the
+ * direction it scans in (1 or -1) in 'direction'.
+ */
+bool bf_is_move_block_loop(const struct bf_program *program, size_t pos, int *direction)
+{
+    const struct bf_instruction *ir = &program->ir[pos];
+    long distance;
+
+    if (ir[0].argument != pos + 5) {
+        return false;
+    }
+    for (size_t i = 0; i < 5; i++) {
+        if (ir[i].shift != 0) {
+            return false;
+        }
+    }
+
+    if (ir[1].opcode == BF_INS_COPY) {
+        distance = (int16_t)ir[1].argument;
+    } else if (ir[1].opcode == BF_INS_MUL && ir[1].argument == 1) {
+        distance = (int16_t)ir[1].offset;
+    } else {
+        return false;
+    }
+
+    if (ir[3].opcode == BF_INS_INC_P) {
+        *direction = 1;
+    } else if (ir[3].opcode == BF_INS_DEC_P) {
+        *direction = -1;
+    } else {
+        return false;
+    }
+
+    return ir[2].opcode == BF_INS_CLEAR && distance == -*direction;
+}
+
+/**
+ * Returns true if an instruction can be part of a run of clears that's 'pointer'
+ * cells away from where the run started: NOPs, CLEARs and pointer moves that
+ * stay within BF_RANGES_REACH of the start.
+ */
+bool bf_ranges_fits(const struct bf_instruction *instr, long pointer)
+{
+    long delta;
+    long first;
+    long second;
+
+    bf_program_access(instr, &delta, &first, &second);
+
+    switch (instr->opcode) {
+    case BF_INS_NOP:
+        return true;
+    case BF_INS_CLEAR:
+        return labs(pointer + first) <= BF_RANGES_REACH;
+    case BF_INS_INC_P:
+    case BF_INS_DEC_P:
+    case BF_INS_ADD_P:
+    case BF_INS_SUB_P:
+        return labs(pointer + delta) <= BF_RANGES_REACH;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Replaces the run of clears from 'start' up to 'end' with a CLEAR_RANGE for
+ * every two or more neighbouring cells it clears, a CLEAR for every other cell,
+ * and a single pointer move at the end. The run is left alone if it doesn't
+ * clear any neighbouring cells.
+ */
+void bf_ranges_replace(struct bf_program *program, size_t start, size_t end)
+{
+    bool cleared[BF_RANGES_REACH * 2 + 2];
+    struct bf_instruction *ir = &program->ir[start];
+    long pointer = 0;
+    long delta;
+    long first;
+    long second;
+    long length;
+    long low = 0; // Lowest and highest index in 'cleared' that's cleared.
+    long high = 0;
+    bool merged = false;
+    size_t count = 0;
+
+    // Most runs are empty, so only the cells between the lowest and the
+    // highest clear are looked at.
+    for (size_t i = start; i < end; i++) {
+        bf_program_access(&program->ir[i], &delta, &first, &second);
+        if (program->ir[i].opcode == BF_INS_CLEAR) {
+            low = count == 0 || pointer + first + BF_RANGES_REACH < low ? pointer + first + BF_RANGES_REACH : low;
+            high = count == 0 || pointer + first + BF_RANGES_REACH > high ? pointer + first + BF_RANGES_REACH : high;
+            count++;
+        }
+        pointer += delta;
+    }
+    if (count < 2) {
+        return;
+    }
+
+    memset(&cleared[low], 0, high - low + 2);
+    pointer = 0;
+    for (size_t i = start; i < end; i++) {
+        bf_program_access(&program->ir[i], &delta, &first, &second);
+        if (program->ir[i].opcode == BF_INS_CLEAR) {
+            cleared[pointer + first + BF_RANGES_REACH] = true;
+        }
+        pointer += delta;
+    }
+
+    for (long cell = low + 1; cell <= high && !merged; cell++) {
+        merged = cleared[cell - 1] && cleared[cell];
+    }
+    if (!merged) {
+        return;
+    }
+
+    // The clears run at their distance from the pointer at the start of the
+    // run, which only moves at the very end.
+    count = 0;
+    for (long cell = low; cell <= high; cell++) {
+        if (!cleared[cell]) {
+            continue;
+        }
+        length = 1;
+        while (cleared[cell + length]) {
+            length++;
+        }
+
+        ir[count++] = (struct bf_instruction){
+            .opcode = length > 1 ? BF_INS_CLEAR_RANGE : BF_INS_CLEAR,
+            .argument = length > 1 ? length : 0,
+            .shift = cell - BF_RANGES_REACH,
+        };
+        cell += length;
+    }
+    if (pointer != 0) {
+        ir[count++] = (struct bf_instruction){
+            .opcode = pointer > 0 ? BF_INS_ADD_P : BF_INS_SUB_P,
+            .argument = labs(pointer),
+        };
+    }
+
+    for (size_t i = start + count; i < end; i++) {
+        program->ir[i] = (struct bf_instruction){ .opcode = BF_INS_NOP };
+    }
+}
+
+bool bf_optimization_pass_ranges(struct bf_program *program)
+{
+    bool *targets;
+    size_t start = 0; // Where the current run of clears starts.
+    long pointer = 0; // How far the pointer has moved since 'start'.
+    long delta;
+    long first;
+    long second;
+    int direction;
+
+    for (size_t i = 0; i < program->size; i++) {
+        if (program->ir[i].opcode != BF_INS_BRANCH_Z || !bf_is_move_block_loop(program, i, &direction)) {
+            continue;
+        }
+
+        program->ir[i] = (struct bf_instruction){ .opcode = BF_INS_MOVE_BLOCK, .argument = (uint16_t)direction };
+        for (size_t j = i + 1; j < i + 5; j++) {
+            program->ir[j] = (struct bf_instruction){ .opcode = BF_INS_NOP };
+        }
+    }
+
+    // The pointer could be anywhere when a run is jumped into.
+    targets = calloc(program->size + 1, sizeof(bool));
+    if (!targets) {
+        return false;
+    }
+    for (size_t i = 0; i < program->size; i++) {
+        if (bf_program_has_address(&program->ir[i])) {
+            targets[program->ir[i].argument] = true;
+        }
+    }
+
+    for (size_t i = 0; i < program->size; i++) {
+        if (targets[i] || !bf_ranges_fits(&program->ir[i], pointer)) {
+            bf_ranges_replace(program, start, i);
+            start = i;
+            pointer = 0;
+
+            if (!bf_ranges_fits(&program->ir[i], pointer)) {
+                start = i + 1;
+                continue;
+            }
+        }
+
+        bf_program_access(&program->ir[i], &delta, &first, &second);
+        pointer += delta;
+    }
+    bf_ranges_replace(program, start, program->size);
+
+    free(targets);
+    return bf_program_compact(program);
+}
+
+/**
+ * Returns true if the loop at 'pos' is a filter loop: a balanced loop that
+ * ends every iteration by reading a byte into the cell at the pointer, and
+ * writes exactly one byte per iteration. Nothing else in it may read input or
+ * do anything 'bf_filter_build' can't run.
+ */
+bool bf_is_filter_loop(const struct bf_program *program, size_t pos)
+{
+    size_t end = program->ir[pos].argument;
+    size_t depth = 0;
+    int outputs = 0;
+
+    if (!bf_utils_check_flag(program->ir[pos].flags, BF_INS_FLAG_BALANCED)
+        || end < pos + 3
+        || program->ir[end - 2].opcode != BF_INS_IN
+        || program->ir[end - 2].shift != 0) {
+        return false;
+    }
+
+    for (size_t i = pos + 1; i < end - 2; i++) {
+        switch (program->ir[i].opcode) {
+        case BF_INS_BRANCH_Z:
+            depth++;
+            break;
+        case BF_INS_BRANCH_NZ:
+            depth--;
+            break;
+        case BF_INS_OUT:
+            // Writes in nested loops would make the number of bytes written
+            // per iteration depend on the cells.
+            if (depth > 0) {
+                return false;
+            }
+            outputs++;
+            break;
+        case BF_INS_NOP:
+        case BF_INS_INC_V:
+        case BF_INS_DEC_V:
+        case BF_INS_ADD_V:
+        case BF_INS_SUB_V:
+        case BF_INS_CLEAR:
+        case BF_INS_CLEAR_RANGE:
+        case BF_INS_COPY:
+        case BF_INS_MUL:
+            break;
+        default:
+            return false;
+        }
+    }
+
+    return outputs == 1;
+}
+
+/** Most filter loops a program gets tables for, each of them takes 128 KiB. */
+#define BF_FILTER_MAX_TABLES 16
+
+/**
+ * Returns true if 'state' knows every cell that an iteration of the filter
+ * loop at 'pos' may access, other than the one under the pointer which holds
+ * the byte that's read. Points 'cells' at the cell under the pointer then, as
+ * 'bf_filter_build' expects.
+ */
+bool bf_filter_known(const struct bf_program *program, size_t pos, const struct bf_outs_state *state, const uint8_t **cells)
+{
+    long low, high;
+    long cell;
+
+    if (!bf_filter_cells(program, pos, &low, &high)) {
+        return false;
+    }
+    for (long offset = low; offset <= high; offset++) {
+        cell = bf_outs_cell(state, offset);
+        if (cell < 0 || (offset != 0 && !state->known[cell])) {
+            return false;
+        }
+    }
+
+    *cells = &state->values[state->pointer];
+    return true;
+}
+
+/**
+ * Puts a FILTER in front of every filter loop whose cells are known when it's
+ * entered, and builds the table it runs from with 'bf_filter_build'. What's
+ * known is followed like 'bf_optimization_pass_trips' does. Since a filter
+ * iteration leaves every cell but the one under the pointer as it found it,
+ * the table holds for every iteration and every time the loop is entered.
+ *
+ * This has to run after pass 4, which marks balanced loops and shifts them.
+ */
+bool bf_optimization_pass_filters(struct bf_program *program)
+{
+    struct bf_outs_state state;
+    struct bf_outs_state *exits; // What's known after each loop the walk is in.
+    struct bf_instruction *instr;
+    struct bf_filter *filter;
+    const uint8_t *cells;
+    bool *targets;
+    size_t *positions = NULL;
+    struct bf_instruction *ir = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    size_t depth = 0;
+    uint32_t index;
+    bool result;
+
+    // Anything other than a loop jumps to places the state doesn't follow.
+    targets = calloc(program->size + 1, sizeof(bool));
+    if (!targets) {
+        goto error1;
+    }
+    for (size_t i = 0; i < program->size; i++) {
+        if (bf_program_has_address(&program->ir[i])
+            && program->ir[i].opcode != BF_INS_BRANCH_Z
+            && program->ir[i].opcode != BF_INS_BRANCH_NZ) {
+            targets[program->ir[i].argument] = true;
+        }
+        depth += program->ir[i].opcode == BF_INS_BRANCH_Z;
+    }
+
+    exits = malloc(sizeof(struct bf_outs_state) * (depth + 1));
+    if (!exits) {
+        goto error2;
+    }
+    filter = malloc(sizeof(struct bf_filter));
+    if (!filter) {
+        goto error3;
+    }
+    depth = 0;
+
+    bf_outs_reset(&state, true);
+
+    for (size_t i = 0; i < program->size; i++) {
+        instr = &program->ir[i];
+        if (targets[i]) {
+            bf_outs_reset(&state, false);
+        }
+
+        if (instr->opcode == BF_INS_BRANCH_NZ) {
+            state = exits[--depth];
+            continue;
+        } else if (instr->opcode != BF_INS_BRANCH_Z) {
+            bf_outs_step(&state, instr);
+            continue;
+        }
+
+        if (program->filters_size < BF_FILTER_MAX_TABLES
+            && bf_is_filter_loop(program, i)
+            && bf_filter_known(program, i, &state, &cells)
+            && bf_filter_build(program, i, cells, filter)) {
+            if (!bf_program_add_filter(program, filter, &index)
+                || !bf_trips_append(&positions, &ir, &count, &capacity, i,
+                    &(struct bf_instruction){
+                        .opcode = BF_INS_FILTER,
+                        .argument = instr->argument,
+                        .offset = index,
+                    })) {
+                goto error4;
+            }
+            bf_trips_skip(program, i, &state);
+            i = instr->argument - 1;
+            continue;
+        }
+
+        exits[depth] = state;
+        bf_trips_skip(program, i, &exits[depth++]);
+        bf_trips_enter(program, i, &state);
+    }
+
+    result = bf_program_insert(program, positions, ir, count);
+    free(filter);
+    free(exits);
+    free(targets);
+    free(positions);
+    free(ir);
+
+    return result;
+
+error4:
+    free(filter);
+error3:
+    free(exits);
+    free(positions);
+    free(ir);
+error2:
+    free(targets);
+error1:
+    return false;
 }
 
 bool bf_is_valid_instruction(const char ch)
@@ -22,6 +22,61 @@
 #define BF_COMPILER_H
 
 #include <stdbool.h>
+#include <stdint.h>
+
+#include "perf.h"
+#include "program.h"
+
+/**
+ * A named optimization pass. The compiler runs every entry of
+ * 'bf_optimization_passes' in order after the unoptimized pass.
+ */
+struct bf_optimization_pass {
+    const char *name;
+    bool (*run)(struct bf_program *program);
+};
+
+/**
+ * Optimization passes in the order they're applied, terminated by an entry
+ * with a NULL name.
+ */
+extern const struct bf_optimization_pass bf_optimization_passes[];
+
+/**
+ * Most optimization passes that 'struct bf_compile_stats' has room for. Adding
+ * passes past this fails to compile, see 'bf_optimization_passes'.
+ */
+#define BF_COMPILE_STATS_PASSES 16
+
+/**
+ * Time spent in an optimization pass, the hardware events counted while it
+ * ran, and the size of the IR before and after it ran.
+ */
+struct bf_pass_stats {
+    const char *name;
+    uint64_t ns;
+    struct bf_perf_counts counts;
+    size_t size_before;
+    size_t size_after;
+};
+
+/**
+ * What 'bf_compile_measured' records about each phase of the compiler, and
+ * how many loops pass 2 rewrote.
+ */
+struct bf_compile_stats {
+    uint64_t unoptimized_ns;
+    struct bf_perf_counts unoptimized_counts;
+    size_t unoptimized_size;
+    size_t pass_count;
+    struct bf_pass_stats passes[BF_COMPILE_STATS_PASSES];
+    uint64_t lower_ns;
+    struct bf_perf_counts lower_counts;
+    size_t code_size;
+    size_t clear_loops;
+    size_t copy_loops;
+    size_t mul_loops;
+};
 
 /**
  * Generates a compiled brainfuck progam from a brainfuck source string. The
@@ -29,12 +84,42 @@
  */
 struct bf_program *bf_compile(char *src);
 
+/**
+ * Like 'bf_compile', but also fills in 'stats'. If 'perf' is set, the hardware
+ * events of each phase are counted with it, otherwise every count is -1.
+ */
+struct bf_program *bf_compile_measured(char *src, struct bf_perf *perf, struct bf_compile_stats *stats);
+
+/**
+ * Like 'bf_compile', but only the unoptimized pass runs up front. Each of the
+ * outermost loops is lowered into an ENTER opcode and optimized by
+ * 'bf_compile_loop' the first time it's entered. Loops that never run are
+ * never optimized, and the program starts running after a single linear scan
+ * over its source.
+ *
+ * The program is modified while it runs, so unlike programs from 'bf_compile'
+ * it must not be shared between virtual machines.
+ */
+struct bf_program *bf_compile_lazy(char *src);
+
+/**
+ * Runs passes 1, 2 and 4 on the loop of a lazily compiled program that starts
+ * at IR index 'pos', and lowers it in place of its ENTER opcode at 'pc'. This
+ * function returns false if memory couldn't be allocated.
+ */
+bool bf_compile_loop(struct bf_program *program, size_t pos, size_t pc);
+
 /**
  * Performs an unoptimized compilation of source. An AST isn't passed in the
  * function arguments since brainfuck is a very simple language.
  */
 bool bf_unoptimized_pass(struct bf_program *program, const char *src);
 
+/**
+ * Puts native opcodes in front of the well-known snippets in 'bf_idioms'.
+ */
+bool bf_optimization_pass_idioms(struct bf_program *program);
+
 /**
  * Combines common operations such as sequential increments into singular ADD /
  * SUB instructions.
@@ -45,32 +130,79 @@ bool bf_unoptimized_pass(struct bf_program *program, const char *src);
  */
 bool bf_optimization_pass_1(struct bf_program *program);
 
+/**
+ * Runs pass 1 on the instructions from 'start' up to 'end'. Loops must either
+ * be entirely in the range or not at all.
+ */
+bool bf_optimization_pass_1_range(struct bf_program *program, size_t start, size_t end);
+
 /**
  * Finds common patterns used in brainfuck programs and optimizes them into
  * ad-hoc instructions to speed up execution.
  */
 bool bf_optimization_pass_2(struct bf_program *program);
 
+/**
+ * Runs pass 2 on the instructions from 'start' up to 'end', see
+ * 'bf_optimization_pass_1_range'.
+ */
+bool bf_optimization_pass_2_range(struct bf_program *program, size_t start, size_t end);
+
 /**
  * Replaces complex instructions with simpler ones if possible.
  */
 bool bf_optimization_pass_3(struct bf_program *program);
 
 /**
- * Utility function that finds a matching closing brace in the source code.
- * This is used by the compiler to determine the addresses of conditional jumps
- *
- * A negative return value indicates a matching brace wasn't found.
+ * Marks loops that leave the pointer where they started as balanced and folds
+ * the pointer movement inside them into the shift of each instruction, so the
+ * body runs at fixed offsets from the pointer without ever writing to it.
+ */
+bool bf_optimization_pass_4(struct bf_program *program);
+
+/**
+ * Shifts the balanced loops from 'start' up to 'end' like pass 4 does, but
+ * leaves the NOPs it creates in place.
  */
-int bf_find_closing_brace(int pos, const char *src);
+void bf_shift_balanced_loops(struct bf_program *program, size_t start, size_t end);
 
 /**
- * Utility function that finds a matching opening brace in the source code.
- * This is used by the compiler to determine the addresses of conditional jumps
+ * Replaces balanced loops that count their cell down by one and only add
+ * multiples of cells and constants to other cells with closed forms, see
+ * 'bf_linear_solve'. Nested loops are solved first, so whole nests of such
+ * loops become a few MUL and POLY instructions.
  *
- * A negative return value indicates a matching brace wasn't found.
+ * This has to run after pass 4, which marks balanced loops and shifts them.
+ */
+bool bf_optimization_pass_linear(struct bf_program *program);
+
+/**
+ * Works out how many times loops run whose counter is known when they're
+ * entered and only changes by a constant amount in each iteration. Short loops
+ * without nested loops are unrolled, loops that never run are removed, and the
+ * BRANCH_Z of every other such loop is marked with BF_INS_FLAG_COUNTED and the
+ * trip count.
+ */
+bool bf_optimization_pass_trips(struct bf_program *program);
+
+/**
+ * Replaces runs of instructions that write bytes known at compile time with a
+ * single OUTS instruction.
+ */
+bool bf_optimization_pass_outs(struct bf_program *program);
+
+/**
+ * Replaces runs of CLEARs of neighbouring cells with CLEAR_RANGE, and loops
+ * like [[-<+>]>] that move a block of cells over by one with MOVE_BLOCK.
+ */
+bool bf_optimization_pass_ranges(struct bf_program *program);
+
+/**
+ * Marks the loops that only turn input into output a byte at a time with
+ * FILTER if the other cells they use are known at compile time, and builds the
+ * tables they run from, see 'bf_filter_build'.
  */
-int bf_find_opening_brace(int pos, const char *src);
+bool bf_optimization_pass_filters(struct bf_program *program);
 
 /**
  * Returns true if the character passed is a valid brainfuck instruction.
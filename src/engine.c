@@ -0,0 +1,188 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdio.h>
+#include <string.h>
+
+#include "engine.h"
+#include "jit.h"
+
+/** Names of the engines for --engine, in the order of 'enum bf_engine'. */
+static const char *const bf_engine_names[] = { "interpreter", "lazy", "jit", "auto" };
+
+bool bf_engine_parse(const char *name, enum bf_engine *engine)
+{
+    for (size_t i = 0; i < sizeof(bf_engine_names) / sizeof(bf_engine_names[0]); i++) {
+        if (strcmp(name, bf_engine_names[i]) == 0) {
+            *engine = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+const char *bf_engine_name(enum bf_engine engine)
+{
+    return bf_engine_names[engine];
+}
+
+enum bf_engine bf_engine_pick_source(const char *src, struct bf_engine_choice *choice)
+{
+    memset(choice, 0, sizeof(struct bf_engine_choice));
+    choice->engine = BF_ENGINE_AUTO;
+
+    if (strlen(src) > BF_ENGINE_LAZY_SOURCE_SIZE) {
+        choice->engine = BF_ENGINE_LAZY;
+        choice->reason = "the script is too large to optimize up front";
+    }
+
+    return choice->engine;
+}
+
+/**
+ * Fills in what the cost model looks at in the IR of a program.
+ */
+void bf_engine_measure(const struct bf_program *program, struct bf_engine_choice *choice)
+{
+    size_t depth = 0;
+
+    choice->size = program->size;
+    choice->depth = 0;
+    choice->input = false;
+
+    for (size_t i = 0; i < program->size; i++) {
+        switch (program->ir[i].opcode) {
+        case BF_INS_BRANCH_Z:
+            if (++depth > choice->depth) {
+                choice->depth = depth;
+            }
+            break;
+        case BF_INS_BRANCH_NZ:
+            depth--;
+            break;
+        case BF_INS_IN:
+            choice->input = true;
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+/** Output the sample run holds back before it has to grow its buffer. */
+#define BF_ENGINE_SAMPLE_CHUNK 4096
+
+/**
+ * Interprets the start of a program on a buffered vm, holding its output back
+ * in 'output' until the program finishes. Stops when the program reads input,
+ * runs out of 'budget' or writes more than BF_ENGINE_SAMPLE_OUTPUT bytes, and
+ * stores the result of the last step in 'code'. Returns false if memory
+ * couldn't be allocated, otherwise 'output' has to be freed by the caller.
+ */
+bool bf_engine_sample(struct bf_vm *vm, uint64_t budget, int *code, uint8_t **output, size_t *output_size)
+{
+    struct bf_result result;
+    uint8_t *grown;
+    size_t capacity = BF_ENGINE_SAMPLE_CHUNK;
+
+    *output_size = 0;
+    *output = malloc(capacity);
+    if (!*output) {
+        return false;
+    }
+    bf_vm_set_output(vm, *output, capacity);
+
+    for (;;) {
+        result = bf_vm_step(vm, budget - vm->dispatches);
+        *output_size += vm->output_size;
+        if (result.code != BF_RESULT_NEED_DRAIN || vm->dispatches >= budget) {
+            break;
+        }
+
+        // The output that's held back is only ever grown, the drained part
+        // stays where it is.
+        if (capacity >= BF_ENGINE_SAMPLE_OUTPUT || !(grown = realloc(*output, capacity * 2))) {
+            break;
+        }
+        *output = grown;
+        capacity *= 2;
+        bf_vm_set_output(vm, *output + *output_size, capacity - *output_size);
+    }
+    bf_vm_set_output(vm, NULL, 0);
+    *code = result.code;
+
+    return true;
+}
+
+bool bf_engine_pick(struct bf_vm *vm, struct bf_engine_choice *choice)
+{
+    struct bf_program *program = vm->program;
+    uint32_t vm_flags = vm->vm_flags;
+    uint64_t budget;
+    uint8_t *output;
+    size_t output_size;
+    int code;
+
+    memset(choice, 0, sizeof(struct bf_engine_choice));
+    bf_engine_measure(program, choice);
+
+    // Loading the program again on a fresh vm only changes its flags.
+    budget = BF_ENGINE_SAMPLE_BUDGET + program->size * BF_ENGINE_JIT_COST;
+    bf_vm_load(vm, program, vm_flags | BF_INPUT_BUFFER | BF_OUTPUT_BUFFER);
+    if (!bf_engine_sample(vm, budget, &code, &output, &output_size)) {
+        return false;
+    }
+    choice->sampled = vm->dispatches;
+
+    if (code == BF_RESULT_SUCCESS) {
+        fwrite(output, 1, output_size, stdout);
+        free(output);
+        choice->engine = BF_ENGINE_INTERPRETER;
+        choice->reason = "the sample run finished the script";
+        choice->finished = true;
+        return true;
+    }
+    free(output);
+
+    if (code == BF_RESULT_ERROR) {
+        choice->engine = BF_ENGINE_INTERPRETER;
+        choice->reason = "the sample run failed";
+    } else if (!bf_jit_supported()) {
+        choice->engine = BF_ENGINE_INTERPRETER;
+        choice->reason = "the JIT isn't supported here";
+    } else if (code == BF_RESULT_NEED_INPUT && choice->depth < BF_ENGINE_JIT_DEPTH) {
+        choice->engine = BF_ENGINE_INTERPRETER;
+        choice->reason = "the script reads input and its loops are shallow";
+    } else if (code == BF_RESULT_NEED_INPUT) {
+        choice->engine = BF_ENGINE_JIT;
+        choice->reason = "the script reads input and its loops are deep";
+    } else {
+        choice->engine = BF_ENGINE_JIT;
+        choice->reason = "the script outran the sample run";
+    }
+
+    // Whatever the sample run did is thrown away, the script starts over.
+    bf_vm_reset(vm);
+    bf_vm_load(vm, program, vm_flags);
+
+    return true;
+}
@@ -0,0 +1,113 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef BF_ENGINE_H
+#define BF_ENGINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interpreter.h"
+
+/**
+ * Scripts with more source code than this are compiled lazily by
+ * --engine=auto, since optimizing all of them up front would take longer than
+ * most of them run.
+ */
+#define BF_ENGINE_LAZY_SOURCE_SIZE (1 << 20)
+
+/**
+ * Instructions the sample run of 'bf_engine_pick' interprets before giving up
+ * on a script being short. Compiling machine code costs about as much as
+ * interpreting a few thousand instructions, plus BF_ENGINE_JIT_COST for every
+ * instruction of IR, so anything that runs for longer than the sample is
+ * faster with the JIT.
+ */
+#define BF_ENGINE_SAMPLE_BUDGET (1 << 16)
+#define BF_ENGINE_JIT_COST 8
+
+/** Output the sample run may hold back before it gives up. */
+#define BF_ENGINE_SAMPLE_OUTPUT (1 << 20)
+
+/**
+ * Scripts that stop the sample run to read input are compiled to machine code
+ * if their loops are nested at least this deep, since that's where the time
+ * between reads goes.
+ */
+#define BF_ENGINE_JIT_DEPTH 3
+
+/**
+ * Ways to run a script.
+ */
+enum bf_engine {
+    BF_ENGINE_INTERPRETER, // Optimized up front and interpreted.
+    BF_ENGINE_LAZY, // Loops are optimized when they first run, see 'bf_compile_lazy'.
+    BF_ENGINE_JIT, // Compiled to machine code, see 'bf_jit_compile'.
+    BF_ENGINE_AUTO, // One of the above, picked by 'bf_engine_pick'.
+};
+
+/**
+ * The engine 'bf_engine_pick' picked for a script, why, and what it was
+ * based on.
+ */
+struct bf_engine_choice {
+    enum bf_engine engine;
+    const char *reason;
+    bool finished; // The sample run ran the whole script and wrote its output.
+    uint64_t sampled; // Instructions run by the sample run.
+    size_t size; // Instructions of IR.
+    size_t depth; // How deep loops are nested.
+    bool input; // The script has an IN instruction.
+};
+
+/**
+ * Looks up an engine by the name --engine takes. Returns false if there's no
+ * such engine.
+ */
+bool bf_engine_parse(const char *name, enum bf_engine *engine);
+
+/**
+ * Returns the name --engine takes for an engine.
+ */
+const char *bf_engine_name(enum bf_engine engine);
+
+/**
+ * Picks the engine of a script from its source code alone, before it's
+ * compiled. Returns BF_ENGINE_LAZY for scripts too large to optimize up front
+ * and fills in 'choice', otherwise it returns BF_ENGINE_AUTO and the rest is
+ * left to 'bf_engine_pick'.
+ */
+enum bf_engine bf_engine_pick_source(const char *src, struct bf_engine_choice *choice);
+
+/**
+ * Picks the engine of a script from its optimized IR and a short sample run.
+ * The sample run interprets the start of the script on 'vm', which has to be
+ * freshly created without BF_INPUT_BUFFER or BF_OUTPUT_BUFFER, holding its
+ * output back. If the script finishes within BF_ENGINE_SAMPLE_BUDGET
+ * instructions without reading input, its output is written to stdout and
+ * 'choice->finished' is set. Otherwise the vm is reset so the script can run
+ * again from the start on the picked engine. Returns false if memory couldn't
+ * be allocated.
+ */
+bool bf_engine_pick(struct bf_vm *vm, struct bf_engine_choice *choice);
+
+#endif
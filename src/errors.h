@@ -24,6 +24,12 @@
 #define BF_RESULT_SUCCESS 0
 #define BF_RESULT_ERROR 1
 
+// Not errors, these tell the caller that the operation hasn't finished yet and
+// should be continued later.
+#define BF_RESULT_YIELD 2
+#define BF_RESULT_NEED_INPUT 3
+#define BF_RESULT_NEED_DRAIN 4
+
 /*
     NOTE: No macros for automatic return on bf_result failure exist since they
     may be misused when memory needs to be cleaned up and is forgotton about.
@@ -41,8 +47,10 @@
  * where error handling is needed.
  *
  * The 'code' field holds an integer that can be checked to check for success
- * or failure of a function. Any integer that's not a zero is an error. An
- * optional c string error message may also be set, but isn't always available.
+ * or failure of a function. Any integer that's not a zero is an error, with the
+ * exception of BF_RESULT_YIELD, BF_RESULT_NEED_INPUT and BF_RESULT_NEED_DRAIN
+ * which mean the function should be called again later. An optional c string error message may also be set, but isn't always
+ * available.
  */
 struct bf_result {
     int code;
@@ -0,0 +1,187 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <string.h>
+
+#include "filter.h"
+#include "interpreter.h"
+
+/** Backwards jumps a single iteration may take before its table is given up on. */
+#define BF_FILTER_MAX_JUMPS 0x10000
+
+/**
+ * Runs the IR from 'start' up to 'end' on 'cells', which points at the cell
+ * under the pointer. Stores the byte that's written in 'output'. Returns false
+ * if it isn't exactly one byte, or if the IR can't be run this way.
+ */
+bool bf_filter_run(const struct bf_program *program, size_t start, size_t end, uint8_t *cells, uint8_t *output)
+{
+    const struct bf_instruction *instr;
+    uint8_t *cell;
+    size_t outputs = 0;
+    size_t jumps = 0;
+
+    for (size_t i = start; i < end; i++) {
+        instr = &program->ir[i];
+        cell = &cells[(int16_t)instr->shift];
+
+        switch (instr->opcode) {
+        case BF_INS_NOP:
+            break;
+        case BF_INS_INC_V:
+            (*cell)++;
+            break;
+        case BF_INS_DEC_V:
+            (*cell)--;
+            break;
+        case BF_INS_ADD_V:
+            *cell += instr->argument;
+            break;
+        case BF_INS_SUB_V:
+            *cell -= instr->argument;
+            break;
+        case BF_INS_CLEAR:
+            *cell = 0;
+            break;
+        case BF_INS_CLEAR_RANGE:
+            memset(cell, 0, instr->argument);
+            break;
+        case BF_INS_COPY:
+            cell[(int16_t)instr->argument] += *cell;
+            break;
+        case BF_INS_MUL:
+            cell[(int16_t)instr->offset] += instr->argument * *cell;
+            break;
+        case BF_INS_OUT:
+            *output = *cell;
+            outputs++;
+            break;
+        case BF_INS_BRANCH_Z:
+            if (*cell == 0) {
+                i = instr->argument - 1;
+            }
+            break;
+        case BF_INS_BRANCH_NZ:
+            if (*cell != 0) {
+                if (++jumps > BF_FILTER_MAX_JUMPS) {
+                    return false;
+                }
+                i = instr->argument - 1;
+            }
+            break;
+        default:
+            return false;
+        }
+    }
+
+    return outputs == 1;
+}
+
+bool bf_filter_cells(const struct bf_program *program, size_t loop, long *low, long *high)
+{
+    size_t end = program->ir[loop].argument - 2; // The IN that ends every iteration.
+    long delta, first, second;
+
+    *low = 0;
+    *high = 0;
+    for (size_t i = loop + 1; i < end; i++) {
+        bf_program_access(&program->ir[i], &delta, &first, &second);
+        *low = first < *low ? first : *low;
+        *low = second < *low ? second : *low;
+        *high = first > *high ? first : *high;
+        *high = second > *high ? second : *high;
+    }
+
+    // Cells further apart than the size of memory would be the same cell.
+    return *high - *low + 1 <= BF_MEMORY_SIZE;
+}
+
+bool bf_filter_build(const struct bf_program *program, size_t loop, const uint8_t *cells, struct bf_filter *filter)
+{
+    size_t end = program->ir[loop].argument - 2;
+    long low, high;
+    size_t size;
+    uint8_t *initial;
+    uint8_t *scratch;
+    bool result = false;
+
+    if (!bf_filter_cells(program, loop, &low, &high)) {
+        goto error1;
+    }
+    size = high - low + 1;
+
+    initial = malloc(size * 2);
+    if (!initial) {
+        goto error1;
+    }
+    scratch = initial + size;
+
+    memcpy(initial, &cells[low], size);
+    initial[-low] = 0; // What every iteration has to leave behind.
+
+    filter->table[0] = 0;
+    filter->identity = true;
+    for (int byte = 1; byte < 256; byte++) {
+        memcpy(scratch, initial, size);
+        scratch[-low] = byte;
+
+        if (!bf_filter_run(program, loop + 1, end, &scratch[-low], &filter->table[byte])
+            || memcmp(scratch, initial, size) != 0) {
+            goto error2;
+        }
+        filter->identity &= filter->table[byte] == byte;
+    }
+
+    for (size_t i = 0; i < 65536; i++) {
+        uint16_t value = i;
+        uint8_t bytes[2];
+
+        memcpy(bytes, &value, sizeof(bytes));
+        bytes[0] = filter->table[bytes[0]];
+        bytes[1] = filter->table[bytes[1]];
+        memcpy(&filter->pairs[i], bytes, sizeof(bytes));
+    }
+    result = true;
+
+error2:
+    free(initial);
+error1:
+    return result;
+}
+
+void bf_filter_map(const struct bf_filter *filter, const uint8_t *input, uint8_t *output, size_t count)
+{
+    uint16_t pair;
+    size_t i = 0;
+
+    if (filter->identity) {
+        memcpy(output, input, count);
+        return;
+    }
+
+    for (; i + 2 <= count; i += 2) {
+        memcpy(&pair, &input[i], sizeof(pair));
+        memcpy(&output[i], &filter->pairs[pair], sizeof(pair));
+    }
+    if (i < count) {
+        output[i] = filter->table[input[i]];
+    }
+}
@@ -0,0 +1,69 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef BF_FILTER_H
+#define BF_FILTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "program.h"
+
+/**
+ * What a filter loop writes for every byte it reads. 'pairs' maps two bytes at
+ * a time, read from memory as a 16-bit value in host byte order, which halves
+ * the number of lookups.
+ */
+struct bf_filter {
+    uint8_t table[256];
+    uint16_t pairs[65536];
+    bool identity; // The loop copies its input unchanged.
+};
+
+/**
+ * Stores the range of cells that an iteration of the filter loop at 'loop' may
+ * access in 'low' and 'high', as distances from the pointer. Returns false if
+ * the range is larger than memory.
+ */
+bool bf_filter_cells(const struct bf_program *program, size_t loop, long *low, long *high);
+
+/**
+ * Works out what the filter loop at 'loop' writes for every byte it reads, if
+ * the cells from 'bf_filter_cells' hold 'cells' when it's entered. 'cells'
+ * points at the cell under the pointer, whose value doesn't matter. A filter
+ * loop reads the next byte at the end of every iteration and writes one byte
+ * per iteration (see 'bf_optimization_pass_filters'). The entries for zero
+ * are never used, since reading a zero ends the loop.
+ *
+ * Returns false if an iteration doesn't clear the cell at the pointer before
+ * reading, leaves any other cell changed, or takes too long, since the loop
+ * doesn't only depend on the byte it's given then. Also returns false if
+ * memory couldn't be allocated.
+ */
+bool bf_filter_build(const struct bf_program *program, size_t loop, const uint8_t *cells, struct bf_filter *filter);
+
+/**
+ * Writes what a filter loop writes for 'count' bytes of 'input' to 'output'.
+ */
+void bf_filter_map(const struct bf_filter *filter, const uint8_t *input, uint8_t *output, size_t count);
+
+#endif
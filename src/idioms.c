@@ -0,0 +1,213 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <string.h>
+
+#include "bytecode.h"
+#include "compiler.h"
+#include "idioms.h"
+#include "interpreter.h"
+
+/** Cell 'offset' cells away from 'base', wrapping around memory like vms do. */
+#define BF_IDIOM_CELL(memory, base, offset) ((memory)[(uint16_t)((base) + (offset))])
+
+/** Where the cells of an idiom start in memory while it's being verified. */
+#define BF_IDIOM_VERIFY_BASE 1024
+
+/** Cells on either side of an idiom that are also compared while verifying. */
+#define BF_IDIOM_VERIFY_MARGIN 16
+
+bool bf_idiom_divmod(uint8_t *memory, size_t base)
+{
+    uint8_t n = BF_IDIOM_CELL(memory, base, 0);
+    uint8_t d = BF_IDIOM_CELL(memory, base, 1);
+
+    // The loop doesn't run at all, whatever is in the other cells.
+    if (n == 0) {
+        return true;
+    }
+
+    // A divisor of 1 walks off to the left of the snippet.
+    if (d < 2) {
+        return false;
+    }
+    for (int i = 2; i < 6; i++) {
+        if (BF_IDIOM_CELL(memory, base, i) != 0) {
+            return false;
+        }
+    }
+
+    BF_IDIOM_CELL(memory, base, 0) = 0;
+    BF_IDIOM_CELL(memory, base, 1) = d - n % d;
+    BF_IDIOM_CELL(memory, base, 2) = n % d;
+    BF_IDIOM_CELL(memory, base, 3) = n / d;
+
+    return true;
+}
+
+size_t bf_idiom_print_dec(const uint8_t *memory, size_t base, uint8_t *output)
+{
+    uint8_t value = BF_IDIOM_CELL(memory, base, 0);
+    size_t count = value >= 100 ? 3 : value >= 10 ? 2 : 1;
+
+    for (int i = 1; i < 10; i++) {
+        if (BF_IDIOM_CELL(memory, base, i) != 0) {
+            return 0;
+        }
+    }
+
+    for (size_t i = count; i-- > 0; value /= 10) {
+        output[i] = '0' + value % 10;
+    }
+
+    return count;
+}
+
+/**
+ * Compiles the snippet of an idiom with every pass except the one that finds
+ * idioms, so that it's run the long way. The pass that finds constant output
+ * is left out too since it takes memory to start out cleared, which it isn't
+ * here.
+ */
+struct bf_program *bf_idiom_compile_reference(const struct bf_idiom *idiom)
+{
+    const struct bf_optimization_pass *pass;
+    struct bf_program *program;
+
+    program = bf_program_create();
+    if (!program) {
+        goto error1;
+    }
+
+    if (!bf_unoptimized_pass(program, idiom->source)) {
+        goto error2;
+    }
+    for (pass = bf_optimization_passes; pass->name; pass++) {
+        if (pass->run == bf_optimization_pass_idioms || pass->run == bf_optimization_pass_outs) {
+            continue;
+        }
+        if (!pass->run(program)) {
+            goto error2;
+        }
+    }
+    if (!bf_program_lower(program)) {
+        goto error2;
+    }
+
+    return program;
+
+error2:
+    bf_program_destroy(program);
+error1:
+    return NULL;
+}
+
+/**
+ * Runs the native version of an idiom on 'memory'. Returns the number of bytes
+ * written to 'output', or -1 if it doesn't apply.
+ */
+int bf_idiom_run_native(const struct bf_idiom *idiom, uint8_t *memory, size_t base, uint8_t *output)
+{
+    size_t count;
+
+    switch (idiom->opcode) {
+    case BF_INS_DIVMOD:
+        return bf_idiom_divmod(memory, base) ? 0 : -1;
+    case BF_INS_PRINT_DEC:
+        count = bf_idiom_print_dec(memory, base, output);
+        return count > 0 ? (int)count : -1;
+    default:
+        return -1;
+    }
+}
+
+bool bf_idiom_verify(const struct bf_idiom *idiom, size_t *states)
+{
+    const size_t base = BF_IDIOM_VERIFY_BASE;
+    const size_t low = base - BF_IDIOM_VERIFY_MARGIN;
+    const size_t size = idiom->width + BF_IDIOM_VERIFY_MARGIN * 2;
+    struct bf_program *program;
+    struct bf_vm *vm;
+    struct bf_result result;
+    uint8_t native[BF_MEMORY_SIZE] = { 0 };
+    uint8_t expected[BF_IDIOM_MAX_OUTPUT];
+    uint8_t output[BF_IDIOM_MAX_OUTPUT + 1];
+    int inputs[32];
+    int count = 0;
+    int written;
+    uint64_t total;
+    bool verified = false;
+
+    for (int i = 0; i < idiom->width; i++) {
+        if (idiom->inputs & (1u << i)) {
+            inputs[count++] = i;
+        }
+    }
+    total = (uint64_t)1 << (8 * count);
+
+    program = bf_idiom_compile_reference(idiom);
+    if (!program) {
+        goto error1;
+    }
+    vm = bf_vm_create(program, BF_OUTPUT_BUFFER);
+    if (!vm) {
+        goto error1;
+    }
+
+    *states = 0;
+    for (uint64_t state = 0; state < total; state++) {
+        memset(&native[low], 0, size);
+        for (int i = 0; i < count; i++) {
+            native[base + inputs[i]] = state >> (8 * i);
+        }
+
+        // The cells are set up for the reference before the native version
+        // changes them.
+        memcpy(&vm->memory[low], &native[low], size);
+        vm->pc = 0;
+        vm->pointer = base;
+        vm->output_size = 0;
+        bf_vm_set_output(vm, output, sizeof(output));
+
+        written = bf_idiom_run_native(idiom, native, base, expected);
+        if (written < 0) {
+            continue; // The snippet runs instead.
+        }
+
+        // Snippets are short, anything that runs for longer than this is
+        // stuck in a loop.
+        result = bf_vm_step(vm, 1 << 20);
+        if (result.code != BF_RESULT_SUCCESS
+            || vm->pointer != base
+            || memcmp(&vm->memory[low], &native[low], size) != 0
+            || vm->output_size != (size_t)written
+            || memcmp(output, expected, written) != 0) {
+            goto error2;
+        }
+        (*states)++;
+    }
+    verified = true;
+
+error2:
+    bf_vm_destroy(vm);
+error1:
+    return verified;
+}
@@ -0,0 +1,56 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef BF_IDIOMS_H
+#define BF_IDIOMS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "patterns.h"
+
+/** Most bytes the native version of an idiom writes. */
+#define BF_IDIOM_MAX_OUTPUT 3
+
+/**
+ * Runs DIVMOD on the cells starting at 'base'. Returns false without touching
+ * memory if the cells aren't in a state that's been verified, in which case
+ * the snippet has to run instead.
+ */
+bool bf_idiom_divmod(uint8_t *memory, size_t base);
+
+/**
+ * Works out what PRINT_DEC writes for the cells starting at 'base' and stores
+ * it in 'output', which has room for BF_IDIOM_MAX_OUTPUT bytes. Returns the
+ * number of bytes, or 0 if the snippet has to run instead.
+ */
+size_t bf_idiom_print_dec(const uint8_t *memory, size_t base, uint8_t *output);
+
+/**
+ * Checks the native version of an idiom against its snippet compiled without
+ * idioms, on every state of the input cells the native version accepts. Both
+ * have to leave memory and the pointer in the same state and write the same
+ * output. The number of states checked is stored in 'states'.
+ */
+bool bf_idiom_verify(const struct bf_idiom *idiom, size_t *states);
+
+#endif
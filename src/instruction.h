@@ -46,20 +46,65 @@ enum bf_opcode {
     BF_INS_CLEAR, // [-]
     BF_INS_COPY, // (BF_INS_COPY, 1), (BF_INS_COPY, 2), (BF_INS_CLEAR) = [->+>+<<]
     BF_INS_MUL,
+    BF_INS_DIVMOD, // (BF_INS_DIVMOD, address), see 'bf_idioms'
+    BF_INS_PRINT_DEC, // (BF_INS_PRINT_DEC, address)
+    BF_INS_FILTER, // (BF_INS_FILTER, address) with the table as offset = ,[.,]
+    BF_INS_OUTS, // (BF_INS_OUTS, string) with the length as offset, see 'bf_optimization_pass_outs'
+    BF_INS_POLY, // (BF_INS_POLY, factor | degree << 8), see 'bf_program_poly'
+    BF_INS_CLEAR_RANGE, // (BF_INS_CLEAR_RANGE, 3) = [-]>[-]>[-]<<
+    BF_INS_MOVE_BLOCK, // (BF_INS_MOVE_BLOCK, 1) = [[-<+>]>], see 'bf_optimization_pass_ranges'
 };
 
+/** Set on both branches of a loop that leaves the pointer where it started. */
+#define BF_INS_FLAG_BALANCED 0x1
+
+/** Set on instructions proven to stay inside of memory, see 'bf_program_bound'. */
+#define BF_INS_FLAG_BOUNDED 0x2
+
+/**
+ * Set on loops that are optimized the first time they run, see
+ * 'bf_compile_lazy'.
+ */
+#define BF_INS_FLAG_LAZY 0x4
+
+/**
+ * Set on BRANCH_Z of loops that always run 'offset' times, see
+ * 'bf_optimization_pass_trips'.
+ */
+#define BF_INS_FLAG_COUNTED 0x8
+
 /**
  * Contains an opcode and an optional argument paired with the instruction.
  * This argument is almost always an address or handle.
  *
  * Offset is used for MUL instructions. Branching instructions will also have
  * them set during optimization to store metadata, though this has no effect on
- * execution.
+ * execution, except for the trip count of a counted BRANCH_Z. Both are 32 bits
+ * wide so that branches can address programs with more than 65536 instructions.
+ * The distances of MUL and COPY only use the low 16 bits. POLY keeps the
+ * distance of its target cell in the low 16 bits and the distance of its source
+ * cell in the high 16 bits.
+ *
+ * Shift is the distance from the pointer to the cell the instruction operates
+ * on (wrapping at 16 bits, so it may be negative). These passes set it:
+ *
+ * - 'bf_optimization_pass_4' (and lazy relowering) folds pointer movement into
+ *   the instructions of balanced loops.
+ * - 'bf_optimization_pass_linear' emits the MUL, POLY and CLEAR of a solved
+ *   loop shifted to the counter cell of each nested loop they come from.
+ * - 'bf_optimization_pass_outs' emits CLEAR and ADD_V for the cells it leaves
+ *   behind after an OUTS, outside of loops too.
+ * - 'bf_optimization_pass_ranges' emits CLEAR_RANGE, outside of loops too.
+ *
+ * For MUL, COPY and POLY the shift moves every cell they access. CLEAR_RANGE
+ * clears 'argument' cells from the one at its shift onwards.
  */
 struct __attribute__((aligned)) bf_instruction {
     enum bf_opcode opcode;
-    uint16_t argument;
-    uint16_t offset;
+    uint32_t argument;
+    uint32_t offset;
+    uint16_t shift;
+    uint16_t flags;
 };
 
 #endif
@@ -18,29 +18,58 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+// Needed for MAP_ANONYMOUS and madvise, which aren't part of C11 or POSIX.
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
+#include "bytecode.h"
+#include "compiler.h"
+#include "filter.h"
+#include "idioms.h"
 #include "interpreter.h"
+#include "utils.h"
 
 struct bf_vm *bf_vm_create(struct bf_program *program, uint32_t vm_flags)
 {
-    struct bf_vm *vm = calloc(1, sizeof(struct bf_vm));
-    if (!vm) {
-        goto error1; // Failed allocation, cannot continue.
-    }
+    struct bf_vm *vm;
+
+    if (bf_utils_check_flag(vm_flags, BF_SPARSE_MEMORY)) {
+        vm = calloc(1, sizeof(struct bf_vm));
+        if (!vm) {
+            goto error1; // Failed allocation, cannot continue.
+        }
 
-    if (program && program->size > 0) {
-        vm->program = program;
+        // Private anonymous pages read as the shared zero page until they're
+        // written to, which is when the kernel allocates them.
+        vm->memory = mmap(NULL, BF_MEMORY_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (vm->memory == MAP_FAILED) {
+            goto error2;
+        }
     } else {
-        goto error2;
+        vm = calloc(1, sizeof(struct bf_vm) + BF_MEMORY_SIZE);
+        if (!vm) {
+            goto error1; // Failed allocation, cannot continue.
+        }
+        vm->memory = vm->tape;
+    }
+    vm->vm_flags = vm_flags & BF_SPARSE_MEMORY;
+
+    if (!bf_vm_load(vm, program, vm_flags)) {
+        goto error3;
     }
-    vm->pc = 0;
-    vm->pointer = 0;
-    vm->vm_flags = vm_flags;
 
     return vm;
 
+error3:
+    if (vm->memory != vm->tape) {
+        munmap(vm->memory, BF_MEMORY_SIZE);
+    }
 error2:
     free(vm);
 error1:
@@ -49,113 +78,666 @@ error1:
     return NULL;
 }
 
+bool bf_vm_load(struct bf_vm *vm, struct bf_program *program, uint32_t vm_flags)
+{
+    if (!program || program->size == 0) {
+        return false;
+    }
+
+    // Programs built by 'bf_compile' are already lowered, but those assembled
+    // by hand only have IR.
+    if (!program->code && !bf_program_lower(program)) {
+        return false;
+    }
+    vm->program = program;
+    vm->pc = 0;
+    vm->pointer = 0;
+    vm->vm_flags = (vm_flags & ~BF_SPARSE_MEMORY) | (vm->vm_flags & BF_SPARSE_MEMORY);
+    vm->dispatches = 0;
+
+    return true;
+}
+
+/**
+ * Zeroes memory from 'start' up to 'end'. Sparse memory is handed back to the
+ * kernel instead, which also releases it.
+ */
+void bf_vm_clear(struct bf_vm *vm, size_t start, size_t end)
+{
+    size_t page_size;
+
+    if (start >= end) {
+        return;
+    } else if (vm->memory == vm->tape) {
+        memset(&vm->memory[start], 0, end - start);
+        return;
+    }
+
+    // Whole pages are dropped, but memory outside of the range is zero
+    // already so nothing is lost.
+    page_size = sysconf(_SC_PAGESIZE);
+    start -= start % page_size;
+    end += (page_size - end % page_size) % page_size;
+    madvise(&vm->memory[start], end - start, MADV_DONTNEED);
+}
+
+void bf_vm_reset(struct bf_vm *vm)
+{
+    size_t reach = vm->program ? vm->program->reach : BF_PROGRAM_REACH_UNKNOWN;
+    long start = -(long)reach;
+    long end = (long)vm->dirty_high + (long)reach + 1;
+
+    // The recorded range is widened by how far the program reaches from the
+    // pointer between backwards jumps. Cells are addressed modulo the memory
+    // size, so the range may wrap around either end.
+    if (vm->dirty_high >= BF_MEMORY_SIZE || end - start >= BF_MEMORY_SIZE) {
+        bf_vm_clear(vm, 0, BF_MEMORY_SIZE);
+    } else {
+        if (start < 0) {
+            bf_vm_clear(vm, BF_MEMORY_SIZE + start, BF_MEMORY_SIZE);
+            start = 0;
+        }
+        if (end > BF_MEMORY_SIZE) {
+            bf_vm_clear(vm, 0, end - BF_MEMORY_SIZE);
+            end = BF_MEMORY_SIZE;
+        }
+        bf_vm_clear(vm, start, end);
+    }
+
+    vm->pc = 0;
+    vm->pointer = 0;
+    vm->dispatches = 0;
+    vm->dirty_high = 0;
+    vm->input = NULL;
+    vm->input_size = 0;
+    vm->input_position = 0;
+    vm->input_closed = false;
+    vm->output = NULL;
+    vm->output_capacity = 0;
+    vm->output_size = 0;
+    vm->string_position = 0;
+}
+
 void bf_vm_destroy(struct bf_vm *vm)
 {
-    bf_program_destroy(vm->program);
+    if (vm->program) {
+        bf_program_destroy(vm->program);
+    }
+    if (vm->memory != vm->tape) {
+        munmap(vm->memory, BF_MEMORY_SIZE);
+    }
+    free(vm->stdin_buffer);
     free(vm);
 }
 
-struct bf_result bf_vm_run(struct bf_vm *vm)
+/** Returned by 'bf_vm_getc' when a buffered vm has to wait for more input. */
+#define BF_VM_WOULD_BLOCK (EOF - 1)
+
+void bf_vm_feed_input(struct bf_vm *vm, const uint8_t *input, size_t size)
+{
+    vm->input = input;
+    vm->input_size = size;
+    vm->input_position = 0;
+}
+
+void bf_vm_close_input(struct bf_vm *vm)
+{
+    vm->input_closed = true;
+}
+
+void bf_vm_set_output(struct bf_vm *vm, uint8_t *output, size_t capacity)
+{
+    vm->output = output;
+    vm->output_capacity = capacity;
+    vm->output_size = 0;
+}
+
+void bf_vm_clear_cells(uint8_t *memory, size_t start, size_t count)
+{
+    if (start + count > BF_MEMORY_SIZE) {
+        memset(memory, 0, start + count - BF_MEMORY_SIZE);
+        count = BF_MEMORY_SIZE - start;
+    }
+    memset(&memory[start], 0, count);
+}
+
+size_t bf_vm_move_block(uint8_t *memory, size_t pointer, int direction, uint64_t *limit)
+{
+    const uint8_t *zero;
+    size_t length;
+
+    if (memory[pointer] == 0) {
+        return pointer;
+    }
+
+    // Every cell after the first is moved into a cell that the iteration
+    // before it cleared, so the block as a whole is moved with memmove.
+    if (direction > 0 && pointer > 0 && (zero = memchr(&memory[pointer], 0, BF_MEMORY_SIZE - pointer))) {
+        length = zero - &memory[pointer];
+        memory[pointer - 1] += memory[pointer];
+        memmove(&memory[pointer], &memory[pointer + 1], length - 1);
+        memory[pointer + length - 1] = 0;
+        return pointer + length;
+    } else if (direction < 0 && pointer < BF_MEMORY_SIZE - 1) {
+        length = 1;
+        while (length <= pointer && memory[pointer - length] != 0) {
+            length++;
+        }
+        if (length <= pointer) {
+            memory[pointer + 1] += memory[pointer];
+            memmove(&memory[pointer - length + 2], &memory[pointer - length + 1], length - 1);
+            memory[pointer - length + 1] = 0;
+            return pointer - length;
+        }
+    }
+
+    // Blocks that run into either end of memory wrap around it.
+    while (memory[pointer] != 0 && *limit > 0) {
+        (*limit)--;
+        memory[(uint16_t)(pointer - direction)] += memory[pointer];
+        memory[pointer] = 0;
+        pointer = (uint16_t)(pointer + direction);
+    }
+
+    return pointer;
+}
+
+/** Size of the buffer stdin is read into, see 'bf_vm_read_stdin'. */
+#define BF_VM_STDIN_BUFFER_SIZE 0x20000
+
+/**
+ * Reads the next part of stdin into the input buffer of a vm that's created
+ * without BF_INPUT_BUFFER. Reading is done directly rather than with stdio so
+ * that the vm knows exactly which bytes a program has consumed. Returns false
+ * and closes the input once there's nothing left to read.
+ */
+static __attribute__((noinline)) bool bf_vm_read_stdin(struct bf_vm *vm)
+{
+    ssize_t count;
+
+    if (!vm->stdin_buffer && !(vm->stdin_buffer = malloc(BF_VM_STDIN_BUFFER_SIZE))) {
+        vm->input_closed = true;
+        return false;
+    }
+
+    // stdio no longer flushes stdout when stdin is read, so a prompt has to
+    // be written out before waiting for the answer.
+    if (!(vm->vm_flags & BF_OUTPUT_BUFFER)) {
+        fflush(stdout);
+    }
+
+    do {
+        count = read(STDIN_FILENO, vm->stdin_buffer, BF_VM_STDIN_BUFFER_SIZE);
+    } while (count < 0 && errno == EINTR);
+
+    if (count <= 0) {
+        vm->input_closed = true;
+        return false;
+    }
+
+    vm->input = vm->stdin_buffer;
+    vm->input_size = count;
+    vm->input_position = 0;
+
+    return true;
+}
+
+/**
+ * Reads a byte of input from stdin or the input buffer. Returns EOF once
+ * there is no more input.
+ *
+ * This and 'bf_vm_putc' are kept out of line since I/O is rare compared to
+ * everything else, and inlining them costs the execution loop registers.
+ */
+static __attribute__((noinline)) int bf_vm_getc(struct bf_vm *vm)
+{
+    if (vm->input_position < vm->input_size) {
+        return vm->input[vm->input_position++];
+    } else if (vm->input_closed) {
+        return EOF;
+    } else if (!(vm->vm_flags & BF_INPUT_BUFFER)) {
+        return bf_vm_read_stdin(vm) ? vm->input[vm->input_position++] : EOF;
+    }
+
+    return BF_VM_WOULD_BLOCK;
+}
+
+/**
+ * Writes a byte of output to stdout or the output buffer. Returns false if
+ * the output buffer is full.
+ */
+static __attribute__((noinline)) bool bf_vm_putc(struct bf_vm *vm, uint8_t value)
+{
+    if (!(vm->vm_flags & BF_OUTPUT_BUFFER)) {
+        putchar(value);
+    } else if (vm->output_size < vm->output_capacity) {
+        vm->output[vm->output_size++] = value;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Writes 'length' bytes from the string table for OUTS. Returns false if the
+ * output buffer fills up first, in which case the rest is written when the
+ * instruction is retried.
+ */
+static __attribute__((noinline)) bool bf_vm_puts(struct bf_vm *vm, uint32_t start, uint32_t length)
+{
+    const uint8_t *string = &vm->program->strings[start];
+    size_t count;
+
+    if (!(vm->vm_flags & BF_OUTPUT_BUFFER)) {
+        fwrite(string, 1, length, stdout);
+        return true;
+    }
+
+    count = length - vm->string_position;
+    if (count > vm->output_capacity - vm->output_size) {
+        count = vm->output_capacity - vm->output_size;
+    }
+    memcpy(&vm->output[vm->output_size], &string[vm->string_position], count);
+    vm->output_size += count;
+    vm->string_position += count;
+
+    if (vm->string_position < length) {
+        return false;
+    }
+    vm->string_position = 0;
+
+    return true;
+}
+
+/**
+ * Writes what the native version of PRINT_DEC prints for the cells at 'base'.
+ * Returns false without writing anything if it doesn't apply or the output
+ * buffer can't take all of it, in which case the idiom's snippet runs.
+ */
+static __attribute__((noinline)) bool bf_vm_print_dec(struct bf_vm *vm, size_t base)
 {
-    struct bf_instruction *instr; // Owned and managed by vm.
-    int input; // Buffered input from stdin.
+    uint8_t digits[BF_IDIOM_MAX_OUTPUT];
+    size_t count = bf_idiom_print_dec(vm->memory, base, digits);
+
+    if (count == 0
+        || ((vm->vm_flags & BF_OUTPUT_BUFFER) && vm->output_capacity - vm->output_size < count)) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        bf_vm_putc(vm, digits[i]);
+    }
+
+    return true;
+}
+
+/** Bytes a filter loop writes to stdout at a time. */
+#define BF_VM_FILTER_CHUNK_SIZE 0x10000
+
+/**
+ * Runs a filter loop over buffers of input at a time with its table at index
+ * 'index' of the program's filters. Returns true once the loop has ended,
+ * which happens when it reads a zero or runs out of input, and leaves the cell
+ * at the pointer cleared like the loop would.
+ *
+ * Returns false if the loop has to run the slow way, in which case the state
+ * is as if the loop was about to be entered (again). That happens if the loop
+ * isn't entered at all, or when more input is needed or output has to be
+ * drained. An iteration only writes its byte once the byte after it is known,
+ * so that it never stops halfway through.
+ */
+static __attribute__((noinline)) bool bf_vm_filter(struct bf_vm *vm, size_t pointer, uint32_t index)
+{
+    const struct bf_filter *filter = &vm->program->filters[index];
+    uint8_t chunk[BF_VM_FILTER_CHUNK_SIZE];
+    uint8_t *output;
+    const uint8_t *input;
+    const uint8_t *zero;
+    uint8_t byte = vm->memory[pointer];
+    size_t room, count;
+    bool ended = false;
+
+    if (byte == 0) {
+        return false;
+    }
+
+    for (;;) {
+        room = vm->vm_flags & BF_OUTPUT_BUFFER ? vm->output_capacity - vm->output_size : sizeof(chunk);
+        if (room == 0) {
+            break;
+        }
+
+        if (vm->input_position == vm->input_size
+            && (vm->input_closed || (vm->vm_flags & BF_INPUT_BUFFER) || !bf_vm_read_stdin(vm))) {
+            if (!vm->input_closed) {
+                break;
+            }
+
+            // The last iteration read EOF, which leaves its cleared cell alone.
+            bf_vm_putc(vm, filter->table[byte]);
+            byte = 0;
+            ended = true;
+            break;
+        }
+
+        // Every byte that's read finishes the iteration of the byte before it,
+        // up to and including a zero.
+        input = &vm->input[vm->input_position];
+        count = vm->input_size - vm->input_position;
+        count = count < room ? count : room;
+        if ((zero = memchr(input, 0, count))) {
+            count = zero - input + 1;
+        }
+
+        output = vm->vm_flags & BF_OUTPUT_BUFFER ? &vm->output[vm->output_size] : chunk;
+        output[0] = filter->table[byte];
+        bf_filter_map(filter, input, output + 1, count - 1);
+        byte = input[count - 1];
+        vm->input_position += count;
+
+        if (vm->vm_flags & BF_OUTPUT_BUFFER) {
+            vm->output_size += count;
+        } else {
+            fwrite(chunk, 1, count, stdout);
+        }
+
+        if (byte == 0) {
+            ended = true;
+            break;
+        }
+    }
+    vm->memory[pointer] = byte;
+
+    return ended;
+}
+
+/**
+ * Widens the range of memory that 'bf_vm_reset' has to clear. This is only
+ * done when jumping backwards, see 'bf_program_reach' for why that's enough.
+ */
+#define BF_VM_RECORD_POINTER()                    \
+    do {                                          \
+        if (stepping && pointer > dirty_high) {   \
+            dirty_high = pointer;                 \
+        }                                         \
+    } while (0)
+
+/**
+ * The execution loop shared by 'bf_vm_run' and 'bf_vm_step'. It's inlined into
+ * both so that 'bf_vm_run' doesn't pay for the budget checks. The same goes
+ * for tracking the pointer, which only 'bf_vm_step' does since vms that run
+ * in one go are rarely reused.
+ */
+static inline __attribute__((always_inline)) struct bf_result bf_vm_execute(struct bf_vm *vm, uint64_t budget, bool stepping)
+{
+    const uint8_t *code = vm->program->code; // Owned and managed by vm.
+    uint8_t *memory = vm->memory;
+    size_t pc = vm->pc;
+    size_t pointer = vm->pointer;
+    uint64_t dispatches = 0; // Kept local so the counter stays in a register.
     uint16_t pointer_holder;
+    uint16_t base; // Shifted cell used by the _AT variants of COPY and MUL.
+    uint64_t limit, moves; // Cells MOVE_BLOCK may move one at a time.
+    int input; // Input from stdin or the input buffer.
+    int code_result = BF_RESULT_SUCCESS;
+    size_t dirty_high = vm->dirty_high;
 
     for (;;) {
-        instr = &vm->program->ir[vm->pc];
+        dispatches++;
 
-        switch (instr->opcode) {
-        case BF_INS_NOP:
-            vm->pc++;
+        switch (code[pc]) {
+        case BF_OP_IN:
+            if ((input = bf_vm_getc(vm)) == BF_VM_WOULD_BLOCK) {
+                code_result = BF_RESULT_NEED_INPUT;
+                goto suspend;
+            } else if (input != EOF) {
+                memory[pointer] = input;
+            }
+            pc += BF_OP_LEN;
             break;
-        case BF_INS_IN:
-            if ((input = getchar()) != EOF) {
-                vm->memory[vm->pointer] = input;
+        case BF_OP_OUT:
+            if (!bf_vm_putc(vm, memory[pointer])) {
+                code_result = BF_RESULT_NEED_DRAIN;
+                goto suspend;
             }
-            vm->pc++;
+            pc += BF_OP_LEN;
+            break;
+        case BF_OP_OUTS:
+            if (!bf_vm_puts(vm, bf_bytecode_read_u32(&code[pc + 1]), bf_bytecode_read_u32(&code[pc + 5]))) {
+                code_result = BF_RESULT_NEED_DRAIN;
+                goto suspend;
+            }
+            pc += BF_OP_LEN_U32_U32;
+            break;
+        case BF_OP_INC_V:
+            memory[pointer]++;
+            pc += BF_OP_LEN;
             break;
-        case BF_INS_OUT:
-            putchar(vm->memory[vm->pointer]);
-            vm->pc++;
+        case BF_OP_DEC_V:
+            memory[pointer]--;
+            pc += BF_OP_LEN;
             break;
-        case BF_INS_INC_V:
-            vm->memory[vm->pointer]++;
-            vm->pc++;
+        case BF_OP_ADD_V:
+            memory[pointer] += bf_bytecode_read_u8(&code[pc + 1]);
+            pc += BF_OP_LEN_U8;
             break;
-        case BF_INS_DEC_V:
-            vm->memory[vm->pointer]--;
-            vm->pc++;
+        case BF_OP_INC_P:
+            pointer++;
+            pc += BF_OP_LEN;
             break;
-        case BF_INS_ADD_V:
-            vm->memory[vm->pointer] += instr->argument;
-            vm->pc++;
+        case BF_OP_DEC_P:
+            pointer--;
+            pc += BF_OP_LEN;
             break;
-        case BF_INS_SUB_V:
-            vm->memory[vm->pointer] -= instr->argument;
-            vm->pc++;
+        case BF_OP_ADD_P:
+            pointer += bf_bytecode_read_u16(&code[pc + 1]);
+            pc += BF_OP_LEN_U16;
+            break;
+        case BF_OP_SUB_P:
+            pointer -= bf_bytecode_read_u16(&code[pc + 1]);
+            pc += BF_OP_LEN_U16;
+            break;
+        case BF_OP_ADD_P_WRAP:
+            pointer = (uint16_t)(pointer + bf_bytecode_read_u16(&code[pc + 1]));
+            pc += BF_OP_LEN_U16;
+            break;
+        case BF_OP_BRANCH_Z:
+            if (memory[pointer] == 0) {
+                pc = bf_bytecode_read_u32(&code[pc + 1]);
+            } else {
+                pc += BF_OP_LEN_U32;
+            }
             break;
-        case BF_INS_INC_P:
-            vm->pointer++; // Pointer wraps at memory boundary.
-            vm->pc++;
+        case BF_OP_BRANCH_NZ:
+            if (memory[pointer] != 0) {
+                pc = bf_bytecode_read_u32(&code[pc + 1]);
+                BF_VM_RECORD_POINTER();
+                if (stepping && dispatches >= budget) {
+                    goto yield;
+                }
+            } else {
+                pc += BF_OP_LEN_U32;
+            }
             break;
-        case BF_INS_DEC_P:
-            vm->pointer--; // Pointer wraps at memory boundary.
-            vm->pc++;
+        case BF_OP_JMP:
+            pc = bf_bytecode_read_u32(&code[pc + 1]);
+            BF_VM_RECORD_POINTER();
+            if (stepping && dispatches >= budget) {
+                goto yield;
+            }
             break;
-        case BF_INS_ADD_P:
-            vm->pointer = vm->pointer + instr->argument;
-            vm->pc++;
+        case BF_OP_ENTER:
+            if (memory[pointer] == 0) {
+                pc = bf_bytecode_read_u32(&code[pc + 1]);
+            } else if (!bf_compile_loop(vm->program, bf_bytecode_read_u32(&code[pc + 5]), pc)) {
+                code_result = BF_RESULT_ERROR;
+                goto halt;
+            }
+            // Otherwise the loop's optimized code is dispatched from the same
+            // place next.
             break;
-        case BF_INS_SUB_P:
-            vm->pointer = vm->pointer - instr->argument;
-            vm->pc++;
+        case BF_OP_NOP:
+            pc += BF_OP_LEN;
             break;
-        case BF_INS_BRANCH_Z:
-            if (vm->memory[vm->pointer] == 0) {
-                vm->pc = instr->argument;
+        case BF_OP_FILTER:
+            if (bf_vm_filter(vm, pointer, bf_bytecode_read_u32(&code[pc + 5]))) {
+                pc = bf_bytecode_read_u32(&code[pc + 1]);
             } else {
-                vm->pc++;
+                pc += BF_OP_LEN_U32_U32;
             }
             break;
-        case BF_INS_BRANCH_NZ:
-            if (vm->memory[vm->pointer] != 0) {
-                vm->pc = instr->argument;
+        case BF_OP_DIVMOD:
+            base = pointer + bf_bytecode_read_u16(&code[pc + 5]);
+            if (bf_idiom_divmod(memory, base)) {
+                pc = bf_bytecode_read_u32(&code[pc + 1]);
             } else {
-                vm->pc++;
+                pc += BF_OP_LEN_U32_U16;
             }
             break;
-        case BF_INS_JMP:
-            vm->pc = instr->argument;
+        case BF_OP_PRINT_DEC:
+            base = pointer + bf_bytecode_read_u16(&code[pc + 5]);
+            if (bf_vm_print_dec(vm, base)) {
+                pc = bf_bytecode_read_u32(&code[pc + 1]);
+            } else {
+                pc += BF_OP_LEN_U32_U16;
+            }
             break;
-        case BF_INS_HALT:
+        case BF_OP_HALT:
             goto halt;
-        case BF_INS_CLEAR:
-            vm->memory[vm->pointer] = 0;
-            vm->pc++;
+        case BF_OP_CLEAR:
+            memory[pointer] = 0;
+            pc += BF_OP_LEN;
             break;
-        case BF_INS_COPY:
-            if (vm->memory[vm->pointer] != 0) {
-                pointer_holder = vm->pointer + instr->argument;
-                vm->memory[pointer_holder] = vm->memory[pointer_holder] + vm->memory[vm->pointer];
+        case BF_OP_COPY:
+            pointer_holder = pointer + bf_bytecode_read_u16(&code[pc + 1]);
+            memory[pointer_holder] += memory[pointer];
+            pc += BF_OP_LEN_U16;
+            break;
+        case BF_OP_MUL:
+            pointer_holder = pointer + bf_bytecode_read_u16(&code[pc + 2]);
+            memory[pointer_holder] += bf_bytecode_read_u8(&code[pc + 1]) * memory[pointer];
+            pc += BF_OP_LEN_U8_U16;
+            break;
+        case BF_OP_IN_AT:
+            if ((input = bf_vm_getc(vm)) == BF_VM_WOULD_BLOCK) {
+                code_result = BF_RESULT_NEED_INPUT;
+                goto suspend;
+            } else if (input != EOF) {
+                memory[(uint16_t)(pointer + bf_bytecode_read_u16(&code[pc + 1]))] = input;
             }
-            vm->pc++;
+            pc += BF_OP_LEN_U16;
             break;
-        case BF_INS_MUL:
-            if (vm->memory[vm->pointer] != 0) {
-                pointer_holder = vm->pointer + instr->offset;
-                vm->memory[pointer_holder] = vm->memory[pointer_holder] + (instr->argument * vm->memory[vm->pointer]);
+        case BF_OP_OUT_AT:
+            if (!bf_vm_putc(vm, memory[(uint16_t)(pointer + bf_bytecode_read_u16(&code[pc + 1]))])) {
+                code_result = BF_RESULT_NEED_DRAIN;
+                goto suspend;
             }
-            vm->pc++;
+            pc += BF_OP_LEN_U16;
+            break;
+        case BF_OP_ADD_V_AT:
+            memory[(uint16_t)(pointer + bf_bytecode_read_u16(&code[pc + 2]))] += bf_bytecode_read_u8(&code[pc + 1]);
+            pc += BF_OP_LEN_U8_U16;
+            break;
+        case BF_OP_BRANCH_Z_AT:
+            if (memory[(uint16_t)(pointer + bf_bytecode_read_u16(&code[pc + 5]))] == 0) {
+                pc = bf_bytecode_read_u32(&code[pc + 1]);
+            } else {
+                pc += BF_OP_LEN_U32_U16;
+            }
+            break;
+        case BF_OP_BRANCH_NZ_AT:
+            if (memory[(uint16_t)(pointer + bf_bytecode_read_u16(&code[pc + 5]))] != 0) {
+                pc = bf_bytecode_read_u32(&code[pc + 1]);
+                if (stepping && dispatches >= budget) {
+                    goto yield;
+                }
+            } else {
+                pc += BF_OP_LEN_U32_U16;
+            }
+            break;
+        case BF_OP_CLEAR_AT:
+            memory[(uint16_t)(pointer + bf_bytecode_read_u16(&code[pc + 1]))] = 0;
+            pc += BF_OP_LEN_U16;
+            break;
+        case BF_OP_COPY_AT:
+            base = pointer + bf_bytecode_read_u16(&code[pc + 3]);
+            pointer_holder = base + bf_bytecode_read_u16(&code[pc + 1]);
+            memory[pointer_holder] += memory[base];
+            pc += BF_OP_LEN_U16_U16;
+            break;
+        case BF_OP_MUL_AT:
+            base = pointer + bf_bytecode_read_u16(&code[pc + 4]);
+            pointer_holder = base + bf_bytecode_read_u16(&code[pc + 2]);
+            memory[pointer_holder] += bf_bytecode_read_u8(&code[pc + 1]) * memory[base];
+            pc += BF_OP_LEN_U8_U16_U16;
+            break;
+        case BF_OP_CLEAR_RANGE:
+            bf_vm_clear_cells(memory, (uint16_t)(pointer + bf_bytecode_read_u16(&code[pc + 3])),
+                bf_bytecode_read_u16(&code[pc + 1]));
+            pc += BF_OP_LEN_U16_U16;
+            break;
+        case BF_OP_MOVE_BLOCK:
+            // Cells moved one at a time count as dispatches, so that a block
+            // which wraps around memory forever still runs out of budget. The
+            // loop goes on from the same MOVE_BLOCK once the vm is resumed.
+            base = pointer;
+            moves = limit = !stepping ? UINT64_MAX : dispatches < budget ? budget - dispatches : 1;
+            pointer = bf_vm_move_block(memory, pointer, (int8_t)bf_bytecode_read_u8(&code[pc + 1]), &limit);
+            dispatches += moves - limit;
+            // The loop this replaces records the pointer at every backwards
+            // jump. A block that wraps around memory may have written any
+            // cell.
+            if (stepping && ((int8_t)bf_bytecode_read_u8(&code[pc + 1]) > 0 ? pointer < base : pointer > base)) {
+                dirty_high = BF_MEMORY_SIZE;
+            }
+            BF_VM_RECORD_POINTER();
+            if (stepping && memory[pointer] != 0) {
+                dirty_high = BF_MEMORY_SIZE;
+                goto yield;
+            }
+            pc += BF_OP_LEN_U8;
+            break;
+        case BF_OP_POLY:
+            base = pointer + bf_bytecode_read_u16(&code[pc + 7]);
+            pointer_holder = base + bf_bytecode_read_u16(&code[pc + 3]);
+            memory[pointer_holder] += bf_bytecode_read_u8(&code[pc + 1])
+                * bf_utils_binomial(memory[base], bf_bytecode_read_u8(&code[pc + 2]))
+                * (bf_bytecode_read_u16(&code[pc + 5]) != 0 ? memory[(uint16_t)(base + bf_bytecode_read_u16(&code[pc + 5]))] : 1);
+            pc += BF_OP_LEN_U8_U8_U16_U16_U16;
             break;
         default:
             goto halt; // Failsafe for unrecognized opcodes.
         }
     }
 
+suspend:
+    // The instruction is dispatched again once the vm is resumed.
+    dispatches--;
+    goto halt;
+yield:
+    code_result = BF_RESULT_YIELD;
 halt:
+    vm->pc = pc;
+    vm->pointer = pointer;
+    vm->dispatches += dispatches;
+    if (stepping) {
+        vm->dirty_high = dirty_high;
+    } else {
+        vm->dirty_high = BF_MEMORY_SIZE; // Any memory may have been written.
+    }
 
     return (struct bf_result){
-        .code = BF_RESULT_SUCCESS,
+        .code = code_result,
         .message = NULL,
     };
 }
+
+struct bf_result bf_vm_run(struct bf_vm *vm)
+{
+    return bf_vm_execute(vm, UINT64_MAX, false);
+}
+
+struct bf_result bf_vm_step(struct bf_vm *vm, uint64_t budget)
+{
+    return bf_vm_execute(vm, budget, true);
+}
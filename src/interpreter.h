@@ -21,6 +21,7 @@
 #ifndef BF_INTERPRETER_H
 #define BF_INTERPRETER_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -33,16 +34,53 @@
 /** The interpreter will output to a buffer rather than stdout if set. */
 #define BF_OUTPUT_BUFFER 0x1
 
+/** The interpreter will read input from a buffer rather than stdin if set. */
+#define BF_INPUT_BUFFER 0x2
+
+/**
+ * Memory is mapped lazily a page at a time rather than allocated up front if
+ * set. Untouched pages are backed by the kernel's shared zero page, so a vm
+ * only costs as much memory as the pages its program writes to. Memory is
+ * accessed the same way either way, so this doesn't slow execution down.
+ *
+ * This is decided when the vm is created, 'bf_vm_load' keeps it as it is.
+ */
+#define BF_SPARSE_MEMORY 0x4
+
 /**
  * The virtual machine does not need to hold very much state. Brainfuck uses a
- * pointer that points to a place in memory which is statically allocated.
+ * pointer that points to a place in memory which is statically allocated,
+ * either right after the vm in 'tape' or in a separate mapping when
+ * BF_SPARSE_MEMORY is set.
  */
 struct bf_vm {
     size_t pc;
     size_t pointer;
     struct bf_program *program;
     uint32_t vm_flags;
-    uint8_t memory[BF_MEMORY_SIZE];
+    uint64_t dispatches; // Instructions executed since the vm was created.
+
+    // Highest pointer seen at backwards jumps, for 'bf_vm_reset'. The pointer
+    // starts at zero, so cells in [0, dirty_high] may have been written.
+    // Pointers that wrapped below zero end up at the top and widen the range
+    // to all of memory.
+    size_t dirty_high;
+
+    // Caller owned buffers used with BF_INPUT_BUFFER and BF_OUTPUT_BUFFER.
+    // Without BF_INPUT_BUFFER the input fields describe 'stdin_buffer', which
+    // stdin is read into so that 'bf_vm_filter' knows what's been consumed.
+    const uint8_t *input;
+    size_t input_size;
+    size_t input_position;
+    bool input_closed;
+    uint8_t *output;
+    size_t output_capacity;
+    size_t output_size;
+    size_t string_position; // Bytes of the current OUTS written so far.
+    uint8_t *stdin_buffer;
+
+    uint8_t *memory;
+    uint8_t tape[];
 };
 
 /**
@@ -55,6 +93,22 @@ struct bf_vm {
  */
 struct bf_vm *bf_vm_create(struct bf_program *program, uint32_t vm_flags);
 
+/**
+ * Loads a program into an existing virtual machine which has to be fresh or
+ * reset with 'bf_vm_reset'. Any program that was loaded before must have been
+ * released by the caller. Unlike 'bf_vm_create' the program isn't freed if it
+ * can't be loaded, in which case false is returned.
+ */
+bool bf_vm_load(struct bf_vm *vm, struct bf_program *program, uint32_t vm_flags);
+
+/**
+ * Returns a virtual machine to the state it was in when it was created so it
+ * can run again. If the program was run with 'bf_vm_step' only the part of
+ * memory it could have written is cleared, after 'bf_vm_run' all of it is.
+ * The loaded program is kept.
+ */
+void bf_vm_reset(struct bf_vm *vm);
+
 /**
  * Frees resources contained in a brainfuck virtual machine such as the main
  * memory and brainfuck source code.
@@ -64,7 +118,68 @@ void bf_vm_destroy(struct bf_vm *vm);
 /**
  * Starts the execution loop to execute code on the passed virtual machine and
  * returns once there is no more input (EOF).
+ *
+ * With BF_INPUT_BUFFER or BF_OUTPUT_BUFFER set the vm never blocks. Instead it
+ * returns BF_RESULT_NEED_INPUT when the input buffer is empty and hasn't been
+ * closed, or BF_RESULT_NEED_DRAIN when the output buffer is full. The
+ * instruction that couldn't complete is retried on the next call.
  */
 struct bf_result bf_vm_run(struct bf_vm *vm);
 
+/**
+ * Executes at most roughly 'budget' instructions on the passed virtual
+ * machine. The budget is only checked when a loop jumps back to its start, so
+ * a step may overshoot it by the length of one loop body, but a program can't
+ * run for longer than that without yielding.
+ *
+ * Returns BF_RESULT_YIELD if the budget ran out, in which case all state is
+ * kept in the vm and the next call picks up where this one left off. Once the
+ * program has finished BF_RESULT_SUCCESS is returned, and will be returned
+ * again by any further calls.
+ */
+struct bf_result bf_vm_step(struct bf_vm *vm, uint64_t budget);
+
+/**
+ * Hands a buffer of input to a vm created with BF_INPUT_BUFFER. The buffer is
+ * not copied and must stay valid until the vm asks for more input by
+ * returning BF_RESULT_NEED_INPUT, at which point all of it has been consumed.
+ */
+void bf_vm_feed_input(struct bf_vm *vm, const uint8_t *input, size_t size);
+
+/**
+ * Marks the end of input for a vm created with BF_INPUT_BUFFER. Once all fed
+ * input is consumed, reads leave the current cell unchanged like they do on
+ * EOF from stdin.
+ */
+void bf_vm_close_input(struct bf_vm *vm);
+
+/**
+ * Sets the buffer a vm created with BF_OUTPUT_BUFFER writes to. Output is
+ * appended at 'vm->output_size', and once 'capacity' bytes are written the vm
+ * returns BF_RESULT_NEED_DRAIN. Calling this again (with the same or another
+ * buffer) empties it so execution can continue.
+ */
+void bf_vm_set_output(struct bf_vm *vm, uint8_t *output, size_t capacity);
+
+/**
+ * Clears 'count' cells of 'memory' starting at 'start', wrapping around the
+ * end of memory. This is what CLEAR_RANGE does.
+ */
+void bf_vm_clear_cells(uint8_t *memory, size_t start, size_t count);
+
+/**
+ * Runs the loop [[-<+>]>] (or [[->+<]<] with a 'direction' of -1) on 'memory'
+ * with the pointer at 'pointer', and returns where the pointer ends up. Each
+ * cell from the pointer up to the next zero cell is added to the one before
+ * it, which moves the block one cell back as a whole. This is what MOVE_BLOCK
+ * does.
+ *
+ * A block that runs into either end of memory wraps around it and is moved a
+ * cell at a time, which never ends if no cell is zero. At most '*limit' cells
+ * are moved that way, and '*limit' is lowered by the number moved. If the
+ * block hasn't ended by then, the cell at the returned pointer isn't zero and
+ * calling this again from there carries on with the loop.
+ */
+size_t bf_vm_move_block(uint8_t *memory, size_t pointer, int direction, uint64_t *limit);
+
 #endif
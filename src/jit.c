@@ -0,0 +1,353 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Needed for MAP_ANONYMOUS, which isn't part of C11 or POSIX.
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "jit.h"
+#include "utils.h"
+
+#ifdef BF_JIT_STENCILS
+#include "stencils.inc"
+#endif
+
+/**
+ * Values of the holes of a single instruction.
+ */
+struct bf_jit_values {
+    int stencil; // enum bf_jit_stencil_id, or -1 if there's no code.
+    int32_t argument;
+    int32_t shift;
+    int32_t offset;
+};
+
+/**
+ * Picks the stencil of an instruction and the values of its holes. Cells that
+ * 'bf_program_bound' couldn't prove to be inside of memory are accessed
+ * through the _WRAP variant of the stencil.
+ */
+struct bf_jit_values bf_jit_select(const struct bf_instruction *instr)
+{
+    struct bf_jit_values values = {
+        .stencil = -1,
+        .shift = (int16_t)instr->shift,
+    };
+    bool wraps = !bf_utils_check_flag(instr->flags, BF_INS_FLAG_BOUNDED);
+
+    switch (instr->opcode) {
+    case BF_INS_IN:
+        values.stencil = BF_JIT_STENCIL_IN;
+        break;
+    case BF_INS_OUT:
+        values.stencil = BF_JIT_STENCIL_OUT;
+        break;
+    case BF_INS_INC_V:
+        values.stencil = BF_JIT_STENCIL_INC;
+        break;
+    case BF_INS_DEC_V:
+        values.stencil = BF_JIT_STENCIL_DEC;
+        break;
+    case BF_INS_ADD_V:
+        values.stencil = BF_JIT_STENCIL_ADD;
+        values.argument = (uint8_t)instr->argument;
+        break;
+    case BF_INS_SUB_V:
+        values.stencil = BF_JIT_STENCIL_ADD;
+        values.argument = (uint8_t)-instr->argument;
+        break;
+    case BF_INS_CLEAR:
+        values.stencil = BF_JIT_STENCIL_CLEAR;
+        break;
+    case BF_INS_COPY:
+        values.stencil = BF_JIT_STENCIL_COPY;
+        values.offset = (int16_t)instr->argument;
+        break;
+    case BF_INS_MUL:
+        values.stencil = BF_JIT_STENCIL_MUL;
+        values.argument = (uint8_t)instr->argument;
+        values.offset = (int16_t)instr->offset;
+        break;
+    case BF_INS_POLY:
+        // The degree and the source cell are packed into the same holes as
+        // in the IR, see 'bf_program_poly'.
+        values.stencil = BF_JIT_STENCIL_POLY;
+        values.argument = instr->argument;
+        values.offset = instr->offset;
+        break;
+    case BF_INS_BRANCH_Z:
+        // Counted loops are always entered.
+        if (bf_utils_check_flag(instr->flags, BF_INS_FLAG_COUNTED)) {
+            return values;
+        }
+        values.stencil = BF_JIT_STENCIL_BRANCH_Z;
+        break;
+    case BF_INS_BRANCH_NZ:
+        values.stencil = BF_JIT_STENCIL_BRANCH_NZ;
+        break;
+    case BF_INS_INC_P:
+    case BF_INS_DEC_P:
+    case BF_INS_ADD_P:
+    case BF_INS_SUB_P:
+        values.stencil = wraps ? BF_JIT_STENCIL_MOVE_WRAP : BF_JIT_STENCIL_MOVE;
+        if (instr->opcode == BF_INS_INC_P) {
+            values.shift = 1;
+        } else if (instr->opcode == BF_INS_DEC_P) {
+            values.shift = -1;
+        } else if (instr->opcode == BF_INS_ADD_P) {
+            values.shift = instr->argument;
+        } else {
+            values.shift = -(int32_t)instr->argument;
+        }
+        return values;
+    case BF_INS_JMP:
+        values.stencil = BF_JIT_STENCIL_JUMP;
+        return values;
+    case BF_INS_HALT:
+        values.stencil = BF_JIT_STENCIL_HALT;
+        return values;
+    case BF_INS_OUTS:
+        values.stencil = BF_JIT_STENCIL_OUTS;
+        values.argument = instr->argument;
+        values.offset = instr->offset;
+        return values;
+    case BF_INS_CLEAR_RANGE:
+        values.stencil = BF_JIT_STENCIL_CLEAR_RANGE;
+        values.argument = instr->argument;
+        return values;
+    case BF_INS_MOVE_BLOCK:
+        values.stencil = BF_JIT_STENCIL_MOVE_BLOCK;
+        values.argument = (uint8_t)instr->argument;
+        return values;
+    default:
+        return values;
+    }
+
+    if (wraps) {
+        values.stencil += BF_JIT_STENCIL_WRAP;
+    }
+
+    return values;
+}
+
+/**
+ * Patches the holes of a stencil copied to 'code + start'. 'next' and
+ * 'target' are where CONTINUE and JUMP go.
+ */
+void bf_jit_patch(uint8_t *code, size_t start, const struct bf_jit_stencil *stencil,
+    const struct bf_jit_values *values, size_t next, size_t target)
+{
+    const struct bf_jit_hole *hole;
+    int64_t value;
+    uint32_t patch;
+
+    for (size_t i = 0; i < stencil->hole_count; i++) {
+        hole = &stencil->holes[i];
+
+        switch (hole->value) {
+        case BF_JIT_HOLE_ARGUMENT:
+            value = values->argument;
+            break;
+        case BF_JIT_HOLE_SHIFT:
+            value = values->shift;
+            break;
+        case BF_JIT_HOLE_OFFSET:
+            value = values->offset;
+            break;
+        case BF_JIT_HOLE_CONTINUE:
+            value = next;
+            break;
+        default:
+            value = target;
+            break;
+        }
+
+        // Code is addressed relative to its start, so there's no need to
+        // know where it's mapped for relative patches.
+        value += hole->addend;
+        if (hole->patch == BF_JIT_PATCH_REL32) {
+            value -= start + hole->offset;
+        }
+        patch = (uint32_t)value;
+        memcpy(&code[start + hole->offset], &patch, sizeof(patch));
+    }
+}
+
+bool bf_jit_supported()
+{
+#ifdef BF_JIT_STENCILS
+    return true;
+#else
+    return false;
+#endif
+}
+
+struct bf_jit *bf_jit_compile(struct bf_program *program)
+{
+#ifdef BF_JIT_STENCILS
+    const struct bf_jit_stencil *stencil;
+    const struct bf_instruction *instr;
+    struct bf_jit_values values;
+    struct bf_jit *jit;
+    size_t *starts;
+    size_t size = 0;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+
+    jit = calloc(1, sizeof(struct bf_jit));
+    if (!jit) {
+        goto error1;
+    }
+
+    // Where the code of every instruction starts, and one past the end for
+    // the HALT that's added after the last one.
+    starts = malloc((program->size + 1) * sizeof(size_t));
+    if (!starts) {
+        goto error2;
+    }
+    for (size_t i = 0; i < program->size; i++) {
+        values = bf_jit_select(&program->ir[i]);
+        starts[i] = size;
+        size += values.stencil < 0 ? 0 : bf_jit_stencils[values.stencil].size;
+    }
+    starts[program->size] = size;
+    size += bf_jit_stencils[BF_JIT_STENCIL_HALT].size;
+
+    jit->code_size = (size + page_size - 1) / page_size * page_size;
+    jit->code = mmap(NULL, jit->code_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        goto error3;
+    }
+
+    for (size_t i = 0; i < program->size; i++) {
+        instr = &program->ir[i];
+        values = bf_jit_select(instr);
+        if (values.stencil < 0) {
+            continue;
+        }
+
+        stencil = &bf_jit_stencils[values.stencil];
+        memcpy(&jit->code[starts[i]], stencil->code, stencil->size);
+        bf_jit_patch(jit->code, starts[i], stencil, &values, starts[i + 1],
+            instr->opcode == BF_INS_BRANCH_Z || instr->opcode == BF_INS_BRANCH_NZ || instr->opcode == BF_INS_JMP
+                ? starts[instr->argument]
+                : 0);
+    }
+    stencil = &bf_jit_stencils[BF_JIT_STENCIL_HALT];
+    memcpy(&jit->code[starts[program->size]], stencil->code, stencil->size);
+
+    if (mprotect(jit->code, jit->code_size, PROT_READ | PROT_EXEC) != 0) {
+        goto error4;
+    }
+
+    free(starts);
+    return jit;
+
+error4:
+    munmap(jit->code, jit->code_size);
+error3:
+    free(starts);
+error2:
+    free(jit);
+error1:
+    return NULL;
+#else
+    (void)program;
+    return NULL;
+#endif
+}
+
+/**
+ * Reads a byte of input for IN stencils.
+ */
+int bf_jit_get(struct bf_jit_context *context)
+{
+    (void)context;
+    return getchar();
+}
+
+/**
+ * Writes a byte of output for OUT stencils.
+ */
+void bf_jit_put(struct bf_jit_context *context, uint8_t value)
+{
+    (void)context;
+    putchar(value);
+}
+
+/**
+ * Writes the string of an OUTS from the string table of the program.
+ */
+void bf_jit_write(struct bf_jit_context *context, uint32_t start, uint32_t length)
+{
+    fwrite(&context->vm->program->strings[start], 1, length, stdout);
+}
+
+/**
+ * Clears the cells of a CLEAR_RANGE, see 'bf_vm_clear_cells'.
+ */
+void bf_jit_clear(struct bf_jit_context *context, size_t start, uint32_t count)
+{
+    bf_vm_clear_cells(context->vm->memory, start, count);
+}
+
+/**
+ * Moves the block of a MOVE_BLOCK, see 'bf_vm_move_block'.
+ */
+size_t bf_jit_move(struct bf_jit_context *context, size_t pointer, int direction)
+{
+    uint64_t limit = UINT64_MAX; // The JIT has no budget to run out of.
+
+    return bf_vm_move_block(context->vm->memory, pointer, direction, &limit);
+}
+
+struct bf_result bf_jit_run(struct bf_jit *jit, struct bf_vm *vm)
+{
+    struct bf_jit_context context = {
+        .vm = vm,
+        .get = bf_jit_get,
+        .put = bf_jit_put,
+        .write = bf_jit_write,
+        .clear = bf_jit_clear,
+        .move = bf_jit_move,
+    };
+    bf_jit_function function;
+
+    if (vm->vm_flags & (BF_INPUT_BUFFER | BF_OUTPUT_BUFFER)) {
+        return (struct bf_result) { .code = BF_RESULT_ERROR };
+    }
+
+    // ISO C doesn't allow converting between object and function pointers,
+    // but POSIX requires it to work for dlsym.
+    memcpy(&function, &jit->code, sizeof(function));
+    vm->pointer = function(vm->memory, vm->pointer, &context);
+
+    return (struct bf_result) { .code = BF_RESULT_SUCCESS };
+}
+
+void bf_jit_destroy(struct bf_jit *jit)
+{
+    munmap(jit->code, jit->code_size);
+    free(jit);
+}
@@ -0,0 +1,170 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef BF_JIT_H
+#define BF_JIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "errors.h"
+#include "interpreter.h"
+#include "program.h"
+
+/**
+ * === README ===
+ *
+ * The JIT works by copy and patch. Every instruction has a stencil, a small C
+ * function in src/stencils.c that's compiled once at build time. Values that
+ * are only known at run time, like the shift of a cell or where a branch
+ * goes, are written as references to the BF_HOLE_* symbols. tools/stencils.py
+ * reads the machine code of each stencil and where the compiler left those
+ * references (its relocations) out of the object file, and writes them into
+ * stencils.inc as 'bf_jit_stencils'.
+ *
+ * Compiling a program is then just copying the stencil of every instruction
+ * after one another into executable memory and patching the holes. Stencils
+ * end by tail calling the next one, which is left out of the copy when it's
+ * the last instruction so that execution falls through instead.
+ *
+ * Stencils keep the vm memory, the pointer and 'struct bf_jit_context' in
+ * argument registers from start to end, and 'bf_jit_run' is a single call.
+ *
+ * Stencils are only built for x86-64 Linux, elsewhere 'bf_jit_compile'
+ * always fails.
+ */
+
+/** Values that go into the holes of a stencil. */
+enum bf_jit_hole_value {
+    BF_JIT_HOLE_ARGUMENT, // Value added by ADD, factor of MUL and POLY, string of OUTS, or count of CLEAR_RANGE.
+    BF_JIT_HOLE_SHIFT, // Offset of the cell from the pointer.
+    BF_JIT_HOLE_OFFSET, // Offset of the target cell of COPY, MUL and POLY, or length of OUTS.
+    BF_JIT_HOLE_CONTINUE, // Address of the next instruction.
+    BF_JIT_HOLE_JUMP, // Address of the branch target.
+};
+
+/** How a value is written into a hole. */
+enum bf_jit_patch {
+    BF_JIT_PATCH_ABS32, // The value itself as 32 bits.
+    BF_JIT_PATCH_REL32, // The value relative to the hole, as 32 bits.
+};
+
+/** Stencils generated from src/stencils.c, see 'bf_jit_stencil_select'. */
+enum bf_jit_stencil_id {
+    BF_JIT_STENCIL_IN,
+    BF_JIT_STENCIL_OUT,
+    BF_JIT_STENCIL_INC,
+    BF_JIT_STENCIL_DEC,
+    BF_JIT_STENCIL_ADD,
+    BF_JIT_STENCIL_CLEAR,
+    BF_JIT_STENCIL_COPY,
+    BF_JIT_STENCIL_MUL,
+    BF_JIT_STENCIL_POLY,
+    BF_JIT_STENCIL_BRANCH_Z,
+    BF_JIT_STENCIL_BRANCH_NZ,
+    BF_JIT_STENCIL_IN_WRAP,
+    BF_JIT_STENCIL_OUT_WRAP,
+    BF_JIT_STENCIL_INC_WRAP,
+    BF_JIT_STENCIL_DEC_WRAP,
+    BF_JIT_STENCIL_ADD_WRAP,
+    BF_JIT_STENCIL_CLEAR_WRAP,
+    BF_JIT_STENCIL_COPY_WRAP,
+    BF_JIT_STENCIL_MUL_WRAP,
+    BF_JIT_STENCIL_POLY_WRAP,
+    BF_JIT_STENCIL_BRANCH_Z_WRAP,
+    BF_JIT_STENCIL_BRANCH_NZ_WRAP,
+    BF_JIT_STENCIL_MOVE,
+    BF_JIT_STENCIL_MOVE_WRAP,
+    BF_JIT_STENCIL_JUMP,
+    BF_JIT_STENCIL_HALT,
+    BF_JIT_STENCIL_OUTS,
+    BF_JIT_STENCIL_CLEAR_RANGE,
+    BF_JIT_STENCIL_MOVE_BLOCK,
+    BF_JIT_STENCIL_COUNT,
+};
+
+/** The _WRAP variant of every stencil that accesses a cell. */
+#define BF_JIT_STENCIL_WRAP (BF_JIT_STENCIL_IN_WRAP - BF_JIT_STENCIL_IN)
+
+struct bf_jit_hole {
+    uint32_t offset; // Where the hole is in the stencil.
+    uint8_t value; // enum bf_jit_hole_value
+    uint8_t patch; // enum bf_jit_patch
+    int32_t addend; // Added to the value before it's written.
+};
+
+struct bf_jit_stencil {
+    const uint8_t *code;
+    size_t size;
+    const struct bf_jit_hole *holes;
+    size_t hole_count;
+};
+
+/**
+ * Passed to every stencil. I/O and the bulk memory operations go through
+ * function pointers so stencils don't need relocations for calls, which
+ * couldn't reach the executable from where the code is mapped anyway.
+ */
+struct bf_jit_context {
+    struct bf_vm *vm;
+    int (*get)(struct bf_jit_context *context);
+    void (*put)(struct bf_jit_context *context, uint8_t value);
+    void (*write)(struct bf_jit_context *context, uint32_t start, uint32_t length);
+    void (*clear)(struct bf_jit_context *context, size_t start, uint32_t count);
+    size_t (*move)(struct bf_jit_context *context, size_t pointer, int direction);
+};
+
+/** Signature of stencils and of the compiled code as a whole. */
+typedef size_t (*bf_jit_function)(uint8_t *memory, size_t pointer, struct bf_jit_context *context);
+
+/**
+ * A program compiled into machine code.
+ */
+struct bf_jit {
+    uint8_t *code;
+    size_t code_size; // Size of the executable mapping.
+};
+
+/**
+ * Returns true if mlbf was built with the stencils 'bf_jit_compile' needs.
+ */
+bool bf_jit_supported();
+
+/**
+ * Compiles a program into machine code. Instructions have to be marked by
+ * 'bf_program_bound' first, which 'bf_compile' already did. Returns NULL if
+ * memory couldn't be allocated or the JIT isn't supported on this platform.
+ */
+struct bf_jit *bf_jit_compile(struct bf_program *program);
+
+/**
+ * Runs compiled code on the memory of a vm until the program ends, reading
+ * from stdin and writing to stdout. The vm can't use BF_INPUT_BUFFER or
+ * BF_OUTPUT_BUFFER.
+ */
+struct bf_result bf_jit_run(struct bf_jit *jit, struct bf_vm *vm);
+
+/**
+ * Unmaps compiled code.
+ */
+void bf_jit_destroy(struct bf_jit *jit);
+
+#endif
@@ -0,0 +1,513 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <string.h>
+
+#include "linear.h"
+#include "utils.h"
+
+/**
+ * The value of a cell as a constant plus multiples of the values the cells
+ * had at the start of the iteration, modulo 256. Values that can't be written
+ * like this aren't known.
+ */
+struct bf_linear_value {
+    bool known;
+    uint8_t constant;
+    uint8_t factors[BF_LINEAR_CELLS];
+};
+
+/**
+ * What 'bf_linear_solve' knows about the cells while it runs through an
+ * iteration. Each cell that's accessed gets an index, and 'cells' holds its
+ * offset from the pointer.
+ */
+struct bf_linear_state {
+    const struct bf_program *program;
+    struct bf_linear_loop *const *loops;
+    size_t count;
+    long cells[BF_LINEAR_CELLS];
+    struct bf_linear_value start[BF_LINEAR_CELLS]; // Values at the start of the iteration.
+    struct bf_linear_value values[BF_LINEAR_CELLS];
+};
+
+/**
+ * Returns true if two values are the same.
+ */
+bool bf_linear_equal(const struct bf_linear_value *a, const struct bf_linear_value *b)
+{
+    return a->known == b->known
+        && a->constant == b->constant
+        && memcmp(a->factors, b->factors, sizeof(a->factors)) == 0;
+}
+
+/**
+ * Returns true if a value is known and doesn't depend on any cell.
+ */
+bool bf_linear_constant(const struct bf_linear_value *value)
+{
+    for (size_t i = 0; i < BF_LINEAR_CELLS; i++) {
+        if (value->factors[i] != 0) {
+            return false;
+        }
+    }
+
+    return value->known;
+}
+
+/**
+ * Adds 'factor' times 'other' to a value.
+ */
+void bf_linear_add(struct bf_linear_value *value, uint8_t factor, const struct bf_linear_value *other)
+{
+    value->known &= other->known;
+    value->constant += factor * other->constant;
+    for (size_t i = 0; i < BF_LINEAR_CELLS; i++) {
+        value->factors[i] += factor * other->factors[i];
+    }
+}
+
+/**
+ * Returns the index of the cell at 'offset', which starts out with the value
+ * it has at the start of the iteration when it's first accessed. Returns -1
+ * if too many cells are accessed.
+ */
+long bf_linear_cell(struct bf_linear_state *state, long offset)
+{
+    size_t cell;
+
+    for (cell = 0; cell < state->count; cell++) {
+        if (state->cells[cell] == offset) {
+            return cell;
+        }
+    }
+    if (state->count == BF_LINEAR_CELLS) {
+        return -1;
+    }
+
+    cell = state->count++;
+    state->cells[cell] = offset;
+    state->start[cell] = (struct bf_linear_value){ .known = true };
+    state->start[cell].factors[cell] = 1;
+    state->values[cell] = state->start[cell];
+
+    return cell;
+}
+
+/**
+ * Returns the offset of the cell an instruction writes to in 'offset', or
+ * false if it doesn't write to any.
+ */
+bool bf_linear_written(const struct bf_instruction *instr, long *offset)
+{
+    struct bf_poly poly;
+    long delta;
+    long first;
+    long second;
+
+    bf_program_access(instr, &delta, &first, &second);
+
+    switch (instr->opcode) {
+    case BF_INS_IN:
+    case BF_INS_INC_V:
+    case BF_INS_DEC_V:
+    case BF_INS_ADD_V:
+    case BF_INS_SUB_V:
+    case BF_INS_CLEAR:
+        *offset = first;
+        return true;
+    case BF_INS_COPY:
+    case BF_INS_MUL:
+        *offset = second;
+        return true;
+    case BF_INS_POLY:
+        bf_program_poly(instr, &poly);
+        *offset = poly.target;
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Applies an instruction other than a branch to the values of the cells.
+ * Returns false if it's anything else than arithmetic on cells.
+ */
+bool bf_linear_step(struct bf_linear_state *state, const struct bf_instruction *instr)
+{
+    struct bf_linear_value *values = state->values;
+    struct bf_linear_value one = { .known = true, .constant = 1 };
+    const struct bf_linear_value *source;
+    struct bf_poly poly;
+    long delta;
+    long first;
+    long second;
+    long cell;
+    long target;
+
+    if (instr->opcode == BF_INS_NOP) {
+        return true;
+    }
+
+    bf_program_access(instr, &delta, &first, &second);
+    if ((cell = bf_linear_cell(state, (int16_t)instr->shift)) < 0) {
+        return false;
+    }
+
+    switch (instr->opcode) {
+    case BF_INS_INC_V:
+        values[cell].constant++;
+        return true;
+    case BF_INS_DEC_V:
+        values[cell].constant--;
+        return true;
+    case BF_INS_ADD_V:
+        values[cell].constant += instr->argument;
+        return true;
+    case BF_INS_SUB_V:
+        values[cell].constant -= instr->argument;
+        return true;
+    case BF_INS_CLEAR:
+        values[cell] = (struct bf_linear_value){ .known = true };
+        return true;
+    case BF_INS_COPY:
+    case BF_INS_MUL:
+        if ((target = bf_linear_cell(state, second)) < 0) {
+            return false;
+        }
+        bf_linear_add(&values[target], instr->opcode == BF_INS_COPY ? 1 : instr->argument, &values[cell]);
+        return true;
+    case BF_INS_POLY:
+        bf_program_poly(instr, &poly);
+        if ((target = bf_linear_cell(state, poly.target)) < 0
+            || (poly.source != poly.counter && bf_linear_cell(state, poly.source) < 0)) {
+            return false;
+        }
+        source = poly.source != poly.counter ? &values[bf_linear_cell(state, poly.source)] : &one;
+
+        // The product stays linear if either side of it is a constant.
+        if (bf_linear_constant(&values[cell])) {
+            bf_linear_add(&values[target], poly.factor * bf_utils_binomial(values[cell].constant, poly.degree), source);
+        } else if (poly.degree == 1 && bf_linear_constant(source)) {
+            bf_linear_add(&values[target], poly.factor * source->constant, &values[cell]);
+        } else {
+            values[target].known = false;
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Forgets the value of every cell the loop from 'start' up to 'end' (its
+ * BRANCH_NZ) writes to, except for its counter which it leaves cleared.
+ * Returns false if too many cells are accessed.
+ */
+bool bf_linear_forget(struct bf_linear_state *state, size_t start, size_t end)
+{
+    long offset;
+    long cell;
+
+    for (size_t i = start; i <= end; i++) {
+        if (!bf_linear_written(&state->program->ir[i], &offset)) {
+            continue;
+        }
+        if ((cell = bf_linear_cell(state, offset)) < 0) {
+            return false;
+        }
+        state->values[cell].known = false;
+    }
+
+    cell = bf_linear_cell(state, (int16_t)state->program->ir[start].shift);
+    state->values[cell] = (struct bf_linear_value){ .known = true };
+
+    return true;
+}
+
+/**
+ * Runs the instructions from 'start' up to 'end' once, using the closed forms
+ * of nested loops. A nested loop that's peeled only runs if its counter is a
+ * constant, otherwise it's unknown whether the body runs and every cell it
+ * writes is forgotten. Returns false if anything can't be run this way.
+ */
+bool bf_linear_run(struct bf_linear_state *state, size_t start, size_t end)
+{
+    const struct bf_instruction *instr;
+    const struct bf_linear_loop *loop;
+    const struct bf_linear_value *counter;
+    size_t exit;
+    long cell;
+
+    for (size_t i = start; i < end; i++) {
+        instr = &state->program->ir[i];
+        if (instr->opcode != BF_INS_BRANCH_Z) {
+            if (!bf_linear_step(state, instr)) {
+                return false;
+            }
+            continue;
+        }
+
+        loop = state->loops[i];
+        exit = instr->argument - 1;
+        if (!loop || (cell = bf_linear_cell(state, (int16_t)instr->shift)) < 0) {
+            return false;
+        }
+        counter = &state->values[cell];
+
+        if (bf_linear_constant(counter) && counter->constant == 0) {
+            // The loop is skipped.
+        } else if (loop->peeled && !bf_linear_constant(counter)) {
+            if (!bf_linear_forget(state, i, exit)) {
+                return false;
+            }
+        } else {
+            if (loop->peeled && !bf_linear_run(state, i + 1, exit)) {
+                return false;
+            }
+            for (size_t k = 0; k < loop->size; k++) {
+                if (!bf_linear_step(state, &loop->ir[k])) {
+                    return false;
+                }
+            }
+        }
+        i = exit;
+    }
+
+    return true;
+}
+
+/**
+ * Appends an instruction to the closed form of a loop. Returns false if it
+ * doesn't fit, or if a distance doesn't fit in 16 bits.
+ */
+bool bf_linear_emit(struct bf_linear_loop *loop, enum bf_opcode opcode, uint32_t argument, long counter, long target, long source)
+{
+    if (loop->size == BF_LINEAR_TERMS
+        || target - counter < INT16_MIN || target - counter > INT16_MAX
+        || source - counter < INT16_MIN || source - counter > INT16_MAX) {
+        return false;
+    }
+
+    loop->ir[loop->size++] = (struct bf_instruction){
+        .opcode = opcode,
+        .argument = argument,
+        .offset = (uint16_t)(target - counter) | (uint32_t)(uint16_t)(source - counter) << 16,
+        .shift = counter,
+    };
+
+    return true;
+}
+
+bool bf_linear_solve(const struct bf_program *program, struct bf_linear_loop *const *loops, size_t pos, struct bf_linear_loop *loop)
+{
+    struct bf_linear_state state = { .program = program, .loops = loops };
+    size_t end = program->ir[pos].argument - 1;
+    bool reset[BF_LINEAR_CELLS] = { false }; // Set to the same value every iteration.
+    bool changed[BF_LINEAR_CELLS] = { false }; // Changes by a polynomial.
+    bool emitted[BF_LINEAR_CELLS] = { false };
+    uint8_t step[BF_LINEAR_CELLS + 1][BF_LINEAR_CELLS + 1] = { { 0 } };
+    uint8_t power[BF_LINEAR_CELLS + 1][BF_LINEAR_CELLS + 1];
+    uint8_t product[BF_LINEAR_CELLS + 1][BF_LINEAR_CELLS + 1];
+    uint8_t terms[BF_LINEAR_CELLS][BF_LINEAR_CELLS + 1][BF_LINEAR_DEGREE + 1] = { { { 0 } } };
+    struct bf_linear_value *value;
+    size_t count; // Index of the constant in 'step', after the cells.
+    size_t remaining = 0;
+    bool zero;
+    bool ready;
+    bool progress;
+    long source;
+
+    if (!bf_utils_check_flag(program->ir[pos].flags, BF_INS_FLAG_BALANCED)) {
+        return false;
+    }
+
+    // The counter always gets index 0.
+    bf_linear_cell(&state, (int16_t)program->ir[pos].shift);
+    if (!bf_linear_run(&state, pos + 1, end)) {
+        return false;
+    }
+
+    // Cells that end up with a value that only depends on cells the loop
+    // doesn't change have that value at the start of every iteration after
+    // the first one. The body runs once so the rest can start from there.
+    loop->peeled = false;
+    for (size_t cell = 1; cell < state.count; cell++) {
+        value = &state.values[cell];
+        if (!value->known || value->factors[cell] != 0) {
+            continue;
+        }
+
+        reset[cell] = true;
+        for (size_t other = 0; other < state.count; other++) {
+            if (value->factors[other] != 0 && !bf_linear_equal(&state.values[other], &state.start[other])) {
+                reset[cell] = false;
+            }
+        }
+        loop->peeled |= reset[cell];
+    }
+
+    if (loop->peeled) {
+        for (size_t cell = 0; cell < state.count; cell++) {
+            if (reset[cell]) {
+                state.start[cell] = state.values[cell];
+            }
+            state.values[cell] = state.start[cell];
+        }
+        if (!bf_linear_run(&state, pos + 1, end)) {
+            return false;
+        }
+
+        for (size_t cell = 0; cell < state.count; cell++) {
+            if (!reset[cell]) {
+                continue;
+            }
+            if (!bf_linear_equal(&state.values[cell], &state.start[cell])) {
+                return false;
+            }
+            for (size_t other = 0; other < state.count; other++) {
+                if (state.start[cell].factors[other] != 0
+                    && !bf_linear_equal(&state.values[other], &state.start[other])) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    // The counter has to go down by exactly one.
+    value = &state.values[0];
+    value->factors[0]--;
+    value->constant++;
+    if (!bf_linear_constant(value) || value->constant != 0) {
+        return false;
+    }
+
+    // Every other cell either stays the same or changes by a constant plus
+    // multiples of cells, which makes an iteration 'x = x + step * x' over
+    // the cells and the constant 1. 'step' can only depend on cells that
+    // change less, so its powers eventually vanish.
+    count = state.count;
+    step[0][count] = -1;
+    for (size_t cell = 1; cell < count; cell++) {
+        value = &state.values[cell];
+        if (!value->known) {
+            return false;
+        } else if (reset[cell] || bf_linear_equal(value, &state.start[cell])) {
+            continue;
+        } else if (value->factors[cell] != 1) {
+            return false;
+        }
+
+        changed[cell] = true;
+        remaining++;
+        for (size_t other = 0; other < count; other++) {
+            step[cell][other] = value->factors[other] - (other == cell);
+        }
+        step[cell][count] = value->constant;
+    }
+
+    // After n iterations the cells are 'x = sum(C(n, d) * step^d * x)'. The
+    // counter itself reads as n, and n * C(n, d) is folded into
+    // (d + 1) * C(n, d + 1) + d * C(n, d).
+    memcpy(power, step, sizeof(power));
+    for (size_t degree = 1;; degree++) {
+        zero = true;
+        for (size_t cell = 0; cell <= count; cell++) {
+            for (size_t other = 0; other <= count; other++) {
+                zero &= power[cell][other] == 0;
+            }
+        }
+        if (zero) {
+            break;
+        } else if (degree == BF_LINEAR_DEGREE) {
+            return false;
+        }
+
+        for (size_t cell = 1; cell < count; cell++) {
+            for (size_t other = 0; other <= count; other++) {
+                if (other == 0) {
+                    terms[cell][count][degree + 1] += power[cell][0] * (degree + 1);
+                    terms[cell][count][degree] += power[cell][0] * degree;
+                } else {
+                    terms[cell][other][degree] += power[cell][other];
+                }
+            }
+        }
+
+        for (size_t cell = 0; cell <= count; cell++) {
+            for (size_t other = 0; other <= count; other++) {
+                product[cell][other] = 0;
+                for (size_t k = 0; k <= count; k++) {
+                    product[cell][other] += power[cell][k] * step[k][other];
+                }
+            }
+        }
+        memcpy(power, product, sizeof(power));
+    }
+
+    // Every term reads the cells as they were before the loop, so a cell is
+    // only updated once no other cell that's left reads it.
+    loop->size = 0;
+    while (remaining > 0) {
+        progress = false;
+        for (size_t cell = 1; cell < count && !progress; cell++) {
+            if (!changed[cell] || emitted[cell]) {
+                continue;
+            }
+
+            ready = true;
+            for (size_t other = 1; other < count; other++) {
+                for (size_t degree = 1; degree <= BF_LINEAR_DEGREE; degree++) {
+                    ready &= other == cell || !changed[other] || emitted[other] || terms[other][cell][degree] == 0;
+                }
+            }
+            if (!ready) {
+                continue;
+            }
+
+            for (size_t degree = 1; degree <= BF_LINEAR_DEGREE; degree++) {
+                for (size_t other = 1; other <= count; other++) {
+                    if (terms[cell][other][degree] == 0) {
+                        continue;
+                    }
+
+                    source = other == count ? state.cells[0] : state.cells[other];
+                    if (other == count && degree == 1) {
+                        if (!bf_linear_emit(loop, BF_INS_MUL, terms[cell][other][degree], state.cells[0], state.cells[cell], source)) {
+                            return false;
+                        }
+                    } else if (!bf_linear_emit(loop, BF_INS_POLY, terms[cell][other][degree] | degree << 8, state.cells[0], state.cells[cell], source)) {
+                        return false;
+                    }
+                }
+            }
+            emitted[cell] = true;
+            remaining--;
+            progress = true;
+        }
+
+        if (!progress) {
+            return false;
+        }
+    }
+
+    return bf_linear_emit(loop, BF_INS_CLEAR, 0, state.cells[0], state.cells[0], state.cells[0]);
+}
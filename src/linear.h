@@ -0,0 +1,68 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef BF_LINEAR_H
+#define BF_LINEAR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "program.h"
+
+/** Most cells a loop solved by 'bf_linear_solve' may access. */
+#define BF_LINEAR_CELLS 16
+
+/** Highest power of the loop counter a closed form may use. */
+#define BF_LINEAR_DEGREE 8
+
+/** Most instructions in a closed form, including the final CLEAR. */
+#define BF_LINEAR_TERMS 32
+
+/**
+ * The closed form of a loop found by 'bf_linear_solve'. It's made of MUL and
+ * POLY instructions that read the loop counter, followed by a CLEAR of the
+ * counter. If 'peeled' is set the closed form only covers the iterations after
+ * the first one, so the body has to run once before it.
+ */
+struct bf_linear_loop {
+    bool peeled;
+    size_t size;
+    struct bf_instruction ir[BF_LINEAR_TERMS];
+};
+
+/**
+ * Works out the closed form of the balanced loop at 'pos', which has to count
+ * its cell down by one on every iteration and only add to cells multiples of
+ * other cells and constants. Each cell then ends up as a polynomial in the
+ * number of iterations modulo 256. 'loops' holds the closed forms of the loops
+ * nested in it (indexed by IR index, NULL if a loop has none), which is why
+ * loops have to be solved from the innermost outwards.
+ *
+ * Cells that the body sets to the same value on every iteration, such as the
+ * counter of a nested loop, are only known after the first iteration. Loops
+ * with such cells are peeled.
+ *
+ * Returns false if the loop can't be solved.
+ */
+bool bf_linear_solve(const struct bf_program *program, struct bf_linear_loop *const *loops, size_t pos, struct bf_linear_loop *loop);
+
+#endif
@@ -18,15 +18,28 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <ctype.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include "assembler.h"
+#include "batch.h"
 #include "compiler.h"
+#include "engine.h"
+#include "idioms.h"
 #include "interpreter.h"
+#include "jit.h"
+#include "perf.h"
 #include "program.h"
+#include "server.h"
 #include "transpiler.h"
 #include "utils.h"
 
@@ -41,6 +54,7 @@ void mlbf_print_usage()
         stderr,
 
         "Usage: mlbf [options] [script]\n"
+        "       mlbf --batch [options] script input...\n"
         "\n"
         "If no script is supplied, stdin is read for source code.\n"
         "\n"
@@ -49,11 +63,451 @@ void mlbf_print_usage()
         "  -v, --version  Print mlbf version (\"%s\").\n"
         "  -d, --dump     Dump compiled bytecode to stdout.\n"
         "  -o, --output   Dump C source code to the provided path.\n"
+        "      --shards <n>\n"
+        "                 Split the C source code over this many files, named\n"
+        "                 like the output path with -1, -2, ... appended.\n"
+        "      --assembly <path>\n"
+        "                 Dump x86-64 assembly to the provided path.\n"
+        "  -b, --bench    Print compile and run timings as JSON to stderr.\n"
+        "      --stats    Print the time spent in each compiler phase, the size\n"
+        "                 of the IR after it and the loops rewritten as JSON to\n"
+        "                 stderr.\n"
+        "      --perf-counters\n"
+        "                 Count cycles, instructions, branch misses and L1 data\n"
+        "                 cache misses of each compiler phase and of the run,\n"
+        "                 and print them as JSON to stderr. Linux only.\n"
+        "      --jit      Compile the script to machine code before running it.\n"
+        "      --lazy     Optimize each loop when it first runs rather than the\n"
+        "                 whole script up front. Only used by the interpreter.\n"
+        "      --batch    Run the script once for every input file given after it,\n"
+        "                 in lockstep over SIMD lanes, and write the output of\n"
+        "                 each run to the path of its input with .out appended.\n"
+        "      --engine <interpreter|lazy|jit|auto>\n"
+        "                 Run the script on this engine. auto picks one from the\n"
+        "                 size of the script, its loops, whether it reads input\n"
+        "                 and a short sample run, and says which on stderr.\n"
+        "      --sparse-memory\n"
+        "                 Only allocate memory pages the script writes to.\n"
+        "      --verify-idioms\n"
+        "                 Check the native idioms against their brainfuck code.\n"
+        "\n"
+        "Job server:\n"
+        "  -s, --serve <socket>    Run jobs sent to a UNIX socket at this path.\n"
+        "  -j, --workers <n>       Number of worker threads (default %d).\n"
+        "      --cache-size <n>    Compiled programs kept in memory (default %d).\n"
+        "  -c, --connect <socket>  Run the script on a server instead.\n"
+        "      --max-steps <n>     Stop the job after about this many instructions.\n"
+        "      --max-output <n>    Stop the job after this many bytes of output.\n"
         "\n"
         "For reporting bugs / viewing source code, please see:\n"
         "<https://github.com/Reshurum/mlbf>\n",
 
-        mlbf_version());
+        mlbf_version(), BF_SERVER_DEFAULT_WORKERS, BF_SERVER_DEFAULT_CACHE_SIZE);
+}
+
+/**
+ * Writes the C source code of a program to 'path'. Extra shards go next to it,
+ * with the shard number added before the extension. Returns false on error.
+ */
+bool mlbf_transpile(struct bf_program *program, const char *path, int shards)
+{
+    FILE **files;
+    char shard_path[PATH_MAX];
+    const char *extension = strrchr(path, '.');
+    int stem = extension && !strchr(extension, '/') ? extension - path : (int)strlen(path);
+    int opened = 0;
+    bool result = false;
+
+    extension = path + stem;
+
+    files = calloc(shards, sizeof(FILE *));
+    if (!files) {
+        fprintf(stderr, "Unable to allocate memory for the C source code.\n");
+        return false;
+    }
+
+    for (; opened < shards; opened++) {
+        if (opened == 0) {
+            snprintf(shard_path, sizeof(shard_path), "%s", path);
+        } else {
+            snprintf(shard_path, sizeof(shard_path), "%.*s-%d%s", stem, path, opened, extension);
+        }
+
+        files[opened] = fopen(shard_path, "w");
+        if (files[opened] == NULL) {
+            fprintf(stderr, "Unable to write compiled output to '%s'.\n", shard_path);
+            goto cleanup;
+        }
+    }
+
+    result = bf_transpile_sharded(program, files, shards);
+    if (!result) {
+        fprintf(stderr, "Unable to allocate memory for the C source code.\n");
+    }
+
+cleanup:
+    while (opened > 0) {
+        fclose(files[--opened]);
+    }
+    free(files);
+
+    return result;
+}
+
+/**
+ * Writes the x86-64 assembly of a program to 'path'. Returns false on error.
+ */
+bool mlbf_assemble(struct bf_program *program, const char *path)
+{
+    FILE *fp;
+    bool result;
+
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Unable to write compiled output to '%s'.\n", path);
+        return false;
+    }
+
+    result = bf_assemble_program(program, fp);
+    if (!result) {
+        fprintf(stderr, "Unable to allocate memory for the assembly.\n");
+    }
+    fclose(fp);
+
+    return result;
+}
+
+/**
+ * Reads all of an input file for --batch into 'data'. Returns false on error.
+ */
+bool mlbf_read_input(const char *path, uint8_t **data, size_t *size)
+{
+    FILE *fp;
+    uint8_t *grown;
+    size_t capacity = FILE_ALLOC_SIZE;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Unable to open file '%s'.\n", path);
+        return false;
+    }
+
+    *size = 0;
+    *data = malloc(capacity);
+    while (*data) {
+        *size += fread(*data + *size, 1, capacity - *size, fp);
+        if (*size < capacity) {
+            break;
+        }
+        capacity *= 2;
+        grown = realloc(*data, capacity);
+        if (!grown) {
+            free(*data);
+        }
+        *data = grown;
+    }
+    fclose(fp);
+
+    if (!*data) {
+        fprintf(stderr, "Unable to allocate memory for '%s'.\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Writes the output of a --batch run to 'path'. Returns false on error,
+ * including a short write.
+ */
+bool mlbf_write_output(const char *path, const uint8_t *data, size_t size)
+{
+    FILE *fp;
+    bool written;
+
+    fp = fopen(path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Unable to open file '%s'.\n", path);
+        return false;
+    }
+
+    // Runs that write nothing may not have an output buffer at all.
+    written = size == 0 || fwrite(data, 1, size, fp) == size;
+    written &= fclose(fp) == 0;
+    if (!written) {
+        fprintf(stderr, "Unable to write output to '%s'.\n", path);
+    }
+
+    return written;
+}
+
+/**
+ * Runs a script once for every input file in 'paths', BF_BATCH_LANES of them
+ * at a time, and writes the output of each run to its path with ".out"
+ * appended. What the batches measured is added up in 'stats'. Returns false
+ * on error.
+ */
+bool mlbf_batch(struct bf_program *program, char **paths, int count, struct bf_batch_stats *stats)
+{
+    struct bf_batch_lane lanes[BF_BATCH_LANES];
+    struct bf_batch_stats batch_stats;
+    char output_path[PATH_MAX];
+    bool written;
+    int start, size;
+    int read = 0;
+    bool result = false;
+
+    memset(stats, 0, sizeof(struct bf_batch_stats));
+
+    for (start = 0; start < count; start += size) {
+        size = count - start < BF_BATCH_LANES ? count - start : BF_BATCH_LANES;
+        for (read = 0; read < size; read++) {
+            if (!mlbf_read_input(paths[start + read], (uint8_t **)&lanes[read].input, &lanes[read].input_size)) {
+                goto cleanup;
+            }
+        }
+
+        if (!bf_batch_run(program, lanes, size, &batch_stats)) {
+            fprintf(stderr, "Unable to allocate memory for the batch.\n");
+            goto cleanup;
+        }
+        stats->dispatches += batch_stats.dispatches;
+        stats->lane_dispatches += batch_stats.lane_dispatches;
+        stats->splits += batch_stats.splits;
+        stats->merges += batch_stats.merges;
+        stats->scalar_lanes += batch_stats.scalar_lanes;
+
+        for (int i = 0; i < size; i++) {
+            snprintf(output_path, sizeof(output_path), "%s.out", paths[start + i]);
+            written = mlbf_write_output(output_path, lanes[i].output, lanes[i].output_size);
+            free(lanes[i].output);
+            if (!written) {
+                while (++i < size) {
+                    free(lanes[i].output);
+                }
+                goto cleanup;
+            }
+        }
+
+        while (read > 0) {
+            free((uint8_t *)lanes[--read].input);
+        }
+    }
+    result = true;
+
+cleanup:
+    while (read > 0) {
+        free((uint8_t *)lanes[--read].input);
+    }
+
+    return result;
+}
+
+/**
+ * Writes what was measured while reading and compiling a script to stderr as
+ * a single line of JSON.
+ */
+void mlbf_print_stats(uint64_t read_ns, const struct bf_compile_stats *stats)
+{
+    const struct bf_pass_stats *pass;
+
+    fprintf(stderr,
+        "{\"read_ns\": %" PRIu64 ", \"unoptimized_ns\": %" PRIu64 ", \"unoptimized_size\": %zu, \"passes\": [",
+        read_ns, stats->unoptimized_ns, stats->unoptimized_size);
+    for (size_t i = 0; i < stats->pass_count; i++) {
+        pass = &stats->passes[i];
+        fprintf(stderr, "%s{\"name\": \"%s\", \"ns\": %" PRIu64 ", \"size_before\": %zu, \"size_after\": %zu}",
+            i > 0 ? ", " : "", pass->name, pass->ns, pass->size_before, pass->size_after);
+    }
+    fprintf(stderr,
+        "], \"lower_ns\": %" PRIu64 ", \"code_bytes\": %zu, "
+        "\"clear_loops\": %zu, \"copy_loops\": %zu, \"mul_loops\": %zu}\n",
+        stats->lower_ns, stats->code_size, stats->clear_loops, stats->copy_loops, stats->mul_loops);
+}
+
+/**
+ * Writes the counts of a phase as a JSON object, with null for the events that
+ * couldn't be counted.
+ */
+void mlbf_print_counts(const struct bf_perf_counts *counts)
+{
+    fputc('{', stderr);
+    for (int i = 0; i < BF_PERF_EVENT_COUNT; i++) {
+        fprintf(stderr, "%s\"%s\": ", i > 0 ? ", " : "", bf_perf_event_name(i));
+        if (counts->values[i] < 0) {
+            fprintf(stderr, "null");
+        } else {
+            fprintf(stderr, "%" PRId64, counts->values[i]);
+        }
+    }
+    fputc('}', stderr);
+}
+
+/**
+ * Writes 'count / total' as a JSON number, or null if either isn't known.
+ */
+void mlbf_print_ratio(int64_t count, int64_t total)
+{
+    if (count < 0 || total <= 0) {
+        fprintf(stderr, "null");
+    } else {
+        fprintf(stderr, "%.3f", (double)count / total);
+    }
+}
+
+/**
+ * Writes the hardware events counted in each compiler phase and while running
+ * the script to stderr as a single line of JSON. 'run' is NULL if the script
+ * wasn't run. Dispatches are only counted by the interpreter, so the metrics
+ * per dispatch are null for the JIT.
+ */
+void mlbf_print_perf_counters(
+    const struct bf_compile_stats *stats, const struct bf_perf_counts *run, uint64_t dispatches)
+{
+    const struct bf_pass_stats *pass;
+
+    fprintf(stderr, "{\"unoptimized\": ");
+    mlbf_print_counts(&stats->unoptimized_counts);
+    fprintf(stderr, ", \"passes\": [");
+    for (size_t i = 0; i < stats->pass_count; i++) {
+        pass = &stats->passes[i];
+        fprintf(stderr, "%s{\"name\": \"%s\", \"counts\": ", i > 0 ? ", " : "", pass->name);
+        mlbf_print_counts(&pass->counts);
+        fputc('}', stderr);
+    }
+    fprintf(stderr, "], \"lower\": ");
+    mlbf_print_counts(&stats->lower_counts);
+    fprintf(stderr, ", \"run\": ");
+    if (!run) {
+        fprintf(stderr, "null}\n");
+        return;
+    }
+    mlbf_print_counts(run);
+    fprintf(stderr, ", \"dispatches\": %" PRIu64 ", \"cycles_per_dispatch\": ", dispatches);
+    mlbf_print_ratio(run->values[BF_PERF_CYCLES], dispatches);
+    fprintf(stderr, ", \"instructions_per_dispatch\": ");
+    mlbf_print_ratio(run->values[BF_PERF_INSTRUCTIONS], dispatches);
+    fprintf(stderr, ", \"branch_misses_per_dispatch\": ");
+    mlbf_print_ratio(run->values[BF_PERF_BRANCH_MISSES], dispatches);
+    fprintf(stderr, ", \"ipc\": ");
+    mlbf_print_ratio(run->values[BF_PERF_INSTRUCTIONS], run->values[BF_PERF_CYCLES]);
+    fprintf(stderr, "}\n");
+}
+
+/**
+ * Checks every idiom in 'bf_idioms' against its snippet and prints how many
+ * states were verified. Returns false if any of them don't match.
+ */
+bool mlbf_verify_idioms()
+{
+    const struct bf_idiom *idiom;
+    size_t states;
+    bool result = true;
+
+    for (idiom = bf_idioms; idiom->name; idiom++) {
+        if (bf_idiom_verify(idiom, &states)) {
+            printf("%s: %zu states verified\n", idiom->name, states);
+        } else {
+            fprintf(stderr, "%s: native version doesn't match the snippet.\n", idiom->name);
+            result = false;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Forwards stdin to a job server in INPUT frames until EOF. Input is sent a
+ * line at a time so interactive programs work, and it's read through stdio
+ * since the script itself may have been read from stdin before it.
+ */
+void mlbf_client_forward_input(int fd)
+{
+    uint8_t buf[BF_FRAME_MAX_SIZE];
+    size_t len = 0;
+    int ch;
+
+    while ((ch = getchar()) != EOF) {
+        buf[len++] = ch;
+
+        if (ch == '\n' || len == sizeof(buf)) {
+            if (!bf_server_write_frame(fd, BF_FRAME_INPUT, buf, len)) {
+                return; // The job has finished.
+            }
+            len = 0;
+        }
+    }
+    if (len > 0 && !bf_server_write_frame(fd, BF_FRAME_INPUT, buf, len)) {
+        return;
+    }
+    bf_server_write_frame(fd, BF_FRAME_INPUT, NULL, 0);
+}
+
+/**
+ * Runs a script on a server started with --serve, writing the output it
+ * streams back to stdout. Returns false if the job didn't succeed.
+ */
+bool mlbf_client(const char *path, const char *src, const struct bf_job_limits *limits)
+{
+    struct bf_frame_header header;
+    struct bf_job_result result = { .status = BF_JOB_ERROR };
+    uint8_t buf[BF_FRAME_MAX_SIZE];
+    pid_t pid;
+    int fd;
+
+    fd = bf_server_connect(path);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to connect to '%s'.\n", path);
+        goto error1;
+    }
+    if (!bf_server_write_frame(fd, BF_FRAME_LIMITS, limits, sizeof(*limits))
+        || !bf_server_write_frame(fd, BF_FRAME_SCRIPT, src, strlen(src))) {
+        fprintf(stderr, "Unable to send the job to '%s'.\n", path);
+        goto error2;
+    }
+
+    // Input is forwarded by a child process so neither side can block the
+    // other, e.g. when a program writes a lot before reading any input.
+    pid = fork();
+    if (pid < 0) {
+        goto error2;
+    } else if (pid == 0) {
+        mlbf_client_forward_input(fd);
+        _exit(0);
+    }
+
+    while (bf_server_read_all(fd, &header, sizeof(header))) {
+        if (header.type == BF_FRAME_OUTPUT && header.size <= sizeof(buf)) {
+            if (!bf_server_read_all(fd, buf, header.size)) {
+                break;
+            }
+            fwrite(buf, 1, header.size, stdout);
+            fflush(stdout);
+        } else if (header.type == BF_FRAME_STATUS && header.size == sizeof(result)) {
+            if (!bf_server_read_all(fd, &result, sizeof(result))) {
+                result.status = BF_JOB_ERROR;
+            }
+            break;
+        } else {
+            break; // Malformed response.
+        }
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    close(fd);
+
+    if (result.status != BF_JOB_SUCCESS) {
+        fprintf(stderr, "%s\n", bf_server_status_message(result.status));
+        goto error1;
+    }
+
+    return true;
+
+error2:
+    close(fd);
+error1:
+    return false;
 }
 
 int main(int argc, char *argv[])
@@ -64,24 +518,67 @@ int main(int argc, char *argv[])
     size_t alloc_size;
     char *src;
     struct bf_vm *vm;
+    struct bf_jit *jit = NULL;
     struct bf_program *program;
+    struct bf_compile_stats stats;
+    struct bf_perf perf;
+    struct bf_perf_counts run_counts;
+    bool perf_open = false;
+    uint64_t read_start, compile_start, run_start;
+    uint64_t read_ns, compile_ns, run_ns = 0;
 
     // Command-line flags from getopt.
     char *output_path = NULL;
+    char *assembly_path = NULL;
+    char *serve_path = NULL;
+    char *connect_path = NULL;
+    int shards = 1;
+    int workers = BF_SERVER_DEFAULT_WORKERS;
+    size_t cache_size = BF_SERVER_DEFAULT_CACHE_SIZE;
+    struct bf_job_limits limits = { 0 };
     int help_flag = 0;
     int version_flag = 0;
     int dump_flag = 0;
+    int bench_flag = 0;
+    int stats_flag = 0;
+    int perf_flag = 0;
+    int sparse_flag = 0;
+    int jit_flag = 0;
+    int lazy_flag = 0;
+    int batch_flag = 0;
+    struct bf_batch_stats batch_stats;
+    enum bf_engine engine = BF_ENGINE_INTERPRETER;
+    struct bf_engine_choice choice = { 0 };
+    int verify_idioms_flag = 0;
+    uint32_t vm_flags = 0;
 
     const struct option long_options[] = {
         { "help", no_argument, &help_flag, 'h' },
         { "version", no_argument, &version_flag, 'v' },
         { "dump", no_argument, &dump_flag, 'd' },
         { "output", required_argument, NULL, 'o' },
+        { "bench", no_argument, &bench_flag, 'b' },
+        { "stats", no_argument, &stats_flag, 'T' },
+        { "perf-counters", no_argument, &perf_flag, 'P' },
+        { "shards", required_argument, NULL, 'N' },
+        { "assembly", required_argument, NULL, 'A' },
+        { "sparse-memory", no_argument, &sparse_flag, 'M' },
+        { "jit", no_argument, &jit_flag, 'J' },
+        { "lazy", no_argument, &lazy_flag, 'L' },
+        { "engine", required_argument, NULL, 'E' },
+        { "batch", no_argument, &batch_flag, 'B' },
+        { "verify-idioms", no_argument, &verify_idioms_flag, 'I' },
+        { "serve", required_argument, NULL, 's' },
+        { "workers", required_argument, NULL, 'j' },
+        { "cache-size", required_argument, NULL, 'C' },
+        { "connect", required_argument, NULL, 'c' },
+        { "max-steps", required_argument, NULL, 'S' },
+        { "max-output", required_argument, NULL, 'O' },
         { NULL, 0, NULL, 0 },
     };
 
     opterr = 0;
-    while ((c = getopt_long(argc, argv, "hvdo:", long_options, &option_index)) != -1) {
+    while ((c = getopt_long(argc, argv, "hvdbo:s:j:c:", long_options, &option_index)) != -1) {
         switch (c) {
         case 0:
             break;
@@ -94,11 +591,44 @@ int main(int argc, char *argv[])
         case 'd':
             dump_flag = 1;
             break;
+        case 'b':
+            bench_flag = 1;
+            break;
         case 'o':
             output_path = bf_strdup(optarg);
             break;
+        case 'N':
+            shards = atoi(optarg);
+            break;
+        case 'A':
+            assembly_path = optarg;
+            break;
+        case 'E':
+            if (!bf_engine_parse(optarg, &engine)) {
+                fprintf(stderr, "Unknown engine '%s'.\n", optarg);
+                goto error1;
+            }
+            break;
+        case 's':
+            serve_path = optarg;
+            break;
+        case 'j':
+            workers = atoi(optarg);
+            break;
+        case 'C':
+            cache_size = strtoull(optarg, NULL, 10);
+            break;
+        case 'c':
+            connect_path = optarg;
+            break;
+        case 'S':
+            limits.max_steps = strtoull(optarg, NULL, 10);
+            break;
+        case 'O':
+            limits.max_output = strtoull(optarg, NULL, 10);
+            break;
         case '?':
-            if (optopt == 'o') {
+            if (optopt == 'o' || optopt == 's' || optopt == 'j' || optopt == 'c') {
                 fprintf(stderr, "Option -%c requires an argument.\n", optopt);
             } else if (isprint(optopt)) {
                 fprintf(stderr, "Unknown option `-%c'.\n", optopt);
@@ -112,12 +642,40 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (sparse_flag) {
+        vm_flags |= BF_SPARSE_MEMORY;
+    }
+    if (jit_flag) {
+        engine = BF_ENGINE_JIT;
+    } else if (lazy_flag) {
+        engine = BF_ENGINE_LAZY;
+    }
+
     if (help_flag) {
         mlbf_print_usage();
         goto error1;
     } else if (version_flag) {
         printf("%s\n", mlbf_version());
         goto success1;
+    } else if (verify_idioms_flag) {
+        if (!mlbf_verify_idioms()) {
+            goto error1;
+        }
+        goto success1;
+    } else if (serve_path) {
+        if (workers < 1) {
+            fprintf(stderr, "At least one worker is needed.\n");
+            goto error1;
+        }
+        if (!bf_server_run(serve_path, workers, cache_size, vm_flags)) {
+            goto error1;
+        }
+        goto success1;
+    }
+
+    if (batch_flag && optind >= argc) {
+        fprintf(stderr, "The script has to be a file for --batch.\n");
+        goto error1;
     }
 
     // Read the source code from a file if an argument is specified, otherwise
@@ -136,7 +694,9 @@ int main(int argc, char *argv[])
     }
 
     // Read and compile the brainfuck source code.
+    read_start = bf_perf_time_ns();
     src = bf_read_file(fp, alloc_size);
+    read_ns = bf_perf_time_ns() - read_start;
     if (src == NULL) {
         fprintf(stderr, "Unable to read source code.\n");
         goto error1;
@@ -144,46 +704,185 @@ int main(int argc, char *argv[])
     if (fp != stdin) {
         fclose(fp);
     }
-    program = bf_compile(src);
+
+    // Compilation and execution happen on the server in client mode.
+    if (connect_path) {
+        if (!mlbf_client(connect_path, src, &limits)) {
+            goto error2;
+        }
+        free(src);
+        goto success1;
+    }
+
+    // Counters that can't be opened are reported as null rather than failing
+    // the run, e.g. in containers or when perf_event_paranoid forbids them.
+    if (perf_flag) {
+        perf_open = bf_perf_open(&perf);
+        if (!perf_open) {
+            fprintf(stderr, "Performance counters are unavailable, their counts are reported as null.\n");
+        }
+    }
+
+    // Lazily compiled programs can only be interpreted, every other output
+    // needs the whole program optimized. So do the stats and the counters,
+    // which are about the optimizer.
+    if (dump_flag || output_path || assembly_path || stats_flag || perf_flag || batch_flag) {
+        if (engine == BF_ENGINE_LAZY) {
+            engine = BF_ENGINE_INTERPRETER;
+        }
+    } else if (engine == BF_ENGINE_AUTO && bf_engine_pick_source(src, &choice) == BF_ENGINE_LAZY) {
+        engine = BF_ENGINE_LAZY;
+        fprintf(stderr, "Picked the lazy engine since %s.\n", choice.reason);
+    }
+
+    compile_start = bf_perf_time_ns();
+    if (engine == BF_ENGINE_LAZY) {
+        program = bf_compile_lazy(src);
+    } else {
+        program = bf_compile_measured(src, perf_open ? &perf : NULL, &stats);
+    }
+    compile_ns = bf_perf_time_ns() - compile_start;
     if (!program) {
         fprintf(stderr, "Unable to compile source code.\n");
-        goto error2;
+        goto error3;
+    }
+    if (stats_flag) {
+        mlbf_print_stats(read_ns, &stats);
+    }
+
+    if (perf_flag && (batch_flag || dump_flag || output_path || assembly_path)) {
+        mlbf_print_perf_counters(&stats, NULL, 0);
     }
 
-    if (dump_flag) {
+    if (batch_flag) {
+        run_start = bf_perf_time_ns();
+        if (!mlbf_batch(program, &argv[optind + 1], argc - optind - 1, &batch_stats)) {
+            bf_program_destroy(program);
+            goto error3;
+        }
+        run_ns = bf_perf_time_ns() - run_start;
+
+        // Dispatches are counted per group of lanes, the lanes they covered
+        // are counted separately.
+        if (bench_flag) {
+            fprintf(stderr,
+                "{\"compile_ns\": %" PRIu64 ", \"run_ns\": %" PRIu64 ", \"runs\": %d, "
+                "\"dispatches\": %" PRIu64 ", \"lane_dispatches\": %" PRIu64 ", \"splits\": %zu, "
+                "\"merges\": %zu, \"scalar_runs\": %zu, \"peak_rss_kb\": %zu}\n",
+                compile_ns, run_ns, argc - optind - 1, batch_stats.dispatches, batch_stats.lane_dispatches,
+                batch_stats.splits, batch_stats.merges, batch_stats.scalar_lanes, bf_utils_peak_rss_kb());
+        }
+        bf_program_destroy(program);
+    } else if (dump_flag) {
         bf_program_dump(program);
         bf_program_destroy(program);
     } else if (output_path) {
-        if (access(output_path, W_OK) != -1) {
-            remove(output_path);
+        if (shards < 1) {
+            fprintf(stderr, "At least one shard is needed.\n");
+            bf_program_destroy(program);
+            goto error3;
         }
-
-        FILE *output_file = fopen(output_path, "w");
-        if (output_file == NULL) {
-            fprintf(stderr, "Unable to write compiled output to '%s'.", output_path);
-            goto error2;
+        if (!mlbf_transpile(program, output_path, shards)) {
+            bf_program_destroy(program);
+            goto error3;
+        }
+        bf_program_destroy(program);
+    } else if (assembly_path) {
+        if (!mlbf_assemble(program, assembly_path)) {
+            bf_program_destroy(program);
+            goto error3;
         }
-
-        bf_transpile_program(program, output_file);
         bf_program_destroy(program);
-        fclose(output_file);
     } else {
         // Read brainfuck source code from stdin and initialize the virtual
         // machine. TODO: Add a compilation before this call once the bytecode
         // is defined.
-        vm = bf_vm_create(program, 0);
+        vm = bf_vm_create(program, vm_flags);
         if (!vm) {
             fprintf(stderr, "Unable to initialize vm.\n");
-            goto error2;
+            goto error3;
+        }
+
+        // The sample run of --engine=auto either runs the whole script, or it's
+        // thrown away and counts towards the compile time like the JIT.
+        if (engine == BF_ENGINE_AUTO) {
+            compile_start = bf_perf_time_ns();
+            if (!bf_engine_pick(vm, &choice)) {
+                fprintf(stderr, "Unable to allocate memory for the sample run.\n");
+                bf_vm_destroy(vm);
+                goto error3;
+            }
+            run_ns = bf_perf_time_ns() - compile_start;
+            engine = choice.engine;
+            fprintf(stderr,
+                "Picked the %s engine since %s (%zu instructions, loops nested %zu deep, "
+                "%s input, %" PRIu64 " instructions sampled).\n",
+                bf_engine_name(engine), choice.reason, choice.size, choice.depth, choice.input ? "reads" : "no",
+                choice.sampled);
+            if (!choice.finished) {
+                compile_ns += run_ns;
+            }
+        }
+
+        // The JIT only replaces the execution loop, the vm still holds the
+        // memory. Compiling machine code counts towards the compile time.
+        if (engine == BF_ENGINE_JIT) {
+            compile_start = bf_perf_time_ns();
+            jit = bf_jit_compile(vm->program);
+            compile_ns += bf_perf_time_ns() - compile_start;
+            if (!jit) {
+                fprintf(stderr, "Unable to compile machine code, the JIT may not be supported here.\n");
+                bf_vm_destroy(vm);
+                goto error3;
+            }
         }
 
         // Start executing brainfuck in the virtual machine. Cleanup resources
         // used by the virtual machine before quitting and after bf_vm_run
         // returns (program finished running).
-        bf_vm_run(vm);
+        run_start = bf_perf_time_ns();
+        if (perf_open) {
+            bf_perf_start(&perf);
+        }
+        if (jit) {
+            bf_jit_run(jit, vm);
+            bf_jit_destroy(jit);
+        } else if (!choice.finished) {
+            bf_vm_run(vm);
+        }
+        if (perf_open) {
+            bf_perf_stop(&perf, &run_counts);
+        }
+        if (!choice.finished) {
+            run_ns = bf_perf_time_ns() - run_start;
+        }
+
+        // Timings go to stderr so they don't mix with program output. The
+        // benchmark harness (bench/bench.py) parses this line.
+        if (bench_flag) {
+            fflush(stdout);
+            fprintf(stderr,
+                "{\"compile_ns\": %" PRIu64 ", \"run_ns\": %" PRIu64 ", "
+                "\"instructions\": %zu, \"code_bytes\": %zu, "
+                "\"dispatches\": %" PRIu64 ", \"peak_rss_kb\": %zu}\n",
+                compile_ns, run_ns, vm->program->size, vm->program->code_size,
+                vm->dispatches, bf_utils_peak_rss_kb());
+        }
+        if (perf_flag) {
+            if (!perf_open) {
+                for (int i = 0; i < BF_PERF_EVENT_COUNT; i++) {
+                    run_counts.values[i] = -1;
+                }
+            }
+            fflush(stdout);
+            mlbf_print_perf_counters(&stats, &run_counts, vm->dispatches);
+        }
         bf_vm_destroy(vm);
     }
 
+    if (perf_open) {
+        bf_perf_close(&perf);
+    }
     free(src);
 success1:
     if (output_path) {
@@ -191,6 +890,10 @@ success1:
     }
     return 0;
 
+error3:
+    if (perf_open) {
+        bf_perf_close(&perf);
+    }
 error2:
     free(src);
 error1:
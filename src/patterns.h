@@ -97,4 +97,51 @@ static const struct bf_pattern_rule bf_pattern_mul_op[] = {
     { { BF_INS_ADD_V, 0 }, 0 },
 };
 
+/**
+ * A well-known snippet of brainfuck which has a native implementation. Idioms
+ * are matched against the source before any other pass has run, so 'source'
+ * is compared character by character (comments aside).
+ *
+ * The snippet works on the 'width' cells starting at the pointer. Only the
+ * cells in 'inputs' (a bit per cell) may hold any value, the native version
+ * falls back to running the snippet if any other one isn't zero. See
+ * 'bf_idiom_verify' for how the native versions are checked.
+ */
+struct bf_idiom {
+    const char *name;
+    enum bf_opcode opcode;
+    const char *source;
+    int width;
+    uint32_t inputs;
+};
+
+/**
+ * Idioms in the order they're tried, terminated by an entry with a NULL name.
+ *
+ * DIVMOD is the divmod algorithm from the esolangs wiki for divisors of 2 and
+ * up: '>n d' becomes '>0 d-n%d n%d n/d'.
+ *
+ * PRINT_DEC prints the cell as an unsigned decimal number and leaves memory as
+ * it was.
+ */
+static const struct bf_idiom bf_idioms[] = {
+    {
+        "divmod",
+        BF_INS_DIVMOD,
+        "[->-[>+>>]>[+[-<+>]>+>>]<<<<<]",
+        6,
+        0x3,
+    },
+    {
+        "print_dec",
+        BF_INS_PRINT_DEC,
+        ">>++++++++++<<[->+>-[>+>>]>[+[-<+>]>+>>]<<<<<<]>>[-]>>>++++++++++<[->-[>+>>]>[+[-<+>]>+>>]<<<<<]"
+        ">[-]>>[>++++++[-<++++++++>]<.<<+>+>[-]]<[<[->-<]++++++[->++++++++<]>.[-]]<<++++++[-<++++++++>]<.[-]<<"
+        "[-<+>]<",
+        10,
+        0x1,
+    },
+    { NULL, BF_INS_NOP, NULL, 0, 0 },
+};
+
 #endif
@@ -0,0 +1,167 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#define _DEFAULT_SOURCE
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "perf.h"
+
+#ifdef __linux__
+/**
+ * Sets the perf_event_open type and config of an event in 'attr'.
+ */
+void bf_perf_event_config(enum bf_perf_event event, struct perf_event_attr *attr)
+{
+    switch (event) {
+    case BF_PERF_CYCLES:
+        attr->type = PERF_TYPE_HARDWARE;
+        attr->config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+    case BF_PERF_INSTRUCTIONS:
+        attr->type = PERF_TYPE_HARDWARE;
+        attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+    case BF_PERF_BRANCH_MISSES:
+        attr->type = PERF_TYPE_HARDWARE;
+        attr->config = PERF_COUNT_HW_BRANCH_MISSES;
+        break;
+    default:
+        attr->type = PERF_TYPE_HW_CACHE;
+        attr->config = PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8
+            | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+        break;
+    }
+}
+#endif
+
+uint64_t bf_perf_time_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+bool bf_perf_open(struct bf_perf *perf)
+{
+    bool opened = false;
+
+    for (int i = 0; i < BF_PERF_EVENT_COUNT; i++) {
+        perf->fds[i] = -1;
+    }
+
+#ifdef __linux__
+    struct perf_event_attr attr;
+
+    for (int i = 0; i < BF_PERF_EVENT_COUNT; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        bf_perf_event_config(i, &attr);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        perf->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        opened |= perf->fds[i] >= 0;
+    }
+#endif
+
+    return opened;
+}
+
+void bf_perf_close(struct bf_perf *perf)
+{
+    for (int i = 0; i < BF_PERF_EVENT_COUNT; i++) {
+        if (perf->fds[i] >= 0) {
+            close(perf->fds[i]);
+            perf->fds[i] = -1;
+        }
+    }
+}
+
+void bf_perf_start(struct bf_perf *perf)
+{
+#ifdef __linux__
+    for (int i = 0; i < BF_PERF_EVENT_COUNT; i++) {
+        if (perf->fds[i] >= 0) {
+            ioctl(perf->fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(perf->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#else
+    (void)perf;
+#endif
+}
+
+void bf_perf_stop(struct bf_perf *perf, struct bf_perf_counts *counts)
+{
+    uint64_t values[3]; // The count, the time enabled and the time running.
+
+    for (int i = 0; i < BF_PERF_EVENT_COUNT; i++) {
+        counts->values[i] = -1;
+    }
+
+#ifdef __linux__
+    for (int i = 0; i < BF_PERF_EVENT_COUNT; i++) {
+        if (perf->fds[i] >= 0) {
+            ioctl(perf->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    for (int i = 0; i < BF_PERF_EVENT_COUNT; i++) {
+        // An event that never got onto the PMU, because others were using
+        // it, ran for no time at all and stays unavailable.
+        if (perf->fds[i] < 0 || read(perf->fds[i], values, sizeof(values)) != sizeof(values)
+            || values[2] == 0) {
+            continue;
+        }
+        counts->values[i] = (int64_t)((double)values[0] * values[1] / values[2]);
+    }
+#else
+    (void)perf;
+    (void)values;
+#endif
+}
+
+const char *bf_perf_event_name(enum bf_perf_event event)
+{
+    switch (event) {
+    case BF_PERF_CYCLES:
+        return "cycles";
+    case BF_PERF_INSTRUCTIONS:
+        return "instructions";
+    case BF_PERF_BRANCH_MISSES:
+        return "branch_misses";
+    case BF_PERF_L1D_MISSES:
+        return "l1d_misses";
+    default:
+        return "unknown";
+    }
+}
@@ -0,0 +1,93 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef BF_PERF_H
+#define BF_PERF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Hardware events that 'struct bf_perf' counts.
+ */
+enum bf_perf_event {
+    BF_PERF_CYCLES,
+    BF_PERF_INSTRUCTIONS,
+    BF_PERF_BRANCH_MISSES,
+    BF_PERF_L1D_MISSES, // Reads that missed the L1 data cache.
+    BF_PERF_EVENT_COUNT,
+};
+
+/**
+ * How often each event in 'enum bf_perf_event' happened between
+ * 'bf_perf_start' and 'bf_perf_stop'. Events that couldn't be counted are -1.
+ */
+struct bf_perf_counts {
+    int64_t values[BF_PERF_EVENT_COUNT];
+};
+
+/**
+ * Hardware performance counters of the calling thread, opened with
+ * perf_event_open on Linux. Only the user space part of the thread is
+ * counted. Events that the kernel, the hardware or the permissions of the
+ * process don't allow are left out.
+ */
+struct bf_perf {
+    int fds[BF_PERF_EVENT_COUNT]; // -1 if the event couldn't be opened.
+};
+
+/**
+ * Returns a timestamp in nanoseconds from the monotonic clock, so adjustments
+ * to the system time don't show up in measurements. Only the difference
+ * between two calls is meaningful.
+ */
+uint64_t bf_perf_time_ns();
+
+/**
+ * Opens a counter for every event that can be counted. Returns false if none
+ * of them can, such as on other systems or when perf events are disabled, in
+ * which case the counters can still be used but every count is -1.
+ */
+bool bf_perf_open(struct bf_perf *perf);
+
+/**
+ * Closes the counters.
+ */
+void bf_perf_close(struct bf_perf *perf);
+
+/**
+ * Resets the counters and starts counting.
+ */
+void bf_perf_start(struct bf_perf *perf);
+
+/**
+ * Stops counting and stores the counts since 'bf_perf_start' in 'counts'.
+ * Counts are scaled up if the kernel had to share the hardware counters with
+ * other events for part of the time.
+ */
+void bf_perf_stop(struct bf_perf *perf, struct bf_perf_counts *counts);
+
+/**
+ * Returns the name of an event as used in JSON output.
+ */
+const char *bf_perf_event_name(enum bf_perf_event event);
+
+#endif
@@ -0,0 +1,98 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "pool.h"
+
+struct bf_vm_pool *bf_vm_pool_create(size_t capacity)
+{
+    struct bf_vm_pool *pool;
+
+    pool = calloc(1, sizeof(struct bf_vm_pool) + sizeof(struct bf_vm *) * capacity);
+    if (!pool) {
+        goto error1;
+    }
+    if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+        goto error2;
+    }
+    pool->capacity = capacity;
+
+    return pool;
+
+error2:
+    free(pool);
+error1:
+    return NULL;
+}
+
+void bf_vm_pool_destroy(struct bf_vm_pool *pool)
+{
+    for (size_t i = 0; i < pool->size; i++) {
+        bf_vm_destroy(pool->vms[i]);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+struct bf_vm *bf_vm_pool_acquire(struct bf_vm_pool *pool, struct bf_program *program, uint32_t vm_flags)
+{
+    struct bf_vm *vm = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->size > 0) {
+        vm = pool->vms[--pool->size];
+        pool->reused++;
+    } else {
+        pool->created++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!vm) {
+        return bf_vm_create(program, vm_flags);
+    }
+
+    if (!bf_vm_load(vm, program, vm_flags)) {
+        bf_program_destroy(program);
+        bf_vm_pool_release(pool, vm);
+        return NULL;
+    }
+
+    return vm;
+}
+
+void bf_vm_pool_release(struct bf_vm_pool *pool, struct bf_vm *vm)
+{
+    bf_vm_reset(vm);
+    if (vm->program) {
+        bf_program_destroy(vm->program);
+        vm->program = NULL;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->size < pool->capacity) {
+        pool->vms[pool->size++] = vm;
+        vm = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (vm) {
+        bf_vm_destroy(vm);
+    }
+}
@@ -0,0 +1,71 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef BF_POOL_H
+#define BF_POOL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "interpreter.h"
+#include "program.h"
+
+/**
+ * A thread-safe pool of virtual machines. Creating a vm means allocating and
+ * zeroing all of its memory, while a vm that goes back to the pool only has
+ * the memory its last program touched cleared (see 'bf_vm_reset'). For short
+ * jobs that's a fraction of the cost.
+ */
+struct bf_vm_pool {
+    pthread_mutex_t lock;
+    size_t capacity;
+    size_t size;
+    uint64_t created; // Vms allocated because the pool was empty.
+    uint64_t reused;
+    struct bf_vm *vms[];
+};
+
+/**
+ * Creates an empty pool that keeps at most 'capacity' idle virtual machines.
+ */
+struct bf_vm_pool *bf_vm_pool_create(size_t capacity);
+
+/**
+ * Frees the pool along with every idle virtual machine in it. Virtual machines
+ * that are still in use have to be destroyed by their users.
+ */
+void bf_vm_pool_destroy(struct bf_vm_pool *pool);
+
+/**
+ * Takes an idle virtual machine from the pool, or creates one if there are
+ * none, and loads the program into it. Like 'bf_vm_create' the vm owns the
+ * program afterwards and the program is freed if this fails.
+ */
+struct bf_vm *bf_vm_pool_acquire(struct bf_vm_pool *pool, struct bf_program *program, uint32_t vm_flags);
+
+/**
+ * Resets a virtual machine, releases its program and puts it back into the
+ * pool. The vm is destroyed instead if the pool is full.
+ */
+void bf_vm_pool_release(struct bf_vm_pool *pool, struct bf_vm *vm);
+
+#endif
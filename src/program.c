@@ -18,14 +18,18 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 
+#include "filter.h"
+#include "interpreter.h"
 #include "program.h"
 #include "utils.h"
 
 #define INSTRUCTION_ALLOC_COUNT 1024
-#define BF_MAX_PROGRAM_SIZE 65536
+#define BF_MAX_PROGRAM_SIZE 0x8000000
 
 struct bf_program *bf_program_create()
 {
@@ -42,6 +46,9 @@ struct bf_program *bf_program_create()
     program->size = 0;
     program->capacity = INSTRUCTION_ALLOC_COUNT;
     program->ir = ir;
+    program->code_size = 0;
+    program->code = NULL;
+    atomic_init(&program->refcount, 1);
 
     return program;
 
@@ -53,25 +60,296 @@ error1:
 
 void bf_program_destroy(struct bf_program *program)
 {
+    if (atomic_fetch_sub(&program->refcount, 1) > 1) {
+        return; // Still used elsewhere.
+    }
+
+    free(program->strings);
+    free(program->filters);
+    free(program->code);
     free(program->ir);
     free(program);
 }
 
+struct bf_program *bf_program_retain(struct bf_program *program)
+{
+    atomic_fetch_add(&program->refcount, 1);
+    return program;
+}
+
+/**
+ * Adds a range of pointer offsets to the range already known for an
+ * instruction in 'bf_program_reach'.
+ */
+void bf_program_reach_merge(long *low, long *high, size_t pos, long from, long to)
+{
+    low[pos] = from < low[pos] ? from : low[pos];
+    high[pos] = to > high[pos] ? to : high[pos];
+}
+
+/**
+ * Returns the larger of 'reach' and the distance of 'offset' from zero.
+ */
+size_t bf_program_reach_widen(size_t reach, long offset)
+{
+    return (size_t)labs(offset) > reach ? (size_t)labs(offset) : reach;
+}
+
+void bf_program_access(const struct bf_instruction *instr, long *delta, long *first, long *second)
+{
+    struct bf_poly poly;
+
+    *delta = 0;
+    *first = *second = (int16_t)instr->shift;
+
+    switch (instr->opcode) {
+    case BF_INS_INC_P:
+        *delta = 1;
+        break;
+    case BF_INS_DEC_P:
+        *delta = -1;
+        break;
+    case BF_INS_ADD_P:
+        *delta = instr->argument;
+        break;
+    case BF_INS_SUB_P:
+        *delta = -(long)instr->argument;
+        break;
+    case BF_INS_COPY:
+        *second += (int16_t)instr->argument;
+        break;
+    case BF_INS_MUL:
+        *second += (int16_t)instr->offset;
+        break;
+    case BF_INS_DIVMOD:
+    case BF_INS_PRINT_DEC:
+        *second += bf_program_idiom(instr->opcode)->width - 1;
+        break;
+    case BF_INS_POLY:
+        bf_program_poly(instr, &poly);
+        *first = poly.counter < poly.target ? poly.counter : poly.target;
+        *first = poly.source < *first ? poly.source : *first;
+        *second = poly.counter > poly.target ? poly.counter : poly.target;
+        *second = poly.source > *second ? poly.source : *second;
+        break;
+    case BF_INS_CLEAR_RANGE:
+        *second += (long)instr->argument - 1;
+        break;
+    case BF_INS_MOVE_BLOCK:
+        // Where the pointer ends up isn't known, see 'bf_program_bound'.
+        *second -= (int16_t)instr->argument;
+        break;
+    default:
+        break;
+    }
+}
+
+void bf_program_poly(const struct bf_instruction *instr, struct bf_poly *poly)
+{
+    poly->factor = instr->argument;
+    poly->degree = instr->argument >> 8;
+    poly->counter = (int16_t)instr->shift;
+    poly->target = poly->counter + (int16_t)instr->offset;
+    poly->source = poly->counter + (int16_t)(instr->offset >> 16);
+}
+
+/**
+ * Returns true for instructions that may skip ahead to their argument, which
+ * are BRANCH_Z, the idioms and FILTER.
+ */
+bool bf_program_branches_forward(const struct bf_instruction *instr)
+{
+    switch (instr->opcode) {
+    case BF_INS_BRANCH_Z:
+    case BF_INS_DIVMOD:
+    case BF_INS_PRINT_DEC:
+    case BF_INS_FILTER:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Measures the reach of a program from the pointer at backwards jumps, see
+ * 'bf_program_reach'. Backwards jumps of balanced loops are only counted if
+ * 'balanced' is set.
+ */
+size_t bf_program_reach_edges(const struct bf_program *program, bool balanced)
+{
+    const struct bf_instruction *instr;
+    long *low; // Range of pointer offsets at every instruction.
+    long *high;
+    long delta; // Movement of pointer moves, zero for other instructions.
+    long first; // Offsets of the cells the instruction accesses.
+    long second;
+    size_t reach = 0;
+
+    low = malloc(sizeof(long) * (program->size + 1) * 2);
+    if (!low) {
+        return BF_PROGRAM_REACH_UNKNOWN;
+    }
+    high = low + program->size + 1;
+    for (size_t i = 0; i <= program->size; i++) {
+        low[i] = LONG_MAX;
+        high[i] = LONG_MIN;
+    }
+
+    // Offsets are relative to the pointer that was last recorded, which the
+    // vm does at the start of the program and whenever it jumps backwards.
+    bf_program_reach_merge(low, high, 0, 0, 0);
+    for (size_t i = 0; i < program->size; i++) {
+        instr = &program->ir[i];
+        if ((instr->opcode == BF_INS_BRANCH_NZ || instr->opcode == BF_INS_JMP)
+            && (balanced || !bf_utils_check_flag(instr->flags, BF_INS_FLAG_BALANCED))) {
+            bf_program_reach_merge(low, high, instr->argument, 0, 0);
+        }
+    }
+
+    // Every other edge goes forward, so a single pass sees all of the ranges
+    // flowing into an instruction before it gets to the instruction itself.
+    for (size_t i = 0; i < program->size; i++) {
+        instr = &program->ir[i];
+        if (low[i] > high[i]) {
+            continue; // Unreachable.
+        }
+
+        bf_program_access(instr, &delta, &first, &second);
+        if (bf_program_branches_forward(instr)) {
+            bf_program_reach_merge(low, high, instr->argument, low[i], high[i]);
+        }
+
+        reach = bf_program_reach_widen(reach, low[i] + first);
+        reach = bf_program_reach_widen(reach, high[i] + first);
+        reach = bf_program_reach_widen(reach, low[i] + second);
+        reach = bf_program_reach_widen(reach, high[i] + second);
+
+        if (instr->opcode == BF_INS_MOVE_BLOCK) {
+            // The vm records where the pointer ends up like it does after
+            // the backwards jumps of the loop it replaces.
+            bf_program_reach_merge(low, high, i + 1, 0, 0);
+        } else if (instr->opcode != BF_INS_JMP && instr->opcode != BF_INS_HALT) {
+            bf_program_reach_merge(low, high, i + 1, low[i] + delta, high[i] + delta);
+        }
+    }
+
+    free(low);
+
+    return reach;
+}
+
+size_t bf_program_reach(const struct bf_program *program)
+{
+    return bf_program_reach_edges(program, true);
+}
+
+size_t bf_program_drift(const struct bf_program *program)
+{
+    // Balanced loops end where they started, so their jumps are no different
+    // from carrying on after the loop.
+    return bf_program_reach_edges(program, false);
+}
+
+/**
+ * Returns true if every cell from 'low' up to 'high' lies inside of memory.
+ */
+bool bf_program_bounds_inside(long low, long high)
+{
+    return low >= 0 && high < BF_MEMORY_SIZE;
+}
+
+size_t bf_program_bound(struct bf_program *program)
+{
+    struct bf_instruction *instr;
+    long *low; // Range of absolute pointer positions at every instruction.
+    long *high;
+    long delta;
+    long first;
+    long second;
+    long from; // Range of pointer positions after the instruction.
+    long to;
+    size_t bounded = 0;
+
+    for (size_t i = 0; i < program->size; i++) {
+        program->ir[i].flags &= ~BF_INS_FLAG_BOUNDED;
+    }
+
+    low = malloc(sizeof(long) * (program->size + 1) * 2);
+    if (!low) {
+        return 0; // Nothing is proven, so everything stays checked.
+    }
+    high = low + program->size + 1;
+    for (size_t i = 0; i <= program->size; i++) {
+        low[i] = LONG_MAX;
+        high[i] = LONG_MIN;
+    }
+
+    // Balanced loops come back to where they started, so their backwards
+    // jumps don't add anything to the range at the top of the loop. After any
+    // other loop the pointer could be anywhere in memory.
+    bf_program_reach_merge(low, high, 0, 0, 0);
+    for (size_t i = 0; i < program->size; i++) {
+        instr = &program->ir[i];
+        if ((instr->opcode == BF_INS_BRANCH_NZ || instr->opcode == BF_INS_JMP)
+            && !bf_utils_check_flag(instr->flags, BF_INS_FLAG_BALANCED)) {
+            bf_program_reach_merge(low, high, instr->argument, 0, BF_MEMORY_SIZE - 1);
+        }
+    }
+
+    for (size_t i = 0; i < program->size; i++) {
+        instr = &program->ir[i];
+        if (low[i] > high[i]) {
+            continue; // Unreachable.
+        }
+
+        bf_program_access(instr, &delta, &first, &second);
+        if (bf_program_branches_forward(instr)) {
+            bf_program_reach_merge(low, high, instr->argument, low[i], high[i]);
+        }
+
+        from = low[i] + delta;
+        to = high[i] + delta;
+
+        if (instr->opcode == BF_INS_MOVE_BLOCK) {
+            // Runs as far as the block goes, like the loop it replaces.
+            from = 0;
+            to = BF_MEMORY_SIZE - 1;
+        } else if (bf_program_bounds_inside(low[i] + first, high[i] + first)
+            && bf_program_bounds_inside(low[i] + second, high[i] + second)
+            && bf_program_bounds_inside(from, to)) {
+            instr->flags |= BF_INS_FLAG_BOUNDED;
+            bounded++;
+        } else if (delta != 0) {
+            // The move may wrap around memory, after which the pointer could
+            // be anywhere.
+            from = 0;
+            to = BF_MEMORY_SIZE - 1;
+        }
+
+        if (instr->opcode != BF_INS_JMP && instr->opcode != BF_INS_HALT) {
+            bf_program_reach_merge(low, high, i + 1, from, to);
+        }
+    }
+
+    free(low);
+
+    return bounded;
+}
+
 /**
- * Unconditionally increases the capacity of contiguous memory holding the
- * bytecode by INSTRUCTION_ALLOC_COUNT * sizeof(struct bf_instruction) bytes.
+ * Unconditionally doubles the capacity of contiguous memory holding the IR, so
+ * appending stays linear for programs that are megabytes in size.
  */
 bool bf_program_grow(struct bf_program *program)
 {
     struct bf_instruction *resized_ir;
     size_t new_capacity;
 
-    new_capacity = program->capacity + INSTRUCTION_ALLOC_COUNT;
+    new_capacity = program->capacity * 2;
 
-    // Prevent the capacity from going over 65536 bytes in size. This limitation
-    // is imposed so branch instructions can use smaller 16-bit addresses. Most
-    // brainfuck programs, including stress tests such as mandlebrot.b and
-    // hanoi.b, fit in this space within a great margin.
+    // Prevent the capacity from going over BF_MAX_PROGRAM_SIZE instructions.
+    // Branches in the bytecode use 32-bit targets, and this keeps even the
+    // largest opcodes well inside of that range.
     if (new_capacity > BF_MAX_PROGRAM_SIZE) {
         if (program->capacity < BF_MAX_PROGRAM_SIZE) {
             new_capacity = BF_MAX_PROGRAM_SIZE;
@@ -134,6 +412,152 @@ bool bf_program_substitute(struct bf_program *program, const struct bf_instructi
     return true;
 }
 
+bool bf_program_compact(struct bf_program *program)
+{
+    size_t *addresses; // New address of every instruction, indexed by old.
+    size_t size = 0;
+
+    addresses = malloc(sizeof(size_t) * (program->size + 1));
+    if (!addresses) {
+        return false;
+    }
+
+    for (size_t i = 0; i < program->size; i++) {
+        addresses[i] = size;
+        if (program->ir[i].opcode != BF_INS_NOP) {
+            program->ir[size++] = program->ir[i];
+        }
+    }
+    addresses[program->size] = size;
+
+    // Branches point at the instruction after their matching brace. If that
+    // was a NOP, the address maps to the next instruction that survived.
+    for (size_t i = 0; i < size; i++) {
+        if (bf_program_has_address(&program->ir[i])) {
+            program->ir[i].argument = addresses[program->ir[i].argument];
+        }
+    }
+
+    program->size = size;
+    free(addresses);
+
+    return true;
+}
+
+bool bf_program_insert(struct bf_program *program, const size_t *positions, const struct bf_instruction *ir, size_t count)
+{
+    size_t *addresses; // New address of every instruction, indexed by old.
+    size_t k = 0;
+
+    while (program->size + count > program->capacity) {
+        if (!bf_program_grow(program)) {
+            return false;
+        }
+    }
+
+    addresses = malloc(sizeof(size_t) * (program->size + 1));
+    if (!addresses) {
+        return false;
+    }
+
+    // Branches to a position go to the instruction inserted there.
+    for (size_t i = 0; i <= program->size; i++) {
+        while (k < count && positions[k] < i) {
+            k++;
+        }
+        addresses[i] = i + k;
+    }
+
+    // Moves everything from the back so nothing is overwritten before it has
+    // been moved.
+    k = count;
+    while (k > 0 && positions[k - 1] == program->size) {
+        k--;
+        program->ir[program->size + k] = ir[k];
+    }
+    for (size_t i = program->size; i-- > 0;) {
+        program->ir[i + k] = program->ir[i];
+        while (k > 0 && positions[k - 1] == i) {
+            k--;
+            program->ir[i + k] = ir[k];
+        }
+    }
+    program->size += count;
+
+    for (size_t i = 0; i < program->size; i++) {
+        if (bf_program_has_address(&program->ir[i])) {
+            program->ir[i].argument = addresses[program->ir[i].argument];
+        }
+    }
+    free(addresses);
+
+    return true;
+}
+
+bool bf_program_add_string(struct bf_program *program, const uint8_t *string, size_t size, uint32_t *start)
+{
+    uint8_t *resized;
+
+    // Strings are addressed by 32 bit offsets in the bytecode.
+    if (program->strings_size + size > UINT32_MAX) {
+        return false;
+    }
+
+    resized = realloc(program->strings, program->strings_size + size);
+    if (!resized) {
+        return false;
+    }
+    memcpy(&resized[program->strings_size], string, size);
+
+    program->strings = resized;
+    *start = program->strings_size;
+    program->strings_size += size;
+
+    return true;
+}
+
+bool bf_program_add_filter(struct bf_program *program, const struct bf_filter *filter, uint32_t *index)
+{
+    struct bf_filter *resized;
+
+    resized = realloc(program->filters, sizeof(struct bf_filter) * (program->filters_size + 1));
+    if (!resized) {
+        return false;
+    }
+    resized[program->filters_size] = *filter;
+
+    program->filters = resized;
+    *index = program->filters_size++;
+
+    return true;
+}
+
+bool bf_program_has_address(const struct bf_instruction *instr)
+{
+    switch (instr->opcode) {
+    case BF_INS_BRANCH_Z:
+    case BF_INS_BRANCH_NZ:
+    case BF_INS_JMP:
+    case BF_INS_DIVMOD:
+    case BF_INS_PRINT_DEC:
+    case BF_INS_FILTER:
+        return true;
+    default:
+        return false;
+    }
+}
+
+const struct bf_idiom *bf_program_idiom(enum bf_opcode opcode)
+{
+    for (const struct bf_idiom *idiom = bf_idioms; idiom->name; idiom++) {
+        if (idiom->opcode == opcode) {
+            return idiom;
+        }
+    }
+
+    return NULL;
+}
+
 int bf_program_match_sequence(struct bf_program *program, const struct bf_pattern_rule *rules, int pos, size_t size)
 {
     int real_iters = 0;
@@ -175,13 +599,44 @@ int bf_program_match_sequence(struct bf_program *program, const struct bf_patter
     }
 }
 
+/**
+ * Prints the string of an OUTS instruction, escaping anything that isn't
+ * printable.
+ */
+void bf_program_dump_string(const struct bf_program *program, const struct bf_instruction *instr)
+{
+    uint8_t byte;
+
+    printf(" \"");
+    for (size_t i = 0; i < instr->offset; i++) {
+        byte = program->strings[instr->argument + i];
+        if (byte == '"' || byte == '\\') {
+            printf("\\%c", byte);
+        } else if (byte == '\n') {
+            printf("\\n");
+        } else if (byte >= 0x20 && byte < 0x7f) {
+            putchar(byte);
+        } else {
+            printf("\\x%02x", byte);
+        }
+    }
+    printf("\"");
+}
+
 void bf_program_dump(const struct bf_program *program)
 {
     struct bf_instruction *instr;
 
     for (int i = 0; i < program->size; i++) {
         instr = &program->ir[i];
-        printf("(0x%08x) %-9s -> 0x%08x (%d), Offset: %d\n", i, bf_program_map_ins_name(instr->opcode), instr->argument, instr->argument, instr->offset);
+        printf("(0x%08x) %-9s -> 0x%08x (%d), Offset: %d, Shift: %d%s%s%s", i, bf_program_map_ins_name(instr->opcode), instr->argument, instr->argument, instr->offset, (int16_t)instr->shift,
+            bf_utils_check_flag(instr->flags, BF_INS_FLAG_BALANCED) ? " (balanced)" : "",
+            bf_utils_check_flag(instr->flags, BF_INS_FLAG_COUNTED) ? " (counted)" : "",
+            bf_utils_check_flag(instr->flags, BF_INS_FLAG_BOUNDED) ? "" : " (checked)");
+        if (instr->opcode == BF_INS_OUTS) {
+            bf_program_dump_string(program, instr);
+        }
+        printf("\n");
     }
 }
 
@@ -227,6 +682,20 @@ const char *bf_program_map_ins_name(enum bf_opcode opcode)
         return "COPY";
     case BF_INS_MUL:
         return "MUL";
+    case BF_INS_DIVMOD:
+        return "DIVMOD";
+    case BF_INS_PRINT_DEC:
+        return "PRINT_DEC";
+    case BF_INS_FILTER:
+        return "FILTER";
+    case BF_INS_OUTS:
+        return "OUTS";
+    case BF_INS_POLY:
+        return "POLY";
+    case BF_INS_CLEAR_RANGE:
+        return "CLEAR_RANGE";
+    case BF_INS_MOVE_BLOCK:
+        return "MOVE_BLOCK";
     default:
         return "?";
     }
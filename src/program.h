@@ -21,20 +21,41 @@
 #ifndef BF_PROGRAM_H
 #define BF_PROGRAM_H
 
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include "instruction.h"
 #include "patterns.h"
 
+struct bf_compile_stats;
+struct bf_filter;
+
 /**
  * A dynamic array of compiled program instructions that can be given to the
  * brainfuck virtual machine for execution.
+ *
+ * The virtual machine doesn't execute the IR directly but the packed bytecode
+ * in 'code', which is produced by 'bf_program_lower' once the IR is optimized.
+ *
+ * Programs are reference counted so that a compiled program can be shared by
+ * several virtual machines, possibly on different threads. Programs must not
+ * be modified once they're shared.
  */
 struct bf_program {
     size_t size;
     size_t capacity;
     struct bf_instruction *ir;
+    size_t code_size;
+    uint8_t *code;
+    size_t reach; // See 'bf_program_reach', set by 'bf_program_lower'.
+    uint8_t *strings; // Bytes written by OUTS instructions.
+    size_t strings_size;
+    struct bf_filter *filters; // Tables of FILTER instructions.
+    size_t filters_size;
+    struct bf_compile_stats *stats; // Only set while 'bf_compile_measured' runs.
+    atomic_uint refcount;
 };
 
 /**
@@ -44,10 +65,17 @@ struct bf_program {
 struct bf_program *bf_program_create();
 
 /**
- * Cleans up memory used to store the program code.
+ * Releases a reference to the program and cleans up memory used to store the
+ * program code once the last reference is gone.
  */
 void bf_program_destroy(struct bf_program *program);
 
+/**
+ * Takes another reference to the program which has to be released with
+ * 'bf_program_destroy'. Returns the program for convenience.
+ */
+struct bf_program *bf_program_retain(struct bf_program *program);
+
 /**
  * Allocates more space for the program if needed.
  */
@@ -64,6 +92,107 @@ bool bf_program_append(struct bf_program *program, const struct bf_instruction i
  */
 bool bf_program_substitute(struct bf_program *program, const struct bf_instruction *ir, int pos, size_t size);
 
+/**
+ * Removes NOP instructions from the program and corrects the addresses of
+ * branches accordingly. Optimization passes replace instructions with NOPs
+ * rather than moving the IR around, so this should be run afterwards.
+ */
+bool bf_program_compact(struct bf_program *program);
+
+/**
+ * Inserts 'count' instructions from 'ir' into the program, each one right in
+ * front of the instruction at the matching index in 'positions', which has to
+ * be in ascending order. Branch addresses are corrected, and branches to a
+ * position go to the instruction inserted there. Returns false if memory
+ * couldn't be allocated.
+ */
+bool bf_program_insert(struct bf_program *program, const size_t *positions, const struct bf_instruction *ir, size_t count);
+
+/**
+ * Appends 'size' bytes to the string table of the program and returns where
+ * they start in 'start'. Returns false if memory couldn't be allocated.
+ */
+bool bf_program_add_string(struct bf_program *program, const uint8_t *string, size_t size, uint32_t *start);
+
+/**
+ * Appends a copy of 'filter' to the filter tables of the program and returns
+ * its index in 'index'. Returns false if memory couldn't be allocated.
+ */
+bool bf_program_add_filter(struct bf_program *program, const struct bf_filter *filter, uint32_t *index);
+
+/**
+ * Returns true if the argument of an instruction is the address of another
+ * instruction, which has to be corrected whenever the IR is moved around.
+ */
+bool bf_program_has_address(const struct bf_instruction *instr);
+
+/**
+ * Returns how far an instruction moves the pointer in 'delta', and the offsets
+ * from the pointer of the (up to two) cells it accesses in 'first' and
+ * 'second'. POLY accesses three cells, for which the lowest and highest offset
+ * are returned, and CLEAR_RANGE returns the ends of its range. MOVE_BLOCK moves
+ * the pointer as far as its block goes, which isn't included in 'delta'.
+ */
+void bf_program_access(const struct bf_instruction *instr, long *delta, long *first, long *second);
+
+/**
+ * The parts of a POLY instruction, which adds 'factor' times the binomial
+ * coefficient C(n, 'degree') times the source cell to the target cell, where n
+ * is the value of the counter cell. Offsets are from the pointer like the ones
+ * of 'bf_program_access'. If 'source' is the same as 'counter' the product
+ * isn't multiplied by any cell.
+ */
+struct bf_poly {
+    uint8_t factor;
+    uint8_t degree;
+    long counter;
+    long target;
+    long source;
+};
+
+/**
+ * Splits a POLY instruction into its parts, see 'bf_linear_solve'.
+ */
+void bf_program_poly(const struct bf_instruction *instr, struct bf_poly *poly);
+
+/**
+ * Returns the entry in 'bf_idioms' that's replaced by an opcode, or NULL.
+ */
+const struct bf_idiom *bf_program_idiom(enum bf_opcode opcode);
+
+/**
+ * Returned by 'bf_program_reach' if the reach couldn't be determined. It's
+ * large enough to cover the whole memory of a vm.
+ */
+#define BF_PROGRAM_REACH_UNKNOWN 65536
+
+/**
+ * Returns how far from the pointer the program can access memory before the
+ * next time it jumps backwards, measured from the pointer at the last
+ * backwards jump (or the start of the program). Virtual machines only record
+ * the pointer when jumping backwards, so this is how much they widen the
+ * recorded range by to know which memory may have been written.
+ */
+size_t bf_program_reach(const struct bf_program *program);
+
+/**
+ * Like 'bf_program_reach', but measured from the pointer at the last backwards
+ * jump of a loop that isn't balanced.
+ */
+size_t bf_program_drift(const struct bf_program *program);
+
+/**
+ * Works out which instructions are guaranteed to keep the pointer and the
+ * cells they access inside of memory, starting from the first cell. Those get
+ * BF_INS_FLAG_BOUNDED and can be executed without wrapping the pointer. Any
+ * other pointer move wraps around the ends of memory.
+ *
+ * The analysis tracks the range of absolute pointer positions through the
+ * program. It's precise up to the first loop that isn't balanced, after which
+ * the pointer could be anywhere. Returns the number of bounded instructions.
+ */
+size_t bf_program_bound(struct bf_program *program);
+
 /**
  * Compares a sequence of instruction opcodes at the desired position to a
  * referenced list of instructions. This function is primarily used during
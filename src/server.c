@@ -0,0 +1,480 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "compiler.h"
+#include "interpreter.h"
+#include "pool.h"
+#include "server.h"
+
+/**
+ * State shared by every worker thread.
+ */
+struct bf_server {
+    int listen_fd;
+    uint32_t vm_flags;
+    struct bf_cache *cache;
+    struct bf_vm_pool *pool;
+};
+
+/**
+ * A job being served by a worker. Every worker allocates one of these and
+ * reuses it for each connection it accepts.
+ */
+struct bf_job {
+    int fd;
+    struct bf_job_limits limits;
+    struct bf_job_result result;
+    uint64_t output_total;
+    uint8_t input[BF_FRAME_MAX_SIZE];
+    uint8_t output[BF_FRAME_MAX_SIZE];
+};
+
+bool bf_server_read_all(int fd, void *buf, size_t size)
+{
+    uint8_t *p = buf;
+    ssize_t n;
+
+    while (size > 0) {
+        n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+bool bf_server_write_all(int fd, const void *buf, size_t size)
+{
+    const uint8_t *p = buf;
+    ssize_t n;
+
+    while (size > 0) {
+        // MSG_NOSIGNAL turns a client that went away into EPIPE rather than
+        // SIGPIPE, which would take the whole server down.
+        n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+bool bf_server_write_frame(int fd, enum bf_frame_type type, const void *payload, uint32_t size)
+{
+    struct bf_frame_header header = {
+        .type = type,
+        .size = size,
+    };
+
+    return bf_server_write_all(fd, &header, sizeof(header))
+        && bf_server_write_all(fd, payload, size);
+}
+
+const char *bf_server_status_message(enum bf_job_status status)
+{
+    switch (status) {
+    case BF_JOB_SUCCESS:
+        return "Success.";
+    case BF_JOB_ERROR:
+        return "The server was unable to run the job.";
+    case BF_JOB_COMPILE_ERROR:
+        return "Unable to compile source code.";
+    case BF_JOB_UNKNOWN_HASH:
+        return "The script isn't cached by the server.";
+    case BF_JOB_STEP_LIMIT:
+        return "The step limit was exceeded.";
+    case BF_JOB_OUTPUT_LIMIT:
+        return "The output limit was exceeded.";
+    default:
+        return "Unknown status.";
+    }
+}
+
+int bf_server_connect(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Compiles a script sent by the client, or takes it from the cache if the
+ * same source code was compiled before.
+ */
+struct bf_program *bf_server_compile_script(struct bf_server *server, struct bf_job *job, uint32_t size)
+{
+    struct bf_program *program;
+    uint64_t hash;
+    char *src;
+
+    if (size > BF_FRAME_MAX_SCRIPT_SIZE) {
+        goto error1;
+    }
+    src = malloc(size + 1);
+    if (!src) {
+        goto error1;
+    }
+    if (!bf_server_read_all(job->fd, src, size)) {
+        goto error2;
+    }
+    src[size] = '\0';
+
+    hash = bf_cache_hash(src, size);
+    program = bf_cache_get(server->cache, hash, src, size);
+    if (program) {
+        job->result.cached = 1;
+    } else {
+        program = bf_compile(src);
+        if (program) {
+            program = bf_cache_put(server->cache, hash, src, size, program);
+        } else {
+            job->result.status = BF_JOB_COMPILE_ERROR;
+        }
+    }
+
+    free(src);
+    return program;
+
+error2:
+    free(src);
+error1:
+    job->result.status = BF_JOB_ERROR;
+    return NULL;
+}
+
+/**
+ * Reads the request up to and including the script or its hash and returns
+ * the program to run. Returns NULL with the job status set on failure.
+ */
+struct bf_program *bf_server_load_program(struct bf_server *server, struct bf_job *job)
+{
+    struct bf_frame_header header;
+    struct bf_program *program;
+    uint64_t hash;
+
+    if (!bf_server_read_all(job->fd, &header, sizeof(header))) {
+        goto error1;
+    }
+    if (header.type == BF_FRAME_LIMITS) {
+        if (header.size != sizeof(job->limits)
+            || !bf_server_read_all(job->fd, &job->limits, sizeof(job->limits))
+            || !bf_server_read_all(job->fd, &header, sizeof(header))) {
+            goto error1;
+        }
+    }
+
+    if (header.type == BF_FRAME_SCRIPT) {
+        return bf_server_compile_script(server, job, header.size);
+    } else if (header.type == BF_FRAME_HASH) {
+        if (header.size != sizeof(hash) || !bf_server_read_all(job->fd, &hash, sizeof(hash))) {
+            goto error1;
+        }
+        program = bf_cache_get(server->cache, hash, NULL, 0);
+        if (!program) {
+            job->result.status = BF_JOB_UNKNOWN_HASH;
+            return NULL;
+        }
+        job->result.cached = 1;
+        return program;
+    }
+
+error1:
+    job->result.status = BF_JOB_ERROR;
+    return NULL;
+}
+
+/**
+ * Waits for the next input frame from the client and hands it to the vm.
+ */
+bool bf_server_read_input(struct bf_job *job, struct bf_vm *vm)
+{
+    struct bf_frame_header header;
+
+    if (!bf_server_read_all(job->fd, &header, sizeof(header))
+        || header.type != BF_FRAME_INPUT || header.size > sizeof(job->input)) {
+        return false;
+    }
+    if (header.size == 0) {
+        bf_vm_close_input(vm);
+        return true;
+    }
+    if (!bf_server_read_all(job->fd, job->input, header.size)) {
+        return false;
+    }
+    bf_vm_feed_input(vm, job->input, header.size);
+
+    return true;
+}
+
+/**
+ * Sends output buffered by the vm to the client. Returns false if the job
+ * can't continue, either because the output limit was hit or the client went
+ * away.
+ */
+bool bf_server_flush(struct bf_job *job, struct bf_vm *vm)
+{
+    uint64_t size = vm->output_size;
+    bool limited = false;
+
+    if (job->limits.max_output && job->output_total + size > job->limits.max_output) {
+        size = job->limits.max_output - job->output_total;
+        limited = true;
+    }
+    if (size > 0 && !bf_server_write_frame(job->fd, BF_FRAME_OUTPUT, job->output, size)) {
+        job->result.status = BF_JOB_ERROR;
+        return false;
+    }
+    job->output_total += size;
+    bf_vm_set_output(vm, job->output, sizeof(job->output));
+
+    if (limited) {
+        job->result.status = BF_JOB_OUTPUT_LIMIT;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Runs a program to completion, in slices of BF_SERVER_SLICE instructions so
+ * output is streamed back and the step limit can be enforced.
+ */
+void bf_server_execute(struct bf_server *server, struct bf_job *job, struct bf_program *program)
+{
+    struct bf_result result;
+    struct bf_vm *vm;
+    uint64_t budget;
+
+    vm = bf_vm_pool_acquire(server->pool, program, server->vm_flags | BF_INPUT_BUFFER | BF_OUTPUT_BUFFER);
+    if (!vm) {
+        job->result.status = BF_JOB_ERROR;
+        return;
+    }
+    bf_vm_set_output(vm, job->output, sizeof(job->output));
+
+    for (;;) {
+        budget = BF_SERVER_SLICE;
+        if (job->limits.max_steps) {
+            if (vm->dispatches >= job->limits.max_steps) {
+                job->result.status = BF_JOB_STEP_LIMIT;
+                break;
+            }
+            if (job->limits.max_steps - vm->dispatches < budget) {
+                budget = job->limits.max_steps - vm->dispatches;
+            }
+        }
+
+        result = bf_vm_step(vm, budget);
+        if (result.code == BF_RESULT_SUCCESS) {
+            if (bf_server_flush(job, vm)) {
+                job->result.status = BF_JOB_SUCCESS;
+            }
+            break;
+        } else if (result.code == BF_RESULT_YIELD || result.code == BF_RESULT_NEED_DRAIN) {
+            if (!bf_server_flush(job, vm)) {
+                break;
+            }
+        } else if (result.code == BF_RESULT_NEED_INPUT) {
+            // Interactive programs need to see their prompt before the client
+            // can answer it.
+            if (!bf_server_flush(job, vm)) {
+                break;
+            }
+            if (!bf_server_read_input(job, vm)) {
+                job->result.status = BF_JOB_ERROR;
+                break;
+            }
+        } else {
+            job->result.status = BF_JOB_ERROR;
+            break;
+        }
+    }
+
+    job->result.steps = vm->dispatches;
+    bf_vm_pool_release(server->pool, vm);
+}
+
+/**
+ * Serves the single job sent over a freshly accepted connection.
+ */
+void bf_server_handle(struct bf_server *server, struct bf_job *job, int fd)
+{
+    struct bf_program *program;
+
+    job->fd = fd;
+    job->limits = (struct bf_job_limits){ 0 };
+    job->result = (struct bf_job_result){ 0 };
+    job->output_total = 0;
+
+    program = bf_server_load_program(server, job);
+    if (program) {
+        bf_server_execute(server, job, program); // The vm takes over the reference.
+    }
+
+    bf_server_write_frame(fd, BF_FRAME_STATUS, &job->result, sizeof(job->result));
+}
+
+void *bf_server_worker(void *arg)
+{
+    struct bf_server *server = arg;
+    struct timeval timeout = { .tv_sec = BF_SERVER_TIMEOUT };
+    struct bf_job *job;
+    int fd;
+
+    job = malloc(sizeof(struct bf_job));
+    if (!job) {
+        return NULL;
+    }
+
+    for (;;) {
+        fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("accept");
+            break;
+        }
+
+        // Reads and writes that time out fail like a closed connection does.
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0
+            || setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0) {
+            close(fd);
+            continue;
+        }
+
+        bf_server_handle(server, job, fd);
+        close(fd);
+    }
+
+    free(job);
+    return NULL;
+}
+
+bool bf_server_run(const char *path, int workers, size_t cache_size, uint32_t vm_flags)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct bf_server server;
+    pthread_t *threads;
+    int started = 0;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path '%s' is too long.\n", path);
+        goto error1;
+    }
+    strcpy(addr.sun_path, path);
+
+    threads = calloc(workers, sizeof(pthread_t));
+    if (!threads) {
+        goto error1;
+    }
+    server.vm_flags = vm_flags;
+    server.cache = bf_cache_create(cache_size);
+    if (!server.cache) {
+        goto error2;
+    }
+    server.pool = bf_vm_pool_create(workers);
+    if (!server.pool) {
+        goto error3;
+    }
+
+    server.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server.listen_fd < 0) {
+        perror("socket");
+        goto error4;
+    }
+    unlink(path);
+    if (bind(server.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || listen(server.listen_fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Unable to listen on '%s': %s\n", path, strerror(errno));
+        goto error5;
+    }
+
+    for (started = 0; started < workers; started++) {
+        if (pthread_create(&threads[started], NULL, bf_server_worker, &server) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        fprintf(stderr, "Unable to start any workers.\n");
+        goto error5;
+    }
+    fprintf(stderr, "Listening on '%s' with %d workers.\n", path, started);
+
+    // Workers only return if accepting connections fails.
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    close(server.listen_fd);
+    bf_vm_pool_destroy(server.pool);
+    bf_cache_destroy(server.cache);
+    free(threads);
+    return true;
+
+error5:
+    close(server.listen_fd);
+error4:
+    bf_vm_pool_destroy(server.pool);
+error3:
+    bf_cache_destroy(server.cache);
+error2:
+    free(threads);
+error1:
+    return false;
+}
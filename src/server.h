@@ -0,0 +1,144 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef BF_SERVER_H
+#define BF_SERVER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * === README ===
+ *
+ * 'mlbf --serve' runs jobs sent over a UNIX domain socket so that process
+ * startup and compilation aren't paid for every job. Compiled programs are
+ * kept in an LRU cache keyed by the hash of their source code.
+ *
+ * A connection carries a single job. Both directions consist of frames made
+ * of a 'struct bf_frame_header' followed by 'size' bytes of payload, in host
+ * byte order since both ends are on the same machine.
+ *
+ *   Client to server:
+ *     LIMITS   struct bf_job_limits (optional, must come first)
+ *     SCRIPT   brainfuck source code, or
+ *     HASH     u64 hash of source code that was sent before
+ *     INPUT    input bytes, an empty frame marks the end of input
+ *
+ *   Server to client:
+ *     OUTPUT   output bytes
+ *     STATUS   struct bf_job_result, the server closes the connection after
+ *
+ * Input is only read when the program asks for it, and output is sent
+ * whenever the buffer fills up, the program waits for input, or a time slice
+ * of BF_SERVER_SLICE instructions ends. A client has BF_SERVER_TIMEOUT seconds
+ * to send each part of a frame the server waits for.
+ */
+
+/** Largest payload of any frame other than SCRIPT. */
+#define BF_FRAME_MAX_SIZE 65536
+
+/** Largest accepted brainfuck source code. */
+#define BF_FRAME_MAX_SCRIPT_SIZE (16 * 1024 * 1024)
+
+/**
+ * Seconds a worker waits on a client that neither sends nor receives anything
+ * before the job fails with BF_JOB_ERROR. Without it a client that stalls
+ * would keep its worker busy for good.
+ */
+#define BF_SERVER_TIMEOUT 30
+
+/** Instructions executed between flushes of pending output. */
+#define BF_SERVER_SLICE (1 << 24)
+
+#define BF_SERVER_DEFAULT_WORKERS 4
+#define BF_SERVER_DEFAULT_CACHE_SIZE 256
+
+enum bf_frame_type {
+    BF_FRAME_LIMITS,
+    BF_FRAME_SCRIPT,
+    BF_FRAME_HASH,
+    BF_FRAME_INPUT,
+    BF_FRAME_OUTPUT,
+    BF_FRAME_STATUS,
+};
+
+enum bf_job_status {
+    BF_JOB_SUCCESS,
+    BF_JOB_ERROR, // Malformed request or internal error.
+    BF_JOB_COMPILE_ERROR,
+    BF_JOB_UNKNOWN_HASH, // Not cached, send the script instead.
+    BF_JOB_STEP_LIMIT,
+    BF_JOB_OUTPUT_LIMIT,
+};
+
+struct bf_frame_header {
+    uint32_t type;
+    uint32_t size;
+};
+
+/**
+ * Limits for a single job, zero means unlimited. Steps are counted in
+ * instructions like 'bf_vm_step' counts them, so a job may slightly overshoot.
+ */
+struct bf_job_limits {
+    uint64_t max_steps;
+    uint64_t max_output;
+};
+
+struct bf_job_result {
+    uint32_t status;
+    uint32_t cached; // Non-zero if the program came from the cache.
+    uint64_t steps;
+};
+
+/**
+ * Reads or writes exactly 'size' bytes, retrying on short transfers and
+ * interrupts. Returns false on errors and if the connection was closed.
+ */
+bool bf_server_read_all(int fd, void *buf, size_t size);
+bool bf_server_write_all(int fd, const void *buf, size_t size);
+
+/**
+ * Writes a complete frame to a socket.
+ */
+bool bf_server_write_frame(int fd, enum bf_frame_type type, const void *payload, uint32_t size);
+
+/**
+ * Returns a human-readable description of a job status.
+ */
+const char *bf_server_status_message(enum bf_job_status status);
+
+/**
+ * Opens a connection to a server listening at 'path'. Returns the socket or
+ * -1 on failure.
+ */
+int bf_server_connect(const char *path);
+
+/**
+ * Listens on 'path' and serves jobs with 'workers' threads until the process
+ * is terminated. Jobs run on vms created with 'vm_flags' in addition to the
+ * flags the server needs (e.g. BF_SPARSE_MEMORY). A stale socket file left at
+ * 'path' is replaced. Returns false if the server couldn't be started.
+ */
+bool bf_server_run(const char *path, int workers, size_t cache_size, uint32_t vm_flags);
+
+#endif
@@ -0,0 +1,175 @@
+// Copyright (c) 2017 Walter Kuppens
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Stencils for the JIT, see src/jit.h. This file isn't part of mlbf itself,
+// tools/stencils.py compiles it and turns it into stencils.inc.
+//
+// Every stencil has to end with a tail call, and may not reference anything
+// other than the holes below. Any other relocation fails the build. Only the
+// low 32 bits of a hole are patched, so signed holes have to be used either
+// as 64 bit values, which the compiler sign extends, or truncated.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "jit.h"
+
+extern char BF_HOLE_ARGUMENT[];
+extern char BF_HOLE_SHIFT[];
+extern char BF_HOLE_OFFSET[];
+extern size_t BF_HOLE_CONTINUE(uint8_t *memory, size_t pointer, struct bf_jit_context *context);
+extern size_t BF_HOLE_JUMP(uint8_t *memory, size_t pointer, struct bf_jit_context *context);
+
+#define ARGUMENT ((uint8_t)(uintptr_t)BF_HOLE_ARGUMENT)
+#define ARGUMENT32 ((uint32_t)(uintptr_t)BF_HOLE_ARGUMENT)
+#define SHIFT ((intptr_t)BF_HOLE_SHIFT)
+#define OFFSET ((intptr_t)BF_HOLE_OFFSET)
+#define OFFSET32 ((uint32_t)(uintptr_t)BF_HOLE_OFFSET)
+#define CONTINUE() return BF_HOLE_CONTINUE(memory, pointer, context)
+#define JUMP() return BF_HOLE_JUMP(memory, pointer, context)
+
+#define STENCIL(name) size_t bf_stencil_##name(uint8_t *memory, size_t pointer, struct bf_jit_context *context)
+
+// Cells proven to be inside of memory, and cells that have to wrap around it.
+#define CELL(offset) memory[pointer + (offset)]
+#define CELL_WRAP(offset) memory[(uint16_t)(pointer + (offset))]
+
+/**
+ * Defines the stencils of every instruction that accesses a cell, with 'cell'
+ * as the way to access it.
+ */
+#define CELL_STENCILS(suffix, cell)                      \
+    STENCIL(in##suffix)                                  \
+    {                                                    \
+        int value = context->get(context);               \
+        if (value != EOF) {                              \
+            cell(SHIFT) = value;                         \
+        }                                                \
+        CONTINUE();                                      \
+    }                                                    \
+    STENCIL(out##suffix)                                 \
+    {                                                    \
+        context->put(context, cell(SHIFT));              \
+        CONTINUE();                                      \
+    }                                                    \
+    STENCIL(inc##suffix)                                 \
+    {                                                    \
+        cell(SHIFT)++;                                   \
+        CONTINUE();                                      \
+    }                                                    \
+    STENCIL(dec##suffix)                                 \
+    {                                                    \
+        cell(SHIFT)--;                                   \
+        CONTINUE();                                      \
+    }                                                    \
+    STENCIL(add##suffix)                                 \
+    {                                                    \
+        cell(SHIFT) += ARGUMENT;                         \
+        CONTINUE();                                      \
+    }                                                    \
+    STENCIL(clear##suffix)                               \
+    {                                                    \
+        cell(SHIFT) = 0;                                 \
+        CONTINUE();                                      \
+    }                                                    \
+    STENCIL(copy##suffix)                                \
+    {                                                    \
+        cell(SHIFT + OFFSET) += cell(SHIFT);             \
+        CONTINUE();                                      \
+    }                                                    \
+    STENCIL(mul##suffix)                                 \
+    {                                                    \
+        cell(SHIFT + OFFSET) += ARGUMENT * cell(SHIFT);  \
+        CONTINUE();                                      \
+    }                                                    \
+    STENCIL(poly##suffix)                                \
+    {                                                    \
+        uint8_t count = cell(SHIFT);                     \
+        uint8_t degree = ARGUMENT32 >> 8;                \
+        int16_t target = OFFSET32;                       \
+        int16_t source = OFFSET32 >> 16;                 \
+        uint64_t value = degree <= count;                \
+        for (uint64_t i = 0; i < degree; i++) {          \
+            value = value * (count - i) / (i + 1);       \
+        }                                                \
+        if (source != 0) {                               \
+            value *= cell(SHIFT + source);               \
+        }                                                \
+        cell(SHIFT + target) += ARGUMENT * value;        \
+        CONTINUE();                                      \
+    }                                                    \
+    STENCIL(branch_z##suffix)                            \
+    {                                                    \
+        if (__builtin_expect(cell(SHIFT) == 0, 0)) {     \
+            JUMP();                                      \
+        }                                                \
+        CONTINUE();                                      \
+    }                                                    \
+    STENCIL(branch_nz##suffix)                           \
+    {                                                    \
+        if (__builtin_expect(cell(SHIFT) != 0, 1)) {     \
+            JUMP();                                      \
+        }                                                \
+        CONTINUE();                                      \
+    }
+
+CELL_STENCILS(, CELL)
+CELL_STENCILS(_wrap, CELL_WRAP)
+
+STENCIL(move)
+{
+    pointer += SHIFT;
+    CONTINUE();
+}
+
+STENCIL(move_wrap)
+{
+    pointer = (uint16_t)(pointer + SHIFT);
+    CONTINUE();
+}
+
+STENCIL(jump)
+{
+    JUMP();
+}
+
+STENCIL(halt)
+{
+    return pointer;
+}
+
+STENCIL(outs)
+{
+    context->write(context, ARGUMENT32, OFFSET32);
+    CONTINUE();
+}
+
+STENCIL(clear_range)
+{
+    context->clear(context, (uint16_t)(pointer + SHIFT), ARGUMENT32);
+    CONTINUE();
+}
+
+STENCIL(move_block)
+{
+    pointer = context->move(context, pointer, (int8_t)ARGUMENT);
+    CONTINUE();
+}
@@ -18,103 +18,616 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "interpreter.h"
 #include "program.h"
+#include "transpiler.h"
+#include "utils.h"
+
+/** Size of the buffers used by the generated program for input and output. */
+#define BF_TRANSPILE_BUFFER_SIZE 65536
+
+/**
+ * Declarations and buffered I/O shared by every generated file. Output is
+ * flushed before blocking on input so that prompts show up.
+ *
+ * Memory is mapped three times in a row over a static array, so the pointer
+ * can run up to the size of memory past either end and still address the
+ * right cell. Loops that move the pointer bring it back into the middle copy
+ * when they jump backwards, and so does 'move_block'. Keeping the array static
+ * lets the C compiler treat its address as a constant. Blocks of cells are
+ * cleared and moved without wrapping since the copies do that for them.
+ */
+static const char bf_transpile_header[] = "#define _GNU_SOURCE\n"
+                                          "\n"
+                                          "#include <errno.h>\n"
+                                          "#include <stdint.h>\n"
+                                          "#include <stdio.h>\n"
+                                          "#include <string.h>\n"
+                                          "#include <sys/mman.h>\n"
+                                          "#include <unistd.h>\n"
+                                          "\n"
+                                          "#define MEMORY_SIZE %d\n"
+                                          "#define BUFFER_SIZE %d\n"
+                                          "\n"
+                                          "#define memory (copies + MEMORY_SIZE)\n"
+                                          "\n"
+                                          "extern uint8_t copies[3 * MEMORY_SIZE];\n"
+                                          "extern uint8_t output[BUFFER_SIZE];\n"
+                                          "extern size_t output_size;\n"
+                                          "extern uint8_t input[BUFFER_SIZE];\n"
+                                          "extern size_t input_size;\n"
+                                          "extern size_t input_position;\n"
+                                          "extern const uint8_t strings[];\n"
+                                          "\n"
+                                          "void flush_output(void);\n"
+                                          "int fill_input(void);\n"
+                                          "\n"
+                                          "static inline void write_output(uint8_t value)\n"
+                                          "{\n"
+                                          "output[output_size++] = value;\n"
+                                          "if (output_size == BUFFER_SIZE) {\n"
+                                          "flush_output();\n"
+                                          "}\n"
+                                          "}\n"
+                                          "\n"
+                                          "static inline void write_string(const uint8_t *string, size_t size)\n"
+                                          "{\n"
+                                          "for (size_t i = 0; i < size; i++) {\n"
+                                          "write_output(string[i]);\n"
+                                          "}\n"
+                                          "}\n"
+                                          "\n"
+                                          "static inline uint8_t binomial(uint8_t n, uint8_t k)\n"
+                                          "{\n"
+                                          "uint64_t result = 1;\n"
+                                          "if (k > n) {\n"
+                                          "return 0;\n"
+                                          "}\n"
+                                          "for (uint64_t i = 0; i < k; i++) {\n"
+                                          "result = result * (n - i) / (i + 1);\n"
+                                          "}\n"
+                                          "return result;\n"
+                                          "}\n"
+                                          "\n"
+                                          "static inline void clear_cells(uint8_t *p, int shift, size_t count)\n"
+                                          "{\n"
+                                          "memset(memory + (uint16_t)(p - memory + shift), 0, count);\n"
+                                          "}\n"
+                                          "\n"
+                                          "static inline uint8_t *move_block(uint8_t *p, int direction)\n"
+                                          "{\n"
+                                          "long i = (uint16_t)(p - memory);\n"
+                                          "uint8_t *zero;\n"
+                                          "long length;\n"
+                                          "\n"
+                                          "if (direction > 0) {\n"
+                                          "zero = memchr(memory + i, 0, MEMORY_SIZE);\n"
+                                          "} else {\n"
+                                          "zero = memrchr(memory + i - MEMORY_SIZE + 1, 0, MEMORY_SIZE);\n"
+                                          "}\n"
+                                          "if (zero == NULL) {\n"
+                                          "while (memory[i] != 0) {\n"
+                                          "memory[(uint16_t)(i - direction)] += memory[i];\n"
+                                          "memory[i] = 0;\n"
+                                          "i = (uint16_t)(i + direction);\n"
+                                          "}\n"
+                                          "return memory + i;\n"
+                                          "}\n"
+                                          "length = direction > 0 ? zero - (memory + i) : (memory + i) - zero;\n"
+                                          "if (length > 0) {\n"
+                                          "memory[i - direction] += memory[i];\n"
+                                          "memmove(direction > 0 ? memory + i : zero + 2, direction > 0 ? memory + i + 1 : zero + 1, length - 1);\n"
+                                          "memory[i + direction * (length - 1)] = 0;\n"
+                                          "}\n"
+                                          "return memory + (uint16_t)(i + direction * length);\n"
+                                          "}\n"
+                                          "\n"
+                                          "static inline int read_input(void)\n"
+                                          "{\n"
+                                          "if (input_position == input_size && !fill_input()) {\n"
+                                          "return EOF;\n"
+                                          "}\n"
+                                          "return input[input_position++];\n"
+                                          "}\n"
+                                          "\n";
+
+/** Definitions of the runtime, only written to the first file. */
+static const char bf_transpile_runtime[] = "uint8_t copies[3 * MEMORY_SIZE] __attribute__((aligned(MEMORY_SIZE)));\n"
+                                           "uint8_t output[BUFFER_SIZE];\n"
+                                           "size_t output_size;\n"
+                                           "uint8_t input[BUFFER_SIZE];\n"
+                                           "size_t input_size;\n"
+                                           "size_t input_position;\n"
+                                           "\n"
+                                           "static int map_memory(void)\n"
+                                           "{\n"
+                                           "int fd = memfd_create(\"mlbf\", 0);\n"
+                                           "int result = fd < 0 || ftruncate(fd, MEMORY_SIZE) < 0 ? -1 : 0;\n"
+                                           "\n"
+                                           "for (int i = 0; i < 3 && result == 0; i++) {\n"
+                                           "if (mmap(copies + i * MEMORY_SIZE, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {\n"
+                                           "result = -1;\n"
+                                           "}\n"
+                                           "}\n"
+                                           "if (fd >= 0) {\n"
+                                           "close(fd);\n"
+                                           "}\n"
+                                           "\n"
+                                           "return result;\n"
+                                           "}\n"
+                                           "\n"
+                                           "void flush_output(void)\n"
+                                           "{\n"
+                                           "size_t written = 0;\n"
+                                           "ssize_t result;\n"
+                                           "\n"
+                                           "while (written < output_size) {\n"
+                                           "result = write(1, output + written, output_size - written);\n"
+                                           "if (result < 0 && errno != EINTR) {\n"
+                                           "break;\n"
+                                           "} else if (result > 0) {\n"
+                                           "written += result;\n"
+                                           "}\n"
+                                           "}\n"
+                                           "output_size = 0;\n"
+                                           "}\n"
+                                           "\n"
+                                           "int fill_input(void)\n"
+                                           "{\n"
+                                           "ssize_t result;\n"
+                                           "\n"
+                                           "flush_output();\n"
+                                           "do {\n"
+                                           "result = read(0, input, sizeof(input));\n"
+                                           "} while (result < 0 && errno == EINTR);\n"
+                                           "if (result <= 0) {\n"
+                                           "return 0;\n"
+                                           "}\n"
+                                           "input_size = result;\n"
+                                           "input_position = 0;\n"
+                                           "\n"
+                                           "return 1;\n"
+                                           "}\n"
+                                           "\n";
 
-void bf_transpile_program(struct bf_program *program, FILE *fp)
+static const char bf_transpile_main_open[] = "int main(void)\n"
+                                             "{\n"
+                                             "uint8_t *p = memory;\n"
+                                             "\n"
+                                             "if (map_memory() < 0) {\n"
+                                             "perror(\"Unable to map memory\");\n"
+                                             "return 1;\n"
+                                             "}\n"
+                                             "\n";
+
+static const char bf_transpile_main_close[] = "\n"
+                                              "flush_output();\n"
+                                              "return 0;\n"
+                                              "}\n";
+
+/**
+ * Writes the C expression for a cell 'offset' cells away from the pointer.
+ * Cells are addressed relative to 'p' so that the C compiler can keep them in
+ * registers. Unless memory is 'mirrored', cells that aren't proven to be
+ * inside of memory wrap around it instead.
+ */
+void bf_transpile_cell(char *buf, size_t size, const struct bf_instruction *instr, int offset, bool mirrored)
 {
-    struct bf_instruction *instr;
+    if (!mirrored && !bf_utils_check_flag(instr->flags, BF_INS_FLAG_BOUNDED)) {
+        snprintf(buf, size, "memory[(uint16_t)(p - memory + %d)]", offset);
+    } else {
+        snprintf(buf, size, "p[%d]", offset);
+    }
+}
 
-    fprintf(fp, "// Generated by mlbf - https://github.com/Reshurum/mlbf\n\n");
-    fprintf(fp, "#include <stdint.h>\n");
-    fprintf(fp, "#include <stdio.h>\n");
-    fprintf(fp, "#include <stdlib.h>\n\n");
+/**
+ * Writes a pointer move. Unless memory is 'mirrored', moves that could leave
+ * memory wrap around it.
+ */
+void bf_transpile_move(FILE *fp, const struct bf_instruction *instr, bool mirrored)
+{
+    int amount;
 
-    fprintf(fp, "int main(int argc, char *argv[])\n{\n");
+    switch (instr->opcode) {
+    case BF_INS_INC_P:
+        amount = 1;
+        break;
+    case BF_INS_DEC_P:
+        amount = -1;
+        break;
+    case BF_INS_SUB_P:
+        amount = -(int)instr->argument;
+        break;
+    default:
+        amount = instr->argument;
+        break;
+    }
 
-    fprintf(fp, "uint8_t *memory = calloc(1, sizeof(int8_t) * %d);\n", BF_MEMORY_SIZE);
-    fprintf(fp, "size_t pointer = 0;\n");
-    fprintf(fp, "uint16_t pointer_holder = 0;\n");
-    fprintf(fp, "int input = 0;\n");
+    if (!mirrored && !bf_utils_check_flag(instr->flags, BF_INS_FLAG_BOUNDED)) {
+        fprintf(fp, "p = memory + (uint16_t)(p - memory + %d);\n", amount);
+    } else {
+        fprintf(fp, "p += %d;\n", amount);
+    }
+}
 
-    fprintf(fp, "if (!memory) {\n");
-    fprintf(fp, "goto error1;\n");
-    fprintf(fp, "}\n");
+/**
+ * Writes the string table of a program, which OUTS instructions write from.
+ */
+void bf_transpile_strings(FILE *fp, const struct bf_program *program)
+{
+    fprintf(fp, "const uint8_t strings[] = {");
+    for (size_t i = 0; i < program->strings_size; i++) {
+        fprintf(fp, "%s0x%02x,", i % 12 == 0 ? "\n" : " ", program->strings[i]);
+    }
+    // Arrays can't be empty in C.
+    fprintf(fp, "%s\n};\n\n", program->strings_size == 0 ? "\n0," : "");
+}
 
-    for (int i = 0; i < program->size; i++) {
-        instr = &program->ir[i];
+/**
+ * Writes the C code of a single instruction.
+ */
+void bf_transpile_instruction(FILE *fp, const struct bf_instruction *instr, bool mirrored)
+{
+    char cell[64];
+    char target[64];
+    char source[64];
+    struct bf_poly poly;
 
-        switch (instr->opcode) {
-        case BF_INS_NOP:
-            break;
-        case BF_INS_IN:
-            fprintf(fp, "if ((input = getchar()) != EOF) {\n");
-            fprintf(fp, "memory[pointer] = input;\n");
-            fprintf(fp, "}\n");
-            break;
-        case BF_INS_OUT:
-            fprintf(fp, "putchar(memory[pointer]);\n");
-            break;
-        case BF_INS_INC_V:
-            fprintf(fp, "memory[pointer]++;\n");
-            break;
-        case BF_INS_DEC_V:
-            fprintf(fp, "memory[pointer]--;\n");
-            break;
-        case BF_INS_ADD_V:
-            fprintf(fp, "memory[pointer] += %d;\n", instr->argument);
-            break;
-        case BF_INS_SUB_V:
-            fprintf(fp, "memory[pointer] -= %d;\n", instr->argument);
-            break;
-        case BF_INS_INC_P:
-            fprintf(fp, "pointer++;\n");
-            break;
-        case BF_INS_DEC_P:
-            fprintf(fp, "pointer--;\n");
-            break;
-        case BF_INS_ADD_P:
-            fprintf(fp, "pointer += %d;\n", instr->argument);
-            break;
-        case BF_INS_SUB_P:
-            fprintf(fp, "pointer -= %d;\n", instr->argument);
-            break;
-        case BF_INS_BRANCH_Z:
-            fprintf(fp, "while (memory[pointer] != 0) {\n");
-            break;
-        case BF_INS_BRANCH_NZ:
-            fprintf(fp, "}\n");
-            break;
-        case BF_INS_JMP:
-            // TODO: Implement if JMP is ever used.
-            break;
-        case BF_INS_HALT:
-            break;
-        case BF_INS_CLEAR:
-            fprintf(fp, "memory[pointer] = 0;\n");
-            break;
-        case BF_INS_COPY:
-            fprintf(fp, "if (memory[pointer] != 0) {\n");
-            fprintf(fp, "pointer_holder = pointer + %d;\n", instr->argument);
-            fprintf(fp, "memory[pointer_holder] = memory[pointer_holder] + memory[pointer];\n");
-            fprintf(fp, "}\n");
-            break;
-        case BF_INS_MUL:
-            fprintf(fp, "if (memory[pointer] != 0) {\n");
-            fprintf(fp, "pointer_holder = pointer + %d;\n", instr->offset);
-            fprintf(fp, "memory[pointer_holder] = memory[pointer_holder] + (%d * memory[pointer]);\n", instr->argument);
+    bf_transpile_cell(cell, sizeof(cell), instr, (int16_t)instr->shift, mirrored);
+
+    switch (instr->opcode) {
+    case BF_INS_NOP:
+        break;
+    case BF_INS_IN:
+        fprintf(fp, "{\n");
+        fprintf(fp, "int c = read_input();\n");
+        fprintf(fp, "if (c != EOF) {\n");
+        fprintf(fp, "%s = c;\n", cell);
+        fprintf(fp, "}\n");
+        fprintf(fp, "}\n");
+        break;
+    case BF_INS_OUT:
+        fprintf(fp, "write_output(%s);\n", cell);
+        break;
+    case BF_INS_INC_V:
+        fprintf(fp, "%s++;\n", cell);
+        break;
+    case BF_INS_DEC_V:
+        fprintf(fp, "%s--;\n", cell);
+        break;
+    case BF_INS_ADD_V:
+        fprintf(fp, "%s += %d;\n", cell, instr->argument);
+        break;
+    case BF_INS_SUB_V:
+        fprintf(fp, "%s -= %d;\n", cell, instr->argument);
+        break;
+    case BF_INS_INC_P:
+    case BF_INS_DEC_P:
+    case BF_INS_ADD_P:
+    case BF_INS_SUB_P:
+        bf_transpile_move(fp, instr, mirrored);
+        break;
+    case BF_INS_BRANCH_Z:
+        // The C compiler can unroll counted loops since their counter doesn't
+        // have to be read.
+        if (bf_utils_check_flag(instr->flags, BF_INS_FLAG_COUNTED)) {
+            fprintf(fp, "for (unsigned trips = %u; trips != 0; trips--) {\n", instr->offset);
+        } else {
+            fprintf(fp, "while (%s != 0) {\n", cell);
+        }
+        break;
+    case BF_INS_BRANCH_NZ:
+        if (mirrored && !bf_utils_check_flag(instr->flags, BF_INS_FLAG_BALANCED)) {
+            fprintf(fp, "if ((size_t)(p - memory) >= MEMORY_SIZE) {\n");
+            fprintf(fp, "p = memory + (uint16_t)(p - memory);\n");
             fprintf(fp, "}\n");
-            break;
-        default:
-            break;
+        }
+        fprintf(fp, "}\n");
+        break;
+    case BF_INS_JMP:
+        // TODO: Implement if JMP is ever used.
+        break;
+    case BF_INS_HALT:
+        break;
+    case BF_INS_CLEAR:
+        fprintf(fp, "%s = 0;\n", cell);
+        break;
+    case BF_INS_COPY:
+        // Adding a zero cell does nothing, so there's no need to branch.
+        bf_transpile_cell(target, sizeof(target), instr, (int16_t)instr->shift + (int16_t)instr->argument, mirrored);
+        fprintf(fp, "%s += %s;\n", target, cell);
+        break;
+    case BF_INS_MUL:
+        bf_transpile_cell(target, sizeof(target), instr, (int16_t)instr->shift + (int16_t)instr->offset, mirrored);
+        fprintf(fp, "%s += %d * %s;\n", target, instr->argument, cell);
+        break;
+    case BF_INS_OUTS:
+        fprintf(fp, "write_string(strings + %u, %u);\n", instr->argument, instr->offset);
+        break;
+    case BF_INS_CLEAR_RANGE:
+        // Constant sizes let the C compiler turn short ranges into stores.
+        if (mirrored || bf_utils_check_flag(instr->flags, BF_INS_FLAG_BOUNDED)) {
+            fprintf(fp, "memset(p + %d, 0, %u);\n", (int16_t)instr->shift, instr->argument);
+        } else {
+            fprintf(fp, "clear_cells(p, %d, %u);\n", (int16_t)instr->shift, instr->argument);
+        }
+        break;
+    case BF_INS_MOVE_BLOCK:
+        fprintf(fp, "p = move_block(p, %d);\n", (int16_t)instr->argument);
+        break;
+    case BF_INS_POLY:
+        bf_program_poly(instr, &poly);
+        bf_transpile_cell(target, sizeof(target), instr, poly.target, mirrored);
+        fprintf(fp, "%s += %d * binomial(%s, %d)", target, poly.factor, cell, poly.degree);
+        if (poly.source != poly.counter) {
+            bf_transpile_cell(source, sizeof(source), instr, poly.source, mirrored);
+            fprintf(fp, " * %s", source);
+        }
+        fprintf(fp, ";\n");
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * Returns the argument of an instruction as far as the C code is concerned.
+ * Branch targets are left out since they only depend on where the loop is.
+ */
+uint32_t bf_transpile_argument(const struct bf_instruction *instr)
+{
+    switch (instr->opcode) {
+    case BF_INS_BRANCH_Z:
+    case BF_INS_BRANCH_NZ:
+    case BF_INS_JMP:
+    case BF_INS_DIVMOD:
+    case BF_INS_PRINT_DEC:
+    case BF_INS_FILTER:
+        return 0;
+    default:
+        return instr->argument;
+    }
+}
+
+/**
+ * Returns true if two instructions compile to the same C code.
+ */
+bool bf_transpile_same_instruction(const struct bf_instruction *a, const struct bf_instruction *b)
+{
+    return a->opcode == b->opcode
+        && bf_transpile_argument(a) == bf_transpile_argument(b)
+        && a->offset == b->offset
+        && a->shift == b->shift
+        && a->flags == b->flags;
+}
+
+/**
+ * Hashes the instructions of a loop with FNV-1a, in the same way that
+ * 'bf_transpile_same_instruction' compares them.
+ */
+uint64_t bf_transpile_hash_loop(const struct bf_program *program, size_t start, size_t end)
+{
+    const struct bf_instruction *instr;
+    uint64_t hash = 14695981039346656037ULL;
+    uint64_t fields[4];
+
+    for (size_t i = start; i <= end; i++) {
+        instr = &program->ir[i];
+        fields[0] = instr->opcode;
+        fields[1] = bf_transpile_argument(instr);
+        fields[2] = instr->offset;
+        fields[3] = (uint64_t)instr->shift << 16 | instr->flags;
+
+        for (size_t j = 0; j < 4; j++) {
+            hash ^= fields[j];
+            hash *= 1099511628211ULL;
         }
     }
 
-    fprintf(fp, "\nfree(memory);\n");
-    fprintf(fp, "return 0;\n\n");
-    fprintf(fp, "error1:\n");
-    fprintf(fp, "return 1;\n");
-    fprintf(fp, "}\n");
+    return hash;
+}
+
+/**
+ * Returns the function for the loop from 'start' to 'end', adding a new one
+ * unless an identical loop already has a function.
+ */
+size_t bf_transpile_outline(struct bf_transpiler *t, size_t start, size_t end)
+{
+    const struct bf_transpile_function *function;
+    uint64_t hash = bf_transpile_hash_loop(t->program, start, end);
+    size_t slot = hash & (t->table_size - 1);
+    size_t k;
+
+    for (; t->table[slot]; slot = (slot + 1) & (t->table_size - 1)) {
+        function = &t->functions[t->table[slot] - 1];
+        if (function->hash != hash || function->end - function->start != end - start) {
+            continue;
+        }
+
+        for (k = 0; k <= end - start; k++) {
+            if (!bf_transpile_same_instruction(&t->program->ir[function->start + k], &t->program->ir[start + k])) {
+                break;
+            }
+        }
+        if (k > end - start) {
+            return t->table[slot] - 1;
+        }
+    }
+
+    t->functions[t->function_count] = (struct bf_transpile_function){
+        .hash = hash,
+        .start = start,
+        .end = end,
+        .shard = 0,
+    };
+    t->table[slot] = ++t->function_count;
+
+    return t->function_count - 1;
+}
+
+/**
+ * Returns how many instructions are written for the code from 'start' up to
+ * 'end', counting nested functions as a single call.
+ */
+size_t bf_transpile_range_size(const struct bf_transpiler *t, size_t start, size_t end)
+{
+    size_t size = 0;
+
+    for (size_t i = start; i <= end; i++, size++) {
+        if (t->outlined[i]) {
+            i = t->program->ir[i].argument - 1;
+        }
+    }
+
+    return size;
+}
+
+/**
+ * Writes the code from 'start' up to 'end', calling the functions of any
+ * outlined loops in between.
+ */
+void bf_transpile_range(FILE *fp, const struct bf_transpiler *t, size_t start, size_t end)
+{
+    for (size_t i = start; i <= end; i++) {
+        if (t->outlined[i]) {
+            fprintf(fp, "p = loop_%zu(p);\n", t->outlined[i] - 1);
+            i = t->program->ir[i].argument - 1;
+        } else {
+            bf_transpile_instruction(fp, &t->program->ir[i], t->mirrored);
+        }
+    }
+}
+
+/**
+ * Finds the loops to outline and spreads their functions over 'count' shards,
+ * keeping the number of instructions in each about even. Returns false if
+ * memory couldn't be allocated.
+ */
+bool bf_transpile_plan(struct bf_transpiler *t, size_t count)
+{
+    const struct bf_program *program = t->program;
+    size_t loops = 0;
+    size_t *load;
+    size_t end;
+    size_t lightest;
+
+    for (size_t i = 0; i < program->size; i++) {
+        loops += program->ir[i].opcode == BF_INS_BRANCH_Z;
+    }
+    for (t->table_size = 1; t->table_size < loops * 2; t->table_size *= 2) { }
+
+    t->outlined = calloc(program->size + 1, sizeof(size_t));
+    t->functions = malloc(sizeof(struct bf_transpile_function) * (loops + 1));
+    t->table = calloc(t->table_size, sizeof(size_t));
+    load = calloc(count, sizeof(size_t));
+    if (!t->outlined || !t->functions || !t->table || !load) {
+        free(load);
+        return false;
+    }
+
+    // Outer loops come first, so a function is always added before the
+    // functions of the loops nested in it.
+    for (size_t i = 0; i < program->size; i++) {
+        end = program->ir[i].argument - 1;
+        if (program->ir[i].opcode == BF_INS_BRANCH_Z && end - i >= BF_TRANSPILE_OUTLINE_SIZE) {
+            t->outlined[i] = bf_transpile_outline(t, i, end) + 1;
+        }
+    }
+
+    load[0] = bf_transpile_range_size(t, 0, program->size - 1);
+    for (size_t f = 0; f < t->function_count; f++) {
+        lightest = 0;
+        for (size_t k = 1; k < count; k++) {
+            lightest = load[k] < load[lightest] ? k : lightest;
+        }
+
+        t->functions[f].shard = lightest;
+        load[lightest] += bf_transpile_range_size(t, t->functions[f].start + 1, t->functions[f].end - 1) + 2;
+    }
+
+    free(load);
+
+    return true;
+}
+
+/**
+ * Writes a single output file. The first one also gets the runtime and main.
+ */
+void bf_transpile_shard(FILE *fp, const struct bf_transpiler *t, size_t shard, size_t count)
+{
+    const struct bf_transpile_function *function;
+    // Functions are only visible to the other files when there are any.
+    const char *linkage = count > 1 ? "" : "static ";
+
+    fprintf(fp, "// Generated by mlbf - https://github.com/Reshurum/mlbf\n\n");
+    fprintf(fp, bf_transpile_header, BF_MEMORY_SIZE, BF_TRANSPILE_BUFFER_SIZE);
+
+    // Functions only called once would be inlined back into their caller.
+    for (size_t f = 0; f < t->function_count; f++) {
+        fprintf(fp, "%s__attribute__((noinline)) uint8_t *loop_%zu(uint8_t *p);\n", linkage, f);
+    }
+    if (t->function_count > 0) {
+        fprintf(fp, "\n");
+    }
+
+    if (shard == 0) {
+        fputs(bf_transpile_runtime, fp);
+        bf_transpile_strings(fp, t->program);
+    }
+
+    for (size_t f = 0; f < t->function_count; f++) {
+        function = &t->functions[f];
+        if (function->shard != shard) {
+            continue;
+        }
+
+        fprintf(fp, "%suint8_t *loop_%zu(uint8_t *p)\n{\n", linkage, f);
+        bf_transpile_instruction(fp, &t->program->ir[function->start], t->mirrored);
+        bf_transpile_range(fp, t, function->start + 1, function->end - 1);
+        bf_transpile_instruction(fp, &t->program->ir[function->end], t->mirrored);
+        fprintf(fp, "return p;\n}\n\n");
+    }
+
+    if (shard == 0) {
+        fputs(bf_transpile_main_open, fp);
+        bf_transpile_range(fp, t, 0, t->program->size - 1);
+        fputs(bf_transpile_main_close, fp);
+    }
+}
+
+bool bf_transpile_program(struct bf_program *program, FILE *fp)
+{
+    return bf_transpile_sharded(program, &fp, 1);
+}
+
+bool bf_transpile_sharded(struct bf_program *program, FILE **files, size_t count)
+{
+    struct bf_transpiler t = { .program = program };
+    bool result = false;
+
+    // The pointer is only brought back into the middle copy of memory at the
+    // end of loops that aren't balanced. In between it mustn't leave the copies
+    // on either side, otherwise every move has to wrap.
+    t.mirrored = bf_program_drift(program) <= BF_MEMORY_SIZE;
+
+    if (!bf_transpile_plan(&t, count)) {
+        goto cleanup;
+    }
+    for (size_t k = 0; k < count; k++) {
+        bf_transpile_shard(files[k], &t, k, count);
+    }
+    result = true;
+
+cleanup:
+    free(t.table);
+    free(t.functions);
+    free(t.outlined);
+
+    return result;
 }
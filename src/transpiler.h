@@ -18,13 +18,58 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+
 #ifndef BF_TRANSPILER_H
 #define BF_TRANSPILER_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #include "program.h"
 
-void bf_transpile_program(struct bf_program *program, FILE *fp);
+/**
+ * Loops with at least this many instructions are emitted as functions of
+ * their own. C compilers take much longer to optimize one huge function than
+ * many small ones, and a call is cheap next to a loop this size.
+ */
+#define BF_TRANSPILE_OUTLINE_SIZE 1024
+
+/**
+ * A loop that's emitted as a function. Loops with identical instructions
+ * share a function, which is the one of the first such loop.
+ */
+struct bf_transpile_function {
+    uint64_t hash;
+    size_t start; // Index of the BRANCH_Z of the first loop.
+    size_t end; // Index of its BRANCH_NZ.
+    size_t shard; // Which of the output files the function is written to.
+};
+
+/**
+ * State of a single call to 'bf_transpile_sharded'.
+ */
+struct bf_transpiler {
+    const struct bf_program *program;
+    bool mirrored; // See 'bf_transpile_sharded'.
+    size_t *outlined; // Function index plus one of every outlined BRANCH_Z.
+    struct bf_transpile_function *functions;
+    size_t function_count;
+    size_t *table; // Open addressing hash table of function indices plus one.
+    size_t table_size;
+};
+
+/**
+ * Writes a C program that does the same as 'program' to 'fp'. Returns false if
+ * memory couldn't be allocated.
+ */
+bool bf_transpile_program(struct bf_program *program, FILE *fp);
+
+/**
+ * Like 'bf_transpile_program', but spreads the functions of the program over
+ * 'count' files so they can be compiled in parallel. The first file also gets
+ * the runtime and main, and the files have to be linked together.
+ */
+bool bf_transpile_sharded(struct bf_program *program, FILE **files, size_t count);
 
 #endif
@@ -38,6 +38,49 @@ static inline bool bf_utils_check_flag(uint32_t flags, uint32_t flag)
     return (flags & flag) != 0;
 }
 
+/**
+ * Returns the binomial coefficient C(n, k) modulo 256. Every intermediate
+ * value is exact in 64 bits as long as 'k' is at most 10.
+ */
+static inline uint8_t bf_utils_binomial(uint8_t n, uint8_t k)
+{
+    uint64_t result = 1;
+
+    if (k > n) {
+        return 0;
+    }
+    for (uint64_t i = 0; i < k; i++) {
+        result = result * (n - i) / (i + 1);
+    }
+
+    return result;
+}
+
+/**
+ * Returns the peak resident set size of the current process in KiB, or 0 if it
+ * can't be determined. Linux exposes this per address space in /proc so the
+ * value isn't inherited from whatever process spawned mlbf.
+ */
+static inline size_t bf_utils_peak_rss_kb()
+{
+    FILE *fp;
+    char line[128];
+    size_t kb = 0;
+
+    fp = fopen("/proc/self/status", "r");
+    if (!fp) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "VmHWM: %zu kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(fp);
+
+    return kb;
+}
+
 /**
  * Portable implementation of strdup.
  */
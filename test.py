@@ -22,7 +22,10 @@
 
 import glob
 import os
+import shutil
 import subprocess
+import tempfile
+import time
 
 MLBF_PATH = './builddir/mlbf'
 MLBF_TEST_DIR = './tests'
@@ -39,6 +42,10 @@ def test_mlbf():
     for script in scripts:
         test_script(*generate_script_names(script))
 
+    test_idioms()
+    test_batch()
+    test_server()
+
 
 def generate_script_names(fpath):
     filename, extension = os.path.splitext(fpath)
@@ -59,6 +66,82 @@ def mlbf_exists():
     return os.path.isfile(MLBF_PATH)
 
 
+def test_idioms():
+    """Checks the native idioms against the brainfuck code they replace."""
+
+    pipe = subprocess.Popen([MLBF_PATH, '--verify-idioms'], stdout=subprocess.DEVNULL)
+    pipe.communicate()
+
+    if pipe.returncode != 0:
+        raise RuntimeError("Got non-zero exit code ({}) from mlbf --verify-idioms.".format(pipe.returncode))
+
+
+def test_batch():
+    """Runs every script with --batch, over parts of its input if it has any,
+    and compares each output with a regular run on the same input."""
+
+    for script in glob.glob(os.path.join(MLBF_TEST_DIR, '*.b')):
+        _, input, _ = generate_script_names(script)
+        data = b''
+        if os.path.isfile(input):
+            with open(input, 'rb') as f:
+                data = f.read()
+        parts = [data[:len(data) * i // 4] for i in range(5)]
+
+        workdir = tempfile.mkdtemp()
+        try:
+            paths = []
+            for i, part in enumerate(parts):
+                paths.append(os.path.join(workdir, 'input{}'.format(i)))
+                with open(paths[-1], 'wb') as f:
+                    f.write(part)
+
+            pipe = subprocess.Popen([MLBF_PATH, '--batch', script] + paths)
+            pipe.communicate()
+            if pipe.returncode != 0:
+                raise RuntimeError("Got non-zero exit code ({}) from mlbf --batch.".format(pipe.returncode))
+
+            for path, part in zip(paths, parts):
+                expected_data = subprocess.run([MLBF_PATH, script], input=part, stdout=subprocess.PIPE).stdout
+                with open(path + '.out', 'rb') as f:
+                    output_data = f.read()
+                if expected_data != output_data:
+                    raise RuntimeError("Expected -> {}, Got -> {}".format(expected_data, output_data))
+        finally:
+            shutil.rmtree(workdir)
+
+
+def test_server():
+    """Checks that --max-steps stops jobs that never end, including ones stuck
+    in a single instruction, and that the worker is free again afterwards."""
+
+    workdir = tempfile.mkdtemp()
+    socket = os.path.join(workdir, 'socket')
+    server = subprocess.Popen([MLBF_PATH, '--serve', socket, '-j', '1'], stderr=subprocess.DEVNULL)
+    try:
+        for _ in range(100):
+            if os.path.exists(socket):
+                break
+            time.sleep(0.05)
+
+        # Fills every cell, then moves the block with MOVE_BLOCK forever.
+        scripts = [('->+[>+]+[[-<+>]>]', 1, b''), ('+[]', 1, b''), ('++++++++[>+++++++++<-]>.', 0, b'H')]
+        for source, returncode, output in scripts:
+            path = os.path.join(workdir, 'script.b')
+            with open(path, 'w') as f:
+                f.write(source)
+
+            pipe = subprocess.run([MLBF_PATH, '--connect', socket, '--max-steps', '1000000', path],
+                                  stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, timeout=10)
+            if pipe.returncode != returncode or pipe.stdout != output:
+                raise RuntimeError("Got exit code {} and {} from mlbf --connect for '{}'.".format(
+                    pipe.returncode, pipe.stdout, source))
+    finally:
+        server.kill()
+        server.wait()
+        shutil.rmtree(workdir)
+
+
 def test_script(source, input, output):
     """Executes a brainfuck script and tests the output."""
 
@@ -0,0 +1,9 @@
+Balanced loops leave the pointer where they found it so every cell in their
+body sits at a fixed distance from it
+
+++++++++[>++++++++>+++++>+<<<-]         c1 = 64 and c2 = 40 and c3 = 8
+>>>[<<+.>>-]                            prints ABCDEFGH from c1
+++++[<<<+++[>>+<<-]>>>-]                nested loop adds 12 to c2 through c0
+<.                                      prints 4
+>>>+++[<<<<+.-->>>>-]                   prints IHG from c1
+++++++++++.                             prints newline
@@ -0,0 +1,5 @@
+Loops that read a byte at the end of every iteration run over whole buffers of
+input at a time
+
+,[.[-],]                                copies input up to the first zero byte
+,[+.[-],]                               adds one to every byte after it
@@ -0,0 +1,13 @@
+Loops whose counter goes down by one every iteration and whose other cells only
+change by sums of cells are replaced by their closed form which may be a polynomial
+of the counter
+
+++++++++++[[->+>+<<]>>[-<<+>>]<<-]                                                                  c1 = 1 plus 2 up to 10 = 55
+>++++++++++.                                                                                        c1 = 65 prints A
+>>+++++++[[->+>+<<]>>[-<<+>>]<[[->>+>+<<<]>>>[-<<<+>>>]<<<-]<-]                                     c6 = 84 from sums of sums up to 7
+>>>.                                                                                                prints T
+<<<<<[-]>>>>>[-]<<<<<<                                                                              clears c1 and c6
+++++++[>[>+<-]+++++++++++<-]                                                                        c2 = 55 since c1 only holds 11 after the first round
+>>++++++++++++++.                                                                                   c2 = 69 prints E
+<+++[>+<-]>.                                                                                        c1 = 14 so c2 = 83 prints S
+++++++++++[-]++++++++++.                                                                            prints a newline
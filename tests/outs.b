@@ -0,0 +1,12 @@
+Runs of instructions that only write constant bytes become a single
+instruction which leaves the cells as the run would have
+
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++.                           c0 = 72 prints H
++++++++++++++++++++++++++++++++++.                                                                  c0 = 105 prints i
+>++++++++++++++++++++++++++++++++.                                                                  c1 = 32 prints a space
+[->+>+<<]>>.                                                                                        moves c1 to c2 and c3 and prints a space
+<+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++.           c2 = 119 prints w
+--------.                                                                                           c2 = 111 prints o
+[-]++++++++++.                                                                                      c2 = 10 prints a newline
+<<[-]+++[>>>.<<<-]                                                                                  c0 = 3 so the loop prints c3 three times
+>>.>.                                                                                               prints the newline in c2 and a space from c3
@@ -0,0 +1,13 @@
+Runs of clears on neighbouring cells become a single CLEAR_RANGE and loops that
+move a block of cells over by one become MOVE_BLOCK
+
+++++++++[>++++++++<-]>+                                                                             c1 = 65
+[>+>+>+<<<-]>>>[<<<+>>>-]<<<                                                                        c1 = 65 and c2 = c3 = 65
+>[-]>[-]>+++++++++<<                                                                                clears c2 and c3 and c4 = 9
+<.>>>.                                                                                              prints A and a tab from c4
+<<<[[-<+>]>]                                                                                        moves c1 into c0 and stops at c2
+<<.>>                                                                                               prints A from c0
+<<[[->+<]<]                                                                                         moves c0 back into c1 and stops at the last cell of memory which is zero
+>>.                                                                                                 prints A from c1
+<<[-]>[-]>[-]>[-]+++++++++[<++++++>-]<--.                                                           clears from the last cell of memory up to c3 and prints 4
+>[-]++++++++++.                                                                                     prints a newline
@@ -0,0 +1,16 @@
+Loops whose counter is known when they're entered run a known number of times so short ones are
+unrolled while loops that never run are dropped and the rest don't test their counter when entered
+
+[.,]                                                                                                c0 is zero so this loop never runs
+>++++++++[<++++++>-]<                                                                               c0 = 48
+>++++++++++[<.+>-]                                                                                  c1 = 10 so the loop is unrolled and prints 0123456789
+<++++++++++++++++.                                                                                  c0 = 74 prints J
+[-]>>++++++++[<++++++++>-]<+                                                                        c0 = 0 and c1 = 65
+<++++++++++++++++++++++++++[>.+<-]                                                                  c0 = 26 and the loop prints A to Z
+>[-]++++++++++.                                                                                     c1 = 10 prints a newline
+<+++++++[>+++++.-----<+++]                                                                          c0 = 7 goes up by 3 so the loop prints 83 cells of 15
+>.                                                                                                  prints a newline
+<+++[>>++++[<<+>>-]<-<-]                                                                            nested loop is entered three times with c2 = 4 and adds 12 to c0
+>++++++++++++++++++++++++++++++++++++++.                                                            c1 = 48 prints 0
+<+[>+.<[-]]                                                                                         c0 = 13 is cleared so the loop runs once and prints 1
+>[-]++++++++++.                                                                                     prints a newline
@@ -0,0 +1,7 @@
+Memory wraps around at both ends so moving left from the first cell lands on
+the last one
+
+<++++++++[>++++++++<-]>+.        multiply across the edge into cell 0
+<+<+[>]<+.                       scan right across the edge
+<<<<<+++++[>>>>>+<<<<<-]>>>>>.   copy across the edge into cell 0
+>[-]++++++++++.
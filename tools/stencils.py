@@ -0,0 +1,260 @@
+#!/usr/bin/env python3
+
+# Copyright (c) 2017 Walter Kuppens
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+"""Builds the stencils of the JIT (see src/jit.h) into a C include file.
+
+src/stencils.c is compiled into an object file with one section per stencil.
+The machine code of each section is written out as a byte array, along with
+where the relocations against the BF_HOLE_* symbols are so that mlbf can
+patch them. Stencils that end by jumping to the next instruction have the
+jump removed so that they fall through instead.
+
+Usage: stencils.py INPUT OUTPUT [-I DIR...] -- CC [CC ARGS...]
+"""
+
+import argparse
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+CFLAGS = [
+    '-std=c11',
+    '-O2',
+    '-c',
+    '-fno-pic',
+    '-mcmodel=small',
+    '-ffunction-sections',
+    '-fno-asynchronous-unwind-tables',
+    '-fno-stack-protector',
+    '-fcf-protection=none',
+    '-fno-jump-tables',
+    '-falign-jumps=1',
+    '-falign-labels=1',
+]
+
+STENCIL_PREFIX = 'bf_stencil_'
+SECTION_PREFIX = '.text.' + STENCIL_PREFIX
+
+HOLES = {
+    'BF_HOLE_ARGUMENT': 'BF_JIT_HOLE_ARGUMENT',
+    'BF_HOLE_SHIFT': 'BF_JIT_HOLE_SHIFT',
+    'BF_HOLE_OFFSET': 'BF_JIT_HOLE_OFFSET',
+    'BF_HOLE_CONTINUE': 'BF_JIT_HOLE_CONTINUE',
+    'BF_HOLE_JUMP': 'BF_JIT_HOLE_JUMP',
+}
+
+R_X86_64_PC32 = 2
+R_X86_64_PLT32 = 4
+R_X86_64_32 = 10
+R_X86_64_32S = 11
+
+PATCHES = {
+    R_X86_64_PC32: 'BF_JIT_PATCH_REL32',
+    R_X86_64_PLT32: 'BF_JIT_PATCH_REL32',
+    R_X86_64_32: 'BF_JIT_PATCH_ABS32',
+    R_X86_64_32S: 'BF_JIT_PATCH_ABS32',
+}
+
+JMP_REL32 = 0xe9
+JCC_REL8 = range(0x70, 0x80)
+
+
+class Hole:
+    def __init__(self, offset, value, patch, addend):
+        self.offset = offset
+        self.value = value
+        self.patch = patch
+        self.addend = addend
+
+
+def read_sections(data):
+    """Returns the sections of an ELF64 object as (name, header) tuples, where
+    the header holds (type, offset, size, link, info)."""
+
+    if data[:4] != b'\x7fELF' or data[4] != 2 or data[5] != 1:
+        raise RuntimeError('Stencils have to be a little endian ELF64 object.')
+
+    shoff, = struct.unpack_from('<Q', data, 0x28)
+    shentsize, shnum, shstrndx = struct.unpack_from('<HHH', data, 0x3a)
+    headers = []
+    for i in range(shnum):
+        name, kind, _, _, offset, size, link, info = struct.unpack_from(
+            '<IIQQQQII', data, shoff + i * shentsize)
+        headers.append((name, (kind, offset, size, link, info)))
+
+    names = headers[shstrndx][1]
+    return [(read_string(data, names[1] + name), header) for name, header in headers]
+
+
+def read_string(data, offset):
+    return data[offset:data.index(b'\0', offset)].decode()
+
+
+def read_symbols(data, sections, index):
+    """Returns the names of the symbols in a symbol table section."""
+
+    _, offset, size, link, _ = sections[index][1]
+    strings = sections[link][1][1]
+    names = []
+    for entry in range(offset, offset + size, 24):
+        name, = struct.unpack_from('<I', data, entry)
+        names.append(read_string(data, strings + name))
+    return names
+
+
+def read_stencils(data):
+    """Returns a dictionary of stencil names to their code and holes."""
+
+    SHT_RELA = 4
+
+    sections = read_sections(data)
+    stencils = {}
+    for name, (_, offset, size, _, _) in sections:
+        if name.startswith(SECTION_PREFIX):
+            stencils[name[len(SECTION_PREFIX):]] = (bytearray(data[offset:offset + size]), [])
+
+    for name, (kind, offset, size, link, info) in sections:
+        if kind != SHT_RELA:
+            continue
+        target = sections[info][0]
+        if not target.startswith(SECTION_PREFIX):
+            continue
+
+        stencil = target[len(SECTION_PREFIX):]
+        symbols = read_symbols(data, sections, link)
+        for entry in range(offset, offset + size, 24):
+            where, type_info, addend = struct.unpack_from('<QQq', data, entry)
+            symbol, kind = symbols[type_info >> 32], type_info & 0xffffffff
+            if symbol not in HOLES or kind not in PATCHES:
+                raise RuntimeError("Stencil '{}' has an unsupported relocation of type {} against '{}'.".format(
+                    stencil, kind, symbol))
+            stencils[stencil][1].append(Hole(where, HOLES[symbol], PATCHES[kind], addend))
+
+    for code, holes in stencils.values():
+        holes.sort(key=lambda hole: hole.offset)
+    return stencils
+
+
+def jump_hole(code, holes, offset):
+    """Returns the hole of a 'jmp rel32' at 'offset', or None."""
+
+    if offset < 0 or code[offset] != JMP_REL32:
+        return None
+    for hole in holes:
+        if hole.offset == offset + 1 and hole.patch == 'BF_JIT_PATCH_REL32':
+            return hole
+    return None
+
+
+def fall_through(code, holes):
+    """Removes the jump to the next instruction at the end of a stencil.
+
+    Branches come out of the compiler as a short jcc over one jmp followed by
+    another, and become a single near jcc to the target that isn't the next
+    instruction.
+    """
+
+    last = jump_hole(code, holes, len(code) - 5)
+    if last is None:
+        return code, holes
+
+    other = jump_hole(code, holes, len(code) - 10)
+    if other is not None and len(code) >= 12 and code[-12] in JCC_REL8 and code[-11] == 5:
+        condition = code[-12] & 0xf
+        if last.value == 'BF_JIT_HOLE_CONTINUE':
+            # The jcc skips to the jump to the next instruction, so the other
+            # jump is taken when the condition is false.
+            target = other
+            condition ^= 1
+        elif other.value == 'BF_JIT_HOLE_CONTINUE':
+            target = last
+        else:
+            return code, holes
+
+        start = len(code) - 12
+        target.offset = start + 2
+        holes = [hole for hole in holes if hole.offset < start] + [target]
+        return code[:start] + bytes([0x0f, 0x80 | condition, 0, 0, 0, 0]), holes
+
+    if last.value == 'BF_JIT_HOLE_CONTINUE':
+        holes = [hole for hole in holes if hole is not last]
+        return code[:-5], holes
+
+    return code, holes
+
+
+def write_stencils(stencils, fp):
+    fp.write('// Generated by tools/stencils.py from src/stencils.c, do not edit.\n\n')
+
+    for name, (code, holes) in stencils.items():
+        fp.write('static const uint8_t {}{}_code[] = {{'.format(STENCIL_PREFIX, name))
+        for i, byte in enumerate(code):
+            fp.write('{}0x{:02x},'.format('\n    ' if i % 12 == 0 else ' ', byte))
+        fp.write('\n};\n\n')
+
+        if holes:
+            fp.write('static const struct bf_jit_hole {}{}_holes[] = {{\n'.format(STENCIL_PREFIX, name))
+            for hole in holes:
+                fp.write('    {{ {}, {}, {}, {} }},\n'.format(hole.offset, hole.value, hole.patch, hole.addend))
+            fp.write('};\n\n')
+
+    fp.write('static const struct bf_jit_stencil bf_jit_stencils[BF_JIT_STENCIL_COUNT] = {\n')
+    for name, (code, holes) in stencils.items():
+        fp.write('    [BF_JIT_STENCIL_{}] = {{ {}{}_code, {}, {}, {} }},\n'.format(
+            name.upper(), STENCIL_PREFIX, name, len(code),
+            STENCIL_PREFIX + name + '_holes' if holes else 'NULL', len(holes)))
+    fp.write('};\n')
+
+
+def main():
+    # Everything after '--' is the compiler, which meson passes as a list.
+    argv = sys.argv[1:]
+    split = argv.index('--') if '--' in argv else len(argv)
+    cc = argv[split + 1:] or ['cc']
+
+    parser = argparse.ArgumentParser(description='Builds the stencils of the JIT.')
+    parser.add_argument('input')
+    parser.add_argument('output')
+    parser.add_argument('-I', dest='include', action='append', default=[])
+    args = parser.parse_args(argv[:split])
+
+    with tempfile.TemporaryDirectory() as workdir:
+        obj = os.path.join(workdir, 'stencils.o')
+        subprocess.check_call(cc + CFLAGS + ['-I' + path for path in args.include] + [args.input, '-o', obj])
+        with open(obj, 'rb') as f:
+            stencils = read_stencils(f.read())
+
+    for name, (code, holes) in stencils.items():
+        stencils[name] = fall_through(code, holes)
+
+    with open(args.output, 'w') as fp:
+        write_stencils(stencils, fp)
+
+
+if __name__ == '__main__':
+    try:
+        main()
+    except RuntimeError as e:
+        print(e, file=sys.stderr)
+        sys.exit(1)